@@ -4,6 +4,10 @@
 
 #include <libavformat/avformat.h>
 #include "common.h"
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
 
 using std::ifstream;
 using string = std::string;
@@ -74,12 +78,66 @@ namespace nvr {
         // Get optional fields
         string sub_stream_url =  config["streamURL"];
         string hardware_enc_priority = "none";
+        string egress_sink = "udpsink";
         int port = 554;
+        int rtp_port = 0;
+        int whep_port = 0;
+        bool janus_enabled = true;
+        bool keyframe_on_demand = true;
+        LatencyProfile latency = getLatencyProfile("default");
+        std::vector<string> codecs = {"vp8"};
+        string codec_preset = "balanced";
+        FrameTapConfig frame_tap = {false, "I420", 0, 0, 0, 4};
+        bool snapshot_server = false;
+        int snapshot_quality = 85;
+        AnalysisConfig analysis = {false, 10, 24, 40, 300};
+        int trace_interval = 0;
+        bool metrics_enabled = false;
+        int metrics_port = 0;
+        bool activity_index = false;
+        MotionConfig motion = {false, 5, 12, 2, 10, {}};
+        CompactionConfig compaction = {false, 3600, 600};
+        int64_t ring_size = 0;
+        UploadConfig upload = {false, "", 0, 8, {}, ""};
         long snapshot_interval = config["splitEvery"];
 
         if (config.contains("port"))
             port = config["port"];
 
+        if (config.contains("rtpPort"))
+            rtp_port = config["rtpPort"];
+
+        if (config.contains("whepPort"))
+            whep_port = config["whepPort"];
+
+        if (config.contains("janus"))
+            janus_enabled = config["janus"];
+
+        if (config.contains("keyframeOnDemand"))
+            keyframe_on_demand = config["keyframeOnDemand"];
+
+        if (config.contains("latencyProfile"))
+            latency = getLatencyProfile(config["latencyProfile"].get<string>());
+
+        // Per-camera overrides on top of the profile
+        if (config.contains("latency")) {
+            json overrides = config["latency"];
+
+            latency.jitter_buffer_ms = overrides.value("jitterBuffer", latency.jitter_buffer_ms);
+            latency.drop_on_latency = overrides.value("dropOnLatency", latency.drop_on_latency);
+            latency.protocols = overrides.value("protocols", latency.protocols);
+            latency.low_latency_decode = overrides.value("lowLatencyDecode", latency.low_latency_decode);
+            latency.encoder_deadline = overrides.value("encoderDeadline", latency.encoder_deadline);
+            latency.lag_in_frames = overrides.value("lagInFrames", latency.lag_in_frames);
+            latency.b_frames = overrides.value("bFrames", latency.b_frames);
+            latency.max_lateness_ms = overrides.value("maxLateness", latency.max_lateness_ms);
+            latency.encode_queue_buffers = overrides.value("encodeQueue", latency.encode_queue_buffers);
+            latency.encode_queue_leaky = overrides.value("encodeQueueLeaky", latency.encode_queue_leaky);
+        }
+
+        if (config.contains("measureLatency"))
+            latency.measure = config["measureLatency"];
+
         if (config.contains("subStreamURL"))
             sub_stream_url = config["subStreamURL"];
 
@@ -89,6 +147,126 @@ namespace nvr {
         if (config.contains("hardwareEncoderPriority"))
             hardware_enc_priority = config["hardwareEncoderPriority"];
 
+        if (config.contains("egressSink"))
+            egress_sink = config["egressSink"];
+
+        // Either one codec or every codec the viewers can play, the cheapest one is used
+        if (config.contains("codec")) {
+            if (config["codec"].is_array())
+                codecs = config["codec"].get<std::vector<string>>();
+            else
+                codecs = {config["codec"].get<string>()};
+        }
+
+        if (config.contains("codecPreset"))
+            codec_preset = config["codecPreset"];
+
+        if (config.contains("snapshotServer"))
+            snapshot_server = config["snapshotServer"];
+
+        if (config.contains("snapshotQuality"))
+            snapshot_quality = config["snapshotQuality"];
+
+        if (config.contains("videoAnalysis")) {
+            json settings = config["videoAnalysis"];
+
+            if (settings.is_boolean()) {
+                analysis.enabled = settings;
+            } else {
+                analysis.enabled = settings.value("enabled", true);
+                analysis.freeze_seconds = settings.value("freezeSeconds", analysis.freeze_seconds);
+                analysis.black_level = settings.value("blackLevel", analysis.black_level);
+                analysis.tamper_level = settings.value("tamperLevel", analysis.tamper_level);
+                analysis.tamper_rebase_seconds = settings.value("tamperRebaseSeconds",
+                                                                analysis.tamper_rebase_seconds);
+            }
+        }
+
+        // true for the default 10 second interval, or the interval in seconds
+        if (config.contains("trace")) {
+            if (config["trace"].is_boolean())
+                trace_interval = config["trace"] ? 10 : 0;
+            else
+                trace_interval = config["trace"];
+        }
+
+        // true for /tmp/nvr-metrics-<id>.sock, or a loopback TCP port
+        if (config.contains("metrics")) {
+            if (config["metrics"].is_boolean()) {
+                metrics_enabled = config["metrics"];
+            } else {
+                metrics_enabled = true;
+                metrics_port = config["metrics"];
+            }
+        }
+
+        if (config.contains("activityIndex"))
+            activity_index = config["activityIndex"];
+
+        if (config.contains("motion")) {
+            json settings = config["motion"];
+
+            if (settings.is_boolean()) {
+                motion.enabled = settings;
+            } else {
+                motion.enabled = settings.value("enabled", true);
+                motion.fps = settings.value("fps", motion.fps);
+                motion.sensitivity = settings.value("sensitivity", motion.sensitivity);
+                motion.min_blocks = settings.value("minBlocks", motion.min_blocks);
+                motion.post_roll = settings.value("postRoll", motion.post_roll);
+
+                if (settings.contains("mask")) {
+                    for (const auto &region: settings["mask"])
+                        motion.mask.push_back({region[0], region[1], region[2], region[3]});
+                }
+            }
+        }
+
+        if (config.contains("compact")) {
+            json settings = config["compact"];
+
+            if (settings.is_boolean()) {
+                compaction.enabled = settings;
+            } else {
+                compaction.enabled = settings.value("enabled", true);
+                compaction.window = settings.value("window", compaction.window);
+                compaction.delay = settings.value("after", compaction.delay);
+            }
+        }
+
+        // Megabytes, a single pre-allocated file instead of one file per clip
+        if (config.contains("ring"))
+            ring_size = config["ring"].get<int64_t>() * 1024 * 1024;
+
+        if (config.contains("upload")) {
+            json settings = config["upload"];
+
+            upload.url = settings.value("url", "");
+            upload.enabled = !upload.url.empty() && settings.value("enabled", true);
+            upload.rate_limit = settings.value("rateLimit", upload.rate_limit);
+            upload.chunk_size = settings.value("chunkSize", upload.chunk_size);
+            upload.authorization = settings.value("authorization", "");
+
+            // "HH:MM" pairs, local time
+            for (const auto &window: settings.value("windows", json::array())) {
+                int start_hour = 0, start_minute = 0, end_hour = 0, end_minute = 0;
+                sscanf(window[0].get<string>().c_str(), "%d:%d", &start_hour, &start_minute);
+                sscanf(window[1].get<string>().c_str(), "%d:%d", &end_hour, &end_minute);
+                upload.windows.push_back({start_hour * 60 + start_minute, end_hour * 60 + end_minute});
+            }
+        }
+
+        if (config.contains("frameTap")) {
+            json tap = config["frameTap"];
+
+            frame_tap.enabled = tap.value("enabled", true);
+            frame_tap.format = tap.value("format", frame_tap.format);
+            frame_tap.width = tap.value("width", frame_tap.width);
+            frame_tap.height = tap.value("height", frame_tap.height);
+            frame_tap.max_fps = tap.value("fps", frame_tap.max_fps);
+            frame_tap.slots = tap.value("slots", frame_tap.slots);
+        }
+
         return {
             stream_url,
             sub_stream_url,
@@ -101,12 +279,52 @@ namespace nvr {
             type,
             stream_id,
             hardware_enc_priority,
+            egress_sink,
             clip_runtime,
             snapshot_interval,
             port,
+            rtp_port,
+            whep_port,
+            janus_enabled,
+            keyframe_on_demand,
+            latency,
+            codecs,
+            codec_preset,
+            frame_tap,
+            snapshot_server,
+            snapshot_quality,
+            analysis,
+            trace_interval,
+            metrics_enabled,
+            metrics_port,
+            activity_index,
+            motion,
+            compaction,
+            ring_size,
+            upload,
         };
     }
 
+    /**
+     * Get a named latency profile
+     * @param name default, low or ultra-low
+     * @return
+     */
+    LatencyProfile getLatencyProfile(const string&name) {
+        if (name == "low")
+            return {name, 50, true, "udp", true, 1, 0, 0, 250, 2, true, false};
+
+        if (name == "ultra-low")
+            return {name, 20, true, "udp", true, 1, 0, 0, 150, 1, true, false};
+
+        if (name != "default")
+            spdlog::warn("Unknown latency profile '{}', using default", name);
+
+        // Matches what the streamer always did: 200ms jitterbuffer, no frames dropped (a lagging encoder holds up
+        // the decoder instead), element defaults otherwise
+        return {"default", 200, false, "", false, -1, -1, 0, 0, 2, false, false};
+    }
+
     bool isReachable(const string&ip_addr) {
         CURL* connection;
         CURLcode res;
@@ -264,4 +482,53 @@ namespace nvr {
     string sanitizeStreamURL(const string&stream_url, const string&password) {
         return std::regex_replace(string(stream_url), std::regex(password), string(password.length(), '*'));
     }
+
+    /**
+     * Send one message to the Never socket, without waiting if it is backed up
+     * @param message
+     * @param logger
+     * @return
+     */
+    bool sendNotification(const json&message, const nvr_logger&logger) {
+        auto socket_path = string("/tmp/nvr.socket");
+        int notify_socket = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+
+        if (notify_socket == -1) {
+            logger->error("Could not initialize Never socket at '{}'", socket_path);
+            return false;
+        }
+
+        struct sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+
+        auto raw = message.dump();
+        bool sent = sendto(notify_socket, raw.data(), raw.size(), MSG_DONTWAIT, (struct sockaddr *) &address,
+                           sizeof(address)) != -1;
+
+        if (!sent)
+            logger->warn("Could not send {} notification to {}", message.value("type", "unknown"), socket_path);
+
+        close(notify_socket);
+        return sent;
+    }
+
+    /**
+     * Move the calling thread to the idle I/O class and lowest CPU priority, so
+     * background work only gets the disk when recording doesn't want it
+     * @param logger
+     */
+    void lowerThreadPriority(const nvr_logger&logger) {
+        // From linux/ioprio.h, which glibc doesn't wrap
+        const int ioprio_who_process = 1;
+        const int ioprio_class_idle = 3;
+        const int ioprio_class_shift = 13;
+
+        auto thread_id = (id_t) syscall(SYS_gettid);
+
+        if (syscall(SYS_ioprio_set, ioprio_who_process, thread_id, ioprio_class_idle << ioprio_class_shift) == -1)
+            logger->warn("Could not set idle I/O priority: {}", strerror(errno));
+
+        setpriority(PRIO_PROCESS, thread_id, 19);
+    }
 } // never
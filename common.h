@@ -44,6 +44,102 @@ namespace nvr {
     };
 
 
+    /**
+     * Ingest/encode knobs trading robustness for latency. Negative values and
+     * empty strings leave the element's own default in place.
+     */
+    struct LatencyProfile {
+        string name;
+        int jitter_buffer_ms;
+        bool drop_on_latency;
+        string protocols;
+        bool low_latency_decode;
+        int64_t encoder_deadline;
+        int lag_in_frames;
+        int b_frames;
+        int max_lateness_ms;
+        // Decoded frames waiting for the encoder, a leaky queue drops the oldest instead of holding up the decoder
+        int encode_queue_buffers;
+        bool encode_queue_leaky;
+        bool measure;
+    };
+
+    /**
+     * Decoded frames published to shared memory for local analytics.
+     * Zero width/height/fps keep the decoder's values.
+     */
+    struct FrameTapConfig {
+        bool enabled;
+        string format;
+        int width;
+        int height;
+        int max_fps;
+        int slots;
+    };
+
+    /**
+     * Freeze/black/tamper detection thresholds, on 8-bit luma
+     */
+    struct AnalysisConfig {
+        bool enabled;
+        int freeze_seconds;
+        int black_level;
+        int tamper_level;
+        // Seconds a changed view has to hold still before it becomes the new reference, 0 never adopts it
+        int tamper_rebase_seconds;
+    };
+
+    /**
+     * Part of the picture motion is ignored in, as fractions of the width and height
+     */
+    struct MotionRegion {
+        double x;
+        double y;
+        double width;
+        double height;
+    };
+
+    /**
+     * Sub stream motion detection that starts and stops main stream recording
+     */
+    struct MotionConfig {
+        bool enabled;
+        int fps;
+        int sensitivity;
+        int min_blocks;
+        int post_roll;
+        std::vector<MotionRegion> mask;
+    };
+
+    /**
+     * Concatenating finished clips into one file per window once they are old enough
+     */
+    struct CompactionConfig {
+        bool enabled;
+        int window;
+        int delay;
+    };
+
+    /**
+     * Minutes after local midnight, a window ending before it starts runs past midnight
+     */
+    struct UploadWindow {
+        int start;
+        int end;
+    };
+
+    /**
+     * Background upload of finished clips as ranged PUTs to url/<camera>/<clip>
+     */
+    struct UploadConfig {
+        bool enabled;
+        string url;
+        int rate_limit;
+        int chunk_size;
+        std::vector<UploadWindow> windows;
+        string authorization;
+    };
+
     struct CameraConfig {
         string stream_url;
         string sub_stream_url;
@@ -56,9 +152,29 @@ namespace nvr {
         StreamType type;
         string stream_id;
         string hardware_enc_priority;
+        string egress_sink;
         const long clip_runtime;
         const long snapshot_interval;
         const int port;
+        const int rtp_port;
+        const int whep_port;
+        const bool janus_enabled;
+        const bool keyframe_on_demand;
+        const LatencyProfile latency;
+        const std::vector<string> codecs;
+        const string codec_preset;
+        const FrameTapConfig frame_tap;
+        const bool snapshot_server;
+        const int snapshot_quality;
+        const AnalysisConfig analysis;
+        const int trace_interval;
+        const bool metrics_enabled;
+        const int metrics_port;
+        const bool activity_index;
+        const MotionConfig motion;
+        const CompactionConfig compaction;
+        const int64_t ring_size;
+        const UploadConfig upload;
     };
 
     string buildStreamURL(const string&url, const string&ip_address, int port, const string&password,
@@ -68,11 +184,17 @@ namespace nvr {
 
     CameraConfig getConfig(const char* config_file);
 
+    LatencyProfile getLatencyProfile(const string&name);
+
     string generateOutputFilename(const string&camera_id, const string&output_path, FileType file_type, bool temporary = false);
 
     int countClips(const string&output_path, const string&camera_name);
 
     nvr_logger buildLogger(const CameraConfig&config);
+
+    bool sendNotification(const nlohmann::json&message, const nvr_logger&logger);
+
+    void lowerThreadPriority(const nvr_logger&logger);
 } // nvr
 
 #endif
@@ -0,0 +1,51 @@
+#include "exporter.h"
+
+/**
+ * Unix seconds, or local time as 2024-01-01 12:00:00, 2024-01-01T12:00:00 or 2024-01-01_12-00-00 (as in clip names)
+ * @param text
+ * @return -1 when it isn't a time
+ */
+time_t parseTime(const char *text) {
+    const char *formats[] = {"%Y-%m-%d %H:%M:%S", "%Y-%m-%dT%H:%M:%S", "%Y-%m-%d_%H-%M-%S"};
+
+    for (const char *format: formats) {
+        struct tm time{};
+        const char *end = strptime(text, format, &time);
+
+        if (end != nullptr && *end == '\0') {
+            time.tm_isdst = -1;
+            return mktime(&time);
+        }
+    }
+
+    char *end = nullptr;
+    long long seconds = strtoll(text, &end, 10);
+
+    return end != text && *end == '\0' ? (time_t) seconds : -1;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 5) {
+        spdlog::error("usage: {} camera-config.json start end output.mp4\n"
+                      "i.e. {} ./cameras/camera-1.json '2024-01-01 12:00:00' '2024-01-01 12:05:00' incident.mp4\n"
+                      "Copy a time range of a camera's recordings into one file, without re-encoding.\n"
+                      "Times are local, or unix seconds.\n", argv[0], argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    const auto config = nvr::getConfig(argv[1]);
+    time_t start = parseTime(argv[2]);
+    time_t end = parseTime(argv[3]);
+
+    if (start < 0 || end <= start) {
+        spdlog::error("Invalid time range '{}' to '{}'", argv[2], argv[3]);
+        return EXIT_FAILURE;
+    }
+
+    av_log_set_level(AV_LOG_ERROR);
+
+    auto logger = spdlog::stdout_color_mt("export");
+    nvr::Exporter exporter(logger, config.output_path, config.stream_id);
+
+    return exporter.exportRange(start, end, argv[4]) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
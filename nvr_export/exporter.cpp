@@ -0,0 +1,237 @@
+//
+// Cuts a wall clock range out of a camera's recordings into one MP4, without re-encoding
+//
+
+#include "exporter.h"
+
+#include <fcntl.h>
+#include <sys/sendfile.h>
+
+namespace fs = std::filesystem;
+
+namespace nvr {
+
+    /**
+     * @param logger
+     * @param output_path Root output path of the recorder
+     * @param camera_id
+     */
+    Exporter::Exporter(const nvr_logger &logger, const string &output_path, const string &camera_id) {
+        this->logger = logger;
+        this->camera_id = camera_id;
+        this->videos_path = fs::path(output_path) / "videos" / camera_id;
+        this->ring_path = RingStore::filePath(output_path, camera_id);
+    }
+
+    /**
+     * Export from the camera's ring if it has one covering the range, otherwise from its clips
+     * @param start Unix seconds
+     * @param end Unix seconds
+     * @param destination
+     * @return
+     */
+    bool Exporter::exportRange(time_t start, time_t end, const string &destination) {
+        if (fs::exists(ring_path) && exportRing(start, end, destination))
+            return true;
+
+        return exportClips(start, end, destination);
+    }
+
+    /**
+     * Copy between files in the kernel. copy_file_range can share extents on filesystems
+     * that support it, sendfile covers the ones where it can't cross devices.
+     * @param from
+     * @param offset
+     * @param to Written at its current position
+     * @param length
+     * @return
+     */
+    bool Exporter::copyRange(int from, off_t offset, int to, size_t length) {
+        bool use_sendfile = false;
+
+        while (length > 0) {
+            ssize_t copied;
+
+            if (!use_sendfile) {
+                copied = copy_file_range(from, &offset, to, nullptr, length, 0);
+
+                if (copied < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+                    use_sendfile = true;
+                    continue;
+                }
+            } else {
+                copied = sendfile(to, from, &offset, length);
+            }
+
+            if (copied <= 0) {
+                logger->error("Export: copy failed: {}", copied < 0 ? strerror(errno) : "unexpected end of file");
+                return false;
+            }
+
+            length -= copied;
+        }
+
+        return true;
+    }
+
+    /**
+     * The ring already holds fragmented MP4, so the export is its init segment followed by the
+     * fragments in range, copied as they are. Starts at the last key frame fragment at or before
+     * start and stops where the recorder restarted, as timestamps begin again there.
+     * @param start
+     * @param end
+     * @param destination
+     * @return False when the ring has nothing in range
+     */
+    bool Exporter::exportRing(time_t start, time_t end, const string &destination) {
+        int ring_fd = open(ring_path.c_str(), O_RDONLY | O_CLOEXEC);
+
+        if (ring_fd < 0)
+            return false;
+
+        RingHeader header{};
+        std::vector<RingEntry> entries;
+
+        if (!RingStore::readIndex(ring_fd, header, entries) || header.init_length == 0) {
+            logger->warn("Export: {} is not a usable ring", ring_path);
+            close(ring_fd);
+            return false;
+        }
+
+        int64_t start_ms = (int64_t) start * 1000;
+        int64_t end_ms = (int64_t) end * 1000;
+        size_t first = entries.size();
+
+        for (size_t i = 0; i < entries.size(); i++) {
+            if (entries[i].start > start_ms) {
+                if (first == entries.size() && (entries[i].flags & ring_sync) && entries[i].start < end_ms)
+                    first = i;
+
+                break;
+            }
+
+            if (entries[i].flags & ring_sync)
+                first = i;
+        }
+
+        if (first == entries.size()) {
+            logger->info("Export: nothing in the ring between {} and {}", start, end);
+            close(ring_fd);
+            return false;
+        }
+
+        size_t last = first;
+
+        while (last + 1 < entries.size() && entries[last + 1].start < end_ms &&
+               entries[last + 1].sequence == entries[last].sequence + 1) {
+            if (entries[last + 1].flags & ring_session_start) {
+                logger->warn("Export: recording restarted at {}, the export stops there",
+                             entries[last + 1].start / 1000);
+                break;
+            }
+
+            last++;
+        }
+
+        int output_fd = open(destination.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+        if (output_fd < 0) {
+            logger->error("Export: cannot create {}: {}", destination, strerror(errno));
+            close(ring_fd);
+            return false;
+        }
+
+        bool success = copyRange(ring_fd, (off_t) header.init_offset, output_fd, header.init_length);
+        uint64_t bytes = header.init_length;
+
+        for (size_t i = first; success && i <= last; i++) {
+            success = copyRange(ring_fd, (off_t) (header.data_offset + entries[i].offset), output_fd,
+                                entries[i].length);
+            bytes += entries[i].length;
+        }
+
+        // The recorder keeps writing, make sure it didn't lap what was copied
+        RingHeader current{};
+        std::vector<RingEntry> remaining;
+
+        if (success && (!RingStore::readIndex(ring_fd, current, remaining) || remaining.empty() ||
+                        remaining.front().sequence > entries[first].sequence)) {
+            logger->error("Export: the ring was overwritten while exporting, try a later start");
+            success = false;
+        }
+
+        close(output_fd);
+        close(ring_fd);
+
+        if (!success) {
+            std::error_code error;
+            fs::remove(destination, error);
+            return false;
+        }
+
+        logger->info("Exported {} fragments ({} MB) from the ring to {}", last - first + 1, bytes / 1024 / 1024,
+                     destination);
+        return true;
+    }
+
+    /**
+     * Stream copy the clips covering the range into one MP4. The first clip is entered at the key
+     * frame before start, the last is left at the first packet past end. Clips are joined back to back.
+     * @param start
+     * @param end
+     * @param destination
+     * @return
+     */
+    bool Exporter::exportClips(time_t start, time_t end, const string &destination) {
+        std::vector<ClipFile> candidates;
+
+        // The last clip starting at or before start, and every clip starting before end
+        for (const auto &clip: listClips(videos_path, camera_id)) {
+            if (clip.start >= end)
+                break;
+
+            if (clip.start <= start)
+                candidates.clear();
+
+            candidates.push_back(clip);
+        }
+
+        std::vector<ClipFile> clips;
+
+        for (auto &clip: candidates) {
+            if (!probeClip(clip)) {
+                logger->warn("Export: skipping unreadable clip {}", clip.path.string());
+                continue;
+            }
+
+            if ((double) clip.start + clip.duration <= (double) start)
+                continue;
+
+            // One track in the output, a clip in another format ends the export
+            if (!clips.empty() && (clip.codec != clips.front().codec || clip.width != clips.front().width ||
+                                   clip.height != clips.front().height)) {
+                logger->warn("Export: {} changes format, the export stops there", clip.path.filename().string());
+                break;
+            }
+
+            clips.push_back(clip);
+        }
+
+        if (clips.empty()) {
+            logger->error("Export: no recordings of {} between {} and {}", camera_id, start, end);
+            return false;
+        }
+
+        double seconds = copyClips(logger, clips, destination, start, end, "");
+
+        if (seconds <= 0) {
+            logger->error("Export: nothing written for {} between {} and {}", camera_id, start, end);
+            std::error_code error;
+            fs::remove(destination, error);
+            return false;
+        }
+
+        logger->info("Exported {:.1f}s from {} clips to {}", seconds, clips.size(), destination);
+        return true;
+    }
+}
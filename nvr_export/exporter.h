@@ -0,0 +1,34 @@
+//
+// Cuts a wall clock range out of a camera's recordings into one MP4, without re-encoding
+//
+
+#ifndef NEVER_CLI_EXPORTER_H
+#define NEVER_CLI_EXPORTER_H
+
+#include "../common.h"
+#include "../nvr_record/clips.h"
+#include "../nvr_record/ring_store.h"
+
+namespace nvr {
+
+    class Exporter {
+    public:
+        Exporter(const nvr_logger &logger, const string &output_path, const string &camera_id);
+        Exporter(Exporter const &) = delete;
+        Exporter &operator=(Exporter const &) = delete;
+
+        bool exportRange(time_t start, time_t end, const string &destination);
+
+    private:
+        nvr_logger logger;
+        string camera_id;
+        std::filesystem::path videos_path;
+        string ring_path;
+
+        bool exportRing(time_t start, time_t end, const string &destination);
+        bool exportClips(time_t start, time_t end, const string &destination);
+        bool copyRange(int from, off_t offset, int to, size_t length);
+    };
+}
+
+#endif //NEVER_CLI_EXPORTER_H
@@ -0,0 +1,135 @@
+//
+// Per-second activity score of a clip from the size of its inter frames, no decoding needed
+//
+
+#include "activity.h"
+
+extern "C" {
+#include <libavutil/time.h>
+}
+
+#include <cmath>
+
+using json = nlohmann::json;
+namespace fs = std::filesystem;
+
+namespace nvr {
+
+    // The baseline falls to a quieter scene quickly and rises to a busier one slowly,
+    // so it tracks the noise floor rather than the motion
+    const double baseline_fall = 0.05;
+    const double baseline_rise = 0.001;
+
+    // Score per multiple of the baseline above 1, 100 is three times the baseline or more
+    const double score_scale = 50.0;
+
+    // Timestamps further ahead than this start the index over instead of padding it
+    const size_t max_gap_seconds = 3600;
+
+    ActivityIndex::ActivityIndex(const nvr_logger &logger) {
+        this->logger = logger;
+    }
+
+    /**
+     * Sidecar written next to the clip, camera-2024-01-01_00-00-00.mp4.activity.json
+     * @param clip_path
+     * @return
+     */
+    string ActivityIndex::sidecarPath(const string &clip_path) {
+        return clip_path + ".activity.json";
+    }
+
+    /**
+     * Called for every packet before it is written (the muxer blanks it). The key frame that starts a
+     * new segment only pads the old clip's last second, key frames are not scored.
+     * @param packet
+     * @param time_base Of the input stream
+     */
+    void ActivityIndex::packet(const AVPacket *packet, AVRational time_base) {
+        int64_t raw = packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts;
+
+        if (raw == AV_NOPTS_VALUE)
+            return;
+
+        double timestamp = (double) raw * av_q2d(time_base);
+
+        if (clip_start < 0) {
+            clip_start = timestamp;
+            clip_wall_start = av_gettime() / 1000;
+        }
+
+        double offset = timestamp - clip_start;
+        auto second = offset > 0 ? (size_t) offset : 0;
+
+        if (second > scores.size() + max_gap_seconds) {
+            logger->warn("Activity index: timestamps jumped {}s, restarting the index", second - scores.size());
+            clip_start = timestamp - (double) scores.size();
+            second = scores.size();
+        }
+
+        while (scores.size() < second)
+            closeSecond();
+
+        // Key frames are big whatever happens in the scene, only inter frames carry motion
+        if (packet->flags & AV_PKT_FLAG_KEY)
+            return;
+
+        auto size = (double) packet->size;
+        second_bytes += packet->size;
+        second_frames++;
+
+        if (baseline == 0)
+            baseline = size;
+        else
+            baseline += (size - baseline) * (size < baseline ? baseline_fall : baseline_rise);
+    }
+
+    void ActivityIndex::closeSecond() {
+        int score;
+
+        if (second_frames > 0 && baseline > 0) {
+            double ratio = (double) second_bytes / (double) second_frames / baseline;
+            score = (int) std::lround(std::clamp((ratio - 1.0) * score_scale, 0.0, 100.0));
+        } else {
+            // Nothing but a key frame (or nothing at all) this second, carry the last score
+            score = scores.empty() ? 0 : scores.back();
+        }
+
+        scores.push_back(score);
+        second_bytes = 0;
+        second_frames = 0;
+    }
+
+    /**
+     * Write the finished clip's index and start a new one
+     * @param clip_path Final location of the clip
+     */
+    void ActivityIndex::finishClip(const string &clip_path) {
+        if (second_frames > 0)
+            closeSecond();
+
+        json index;
+        index["version"] = 1;
+        index["clip"] = fs::path(clip_path).filename().string();
+        index["start"] = clip_wall_start;
+        index["interval"] = 1;
+        index["scores"] = scores;
+
+        string sidecar_path = sidecarPath(clip_path);
+        string temporary_path = sidecar_path + ".tmp";
+
+        {
+            std::ofstream sidecar(temporary_path, std::ios::trunc);
+            sidecar << index.dump();
+
+            if (!sidecar)
+                logger->error("Could not write activity index {}", sidecar_path);
+        }
+
+        std::error_code error;
+        fs::rename(temporary_path, sidecar_path, error);
+
+        clip_start = -1;
+        scores.clear();
+    }
+}
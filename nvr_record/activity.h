@@ -0,0 +1,44 @@
+//
+// Per-second activity score of a clip from the size of its inter frames, no decoding needed
+//
+
+#ifndef NEVER_CLI_ACTIVITY_H
+#define NEVER_CLI_ACTIVITY_H
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+#include "../common.h"
+#include <vector>
+
+namespace nvr {
+
+    class ActivityIndex {
+    public:
+        explicit ActivityIndex(const nvr_logger &logger);
+        ActivityIndex(ActivityIndex const &) = delete;
+        ActivityIndex &operator=(ActivityIndex const &) = delete;
+
+        void packet(const AVPacket *packet, AVRational time_base);
+        void finishClip(const string &clip_path);
+
+        static string sidecarPath(const string &clip_path);
+
+    private:
+        nvr_logger logger;
+
+        // Noise floor of inter frame sizes, in bytes
+        double baseline = 0;
+
+        double clip_start = -1;
+        int64_t clip_wall_start = 0;
+        std::vector<int> scores;
+        uint64_t second_bytes = 0;
+        uint64_t second_frames = 0;
+
+        void closeSecond();
+    };
+}
+
+#endif //NEVER_CLI_ACTIVITY_H
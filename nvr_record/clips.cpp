@@ -0,0 +1,230 @@
+//
+// Finished clips on disk, found by name and probed for their length and format
+//
+
+#include "clips.h"
+
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+
+namespace fs = std::filesystem;
+
+namespace nvr {
+
+    /**
+     * Finished clips of a camera, oldest first, with their start time from the file name
+     * (camera-2024-01-01_00-00-00.mp4, local time). Nothing is probed yet.
+     * @param directory
+     * @param camera_id
+     * @return
+     */
+    std::vector<ClipFile> listClips(const fs::path &directory, const string &camera_id) {
+        std::vector<ClipFile> clips;
+        std::error_code error;
+        string prefix = camera_id + "-";
+
+        for (const auto &entry: fs::directory_iterator(directory, error)) {
+            string name = entry.path().filename().string();
+
+            if (!entry.is_regular_file() || entry.path().extension() != ".mp4" || !name.starts_with(prefix))
+                continue;
+
+            struct tm start_time{};
+            const char *end = strptime(name.c_str() + prefix.size(), "%Y-%m-%d_%H-%M-%S", &start_time);
+
+            if (end == nullptr || strcmp(end, ".mp4") != 0)
+                continue;
+
+            start_time.tm_isdst = -1;
+            clips.push_back({entry.path(), mktime(&start_time), 0, AV_CODEC_ID_NONE, 0, 0});
+        }
+
+        std::sort(clips.begin(), clips.end(), [](const ClipFile &a, const ClipFile &b) {
+            return a.start < b.start;
+        });
+
+        return clips;
+    }
+
+    /**
+     * Fill in the duration and video parameters of a clip
+     * @param clip
+     * @return False when the clip can't be read
+     */
+    bool probeClip(ClipFile &clip) {
+        AVFormatContext *input = nullptr;
+
+        if (avformat_open_input(&input, clip.path.c_str(), nullptr, nullptr) != 0)
+            return false;
+
+        bool valid = false;
+
+        if (avformat_find_stream_info(input, nullptr) >= 0) {
+            int index = av_find_best_stream(input, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+
+            if (index >= 0 && input->duration != AV_NOPTS_VALUE) {
+                AVCodecParameters *parameters = input->streams[index]->codecpar;
+                clip.duration = (double) input->duration / AV_TIME_BASE;
+                clip.codec = parameters->codec_id;
+                clip.width = parameters->width;
+                clip.height = parameters->height;
+                valid = true;
+            }
+        }
+
+        avformat_close_input(&input);
+        return valid;
+    }
+
+    /**
+     * Stream copy the video of the clips into one MP4, each clip's timestamps shifted to follow the last.
+     * The first clip is entered at the key frame at or before start, the copy stops at the first packet past end.
+     * @param logger
+     * @param clips Clips of one format, oldest first
+     * @param output_path
+     * @param start Wall clock time, 0 for the start of the first clip
+     * @param end Wall clock time, 0 for the end of the last clip
+     * @param movflags Muxer movflags, empty for a regular MP4
+     * @return Seconds written, negative on failure
+     */
+    double copyClips(const nvr_logger &logger, const std::vector<ClipFile> &clips, const string &output_path,
+                     time_t start, time_t end, const string &movflags) {
+        AVFormatContext *output = nullptr;
+        AVStream *output_stream = nullptr;
+        AVPacket *packet = av_packet_alloc();
+        int64_t offset = 0;
+        bool success = true;
+        bool done = false;
+
+        if (avformat_alloc_output_context2(&output, nullptr, "mp4", output_path.c_str()) < 0) {
+            logger->error("Stream copy: cannot create muxer for {}", output_path);
+            av_packet_free(&packet);
+            return -1;
+        }
+
+        for (size_t c = 0; c < clips.size() && success && !done; c++) {
+            const ClipFile &clip = clips[c];
+            AVFormatContext *input = nullptr;
+
+            if (avformat_open_input(&input, clip.path.c_str(), nullptr, nullptr) != 0 ||
+                avformat_find_stream_info(input, nullptr) < 0) {
+                logger->error("Stream copy: cannot read {}", clip.path.string());
+                avformat_close_input(&input);
+                success = false;
+                break;
+            }
+
+            int index = av_find_best_stream(input, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+
+            if (index < 0) {
+                logger->error("Stream copy: no video stream in {}", clip.path.string());
+                avformat_close_input(&input);
+                success = false;
+                break;
+            }
+
+            AVStream *input_stream = input->streams[index];
+            AVRational input_base = input_stream->time_base;
+            int64_t stream_start = input_stream->start_time != AV_NOPTS_VALUE ? input_stream->start_time : 0;
+
+            if (output_stream == nullptr) {
+                AVDictionary *params = nullptr;
+
+                if (!movflags.empty())
+                    av_dict_set(&params, "movflags", movflags.c_str(), 0);
+
+                output_stream = avformat_new_stream(output, nullptr);
+                avcodec_parameters_copy(output_stream->codecpar, input_stream->codecpar);
+                output_stream->time_base = input_stream->time_base;
+
+                bool opened = avio_open(&output->pb, output_path.c_str(), AVIO_FLAG_WRITE) >= 0 &&
+                              avformat_write_header(output, &params) >= 0;
+                av_dict_free(&params);
+
+                if (!opened) {
+                    logger->error("Stream copy: cannot start {}", output_path);
+                    avformat_close_input(&input);
+                    success = false;
+                    break;
+                }
+            }
+
+            // Enter the first clip at the key frame at or before start
+            bool keyed = c > 0;
+
+            if (c == 0 && start > clip.start) {
+                int64_t target = av_rescale_q((int64_t) (start - clip.start) * AV_TIME_BASE, AV_TIME_BASE_Q,
+                                              input_base) + stream_start;
+                av_seek_frame(input, index, target, AVSEEK_FLAG_BACKWARD);
+            }
+
+            AVRational output_base = output_stream->time_base;
+            AVRational frame_rate = av_guess_frame_rate(input, input_stream, nullptr);
+            int64_t frame_duration = frame_rate.num > 0 ? av_rescale_q(1, av_inv_q(frame_rate), output_base) : 1;
+            int64_t first_timestamp = AV_NOPTS_VALUE;
+            int64_t clip_end = offset;
+
+            while (av_read_frame(input, packet) >= 0) {
+                if (packet->stream_index != index || packet->dts == AV_NOPTS_VALUE ||
+                    (!keyed && !(packet->flags & AV_PKT_FLAG_KEY))) {
+                    av_packet_unref(packet);
+                    continue;
+                }
+
+                keyed = true;
+
+                double wall = (double) clip.start + (double) (packet->dts - stream_start) * av_q2d(input_base);
+
+                if (end > 0 && wall >= (double) end) {
+                    av_packet_unref(packet);
+                    done = true;
+                    break;
+                }
+
+                if (first_timestamp == AV_NOPTS_VALUE)
+                    first_timestamp = packet->dts;
+
+                int64_t dts = av_rescale_q(packet->dts - first_timestamp, input_base, output_base) + offset;
+                int64_t pts = packet->pts == AV_NOPTS_VALUE ? dts :
+                              av_rescale_q(packet->pts - first_timestamp, input_base, output_base) + offset;
+                int64_t duration = packet->duration > 0 ?
+                                   av_rescale_q(packet->duration, input_base, output_base) : frame_duration;
+
+                packet->dts = dts;
+                packet->pts = pts;
+                packet->duration = duration;
+                packet->stream_index = 0;
+                packet->pos = -1;
+                clip_end = std::max(clip_end, dts + duration);
+
+                if (av_interleaved_write_frame(output, packet) < 0) {
+                    logger->error("Stream copy: write failed on {}", output_path);
+                    success = false;
+                    av_packet_unref(packet);
+                    break;
+                }
+
+                av_packet_unref(packet);
+            }
+
+            offset = clip_end;
+            avformat_close_input(&input);
+        }
+
+        double seconds = -1;
+
+        if (output_stream != nullptr && output->pb != nullptr) {
+            if (success && av_write_trailer(output) < 0)
+                success = false;
+
+            seconds = (double) offset * av_q2d(output_stream->time_base);
+            avio_closep(&output->pb);
+        }
+
+        avformat_free_context(output);
+        av_packet_free(&packet);
+
+        return success ? seconds : -1;
+    }
+}
@@ -0,0 +1,35 @@
+//
+// Finished clips on disk, found by name and probed for their length and format
+//
+
+#ifndef NEVER_CLI_CLIPS_H
+#define NEVER_CLI_CLIPS_H
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+#include "../common.h"
+#include <vector>
+
+namespace nvr {
+
+    struct ClipFile {
+        std::filesystem::path path;
+        time_t start;
+        double duration;
+        AVCodecID codec;
+        int width;
+        int height;
+    };
+
+    std::vector<ClipFile> listClips(const std::filesystem::path &directory, const string &camera_id);
+
+    bool probeClip(ClipFile &clip);
+
+    double copyClips(const nvr_logger &logger, const std::vector<ClipFile> &clips, const string &output_path,
+                     time_t start, time_t end, const string &movflags);
+}
+
+#endif //NEVER_CLI_CLIPS_H
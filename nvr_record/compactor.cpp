@@ -0,0 +1,363 @@
+//
+// Concatenates finished clips into one file per window by stream copy, in the background
+//
+
+#include "compactor.h"
+#include "activity.h"
+
+#include <algorithm>
+#include <cmath>
+
+using json = nlohmann::json;
+namespace fs = std::filesystem;
+
+namespace nvr {
+
+    // How often the videos directory is looked over
+    const auto scan_interval = std::chrono::minutes(5);
+
+    // Clips this close (in seconds) to the end of the one before are treated as one recording
+    const double contiguous_slack = 2.0;
+
+    // Working files live next to the clips so the final rename never crosses a filesystem
+    const string temporary_prefix = ".compact-";
+
+    /**
+     * @param logger
+     * @param camera_id
+     * @param output_path Root output path, clips are under videos/<camera_id>
+     * @param config
+     * @param notifier Receives a "compacted" event for every merge
+     * @param uploader Has the clips it still holds swapped for the merged file, nullptr without uploads
+     */
+    Compactor::Compactor(const nvr_logger &logger, const string &camera_id, const string &output_path,
+                         const CompactionConfig &config, Notifier &notifier, Uploader *uploader) {
+        this->logger = logger;
+        this->camera_id = camera_id;
+        this->videos_path = fs::path(output_path) / "videos" / camera_id;
+        this->manifest_path = this->videos_path / ".compact.json";
+        this->config = config;
+        this->notifier = &notifier;
+        this->uploader = uploader;
+    }
+
+    Compactor::~Compactor() {
+        stop();
+    }
+
+    void Compactor::start() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            if (running)
+                return;
+
+            running = true;
+        }
+
+        compactor_thread = std::thread(&Compactor::run, this);
+
+        logger->info("Compacting clips into {}s files once they are {}s old", config.window, config.delay);
+    }
+
+    void Compactor::stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            if (!running)
+                return;
+
+            running = false;
+        }
+
+        wake.notify_all();
+
+        if (compactor_thread.joinable())
+            compactor_thread.join();
+    }
+
+    void Compactor::run() {
+        lowerThreadPriority(logger);
+        recover();
+
+        std::unique_lock<std::mutex> lock(mutex);
+
+        while (running) {
+            lock.unlock();
+            compactWindows();
+            lock.lock();
+
+            wake.wait_for(lock, scan_interval, [this] { return !running; });
+        }
+    }
+
+    /**
+     * Group the clips into windows aligned on local time and merge every window that
+     * closed more than the delay ago. Only runs of back to back clips with the same
+     * video parameters are merged, so a position in the file is still a wall clock time.
+     */
+    void Compactor::compactWindows() {
+        std::vector<ClipFile> clips = listClips(videos_path, camera_id);
+        time_t now = time(nullptr);
+
+        // Windows handled on an earlier pass are not probed again, however long the retention
+        size_t first = std::partition_point(clips.begin(), clips.end(), [this](const ClipFile &clip) {
+            return clip.start < compacted_until;
+        }) - clips.begin();
+
+        // A window that failed holds compacted_until back, so it and everything after are looked at again
+        bool advance = true;
+
+        while (first < clips.size()) {
+            struct tm local{};
+            localtime_r(&clips[first].start, &local);
+
+            // Window boundaries on the local clock, so hourly files start on the hour
+            long window = std::max(config.window, 60);
+            long local_start = clips[first].start + local.tm_gmtoff;
+            long window_index = local_start >= 0 ? local_start / window : (local_start - window + 1) / window;
+            time_t window_end = (time_t) ((window_index + 1) * window - local.tm_gmtoff);
+
+            size_t last = first;
+
+            while (last < clips.size() && clips[last].start < window_end)
+                last++;
+
+            if (window_end + config.delay > now)
+                break;
+
+            // A window with one file (an hourly output, or a lone clip) has nothing to merge
+            if (last - first == 1) {
+                if (advance)
+                    compacted_until = window_end;
+
+                first = last;
+                continue;
+            }
+
+            std::vector<ClipFile> run;
+            bool merged = true;
+
+            for (size_t i = first; i < last; i++) {
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+
+                    if (!running)
+                        return;
+                }
+
+                ClipFile clip = clips[i];
+
+                if (!probeClip(clip)) {
+                    logger->warn("Compaction: skipping unreadable clip {}", clip.path.string());
+                    merged = false;
+
+                    if (run.size() > 1)
+                        compact(run);
+
+                    run.clear();
+                    continue;
+                }
+
+                if (!run.empty()) {
+                    const ClipFile &previous = run.back();
+                    bool contiguous = (double) (clip.start - previous.start) <= previous.duration + contiguous_slack;
+                    bool same_format = clip.codec == previous.codec && clip.width == previous.width &&
+                                       clip.height == previous.height;
+
+                    if (!contiguous || !same_format) {
+                        if (run.size() > 1 && !compact(run))
+                            merged = false;
+
+                        run.clear();
+                    }
+                }
+
+                run.push_back(clip);
+            }
+
+            if (run.size() > 1 && !compact(run))
+                merged = false;
+
+            advance = advance && merged;
+
+            if (advance)
+                compacted_until = window_end;
+
+            first = last;
+        }
+    }
+
+    /**
+     * Merge a run of clips into the first clip's name. The merged file is written beside the
+     * clips, then a manifest records the swap so a crash part way through can be finished.
+     * @param run
+     * @return False when the run was left as it was
+     */
+    bool Compactor::compact(const std::vector<ClipFile> &run) {
+        fs::path output = run.front().path;
+        fs::path temporary = videos_path / (temporary_prefix + output.filename().string());
+        string temporary_activity = ActivityIndex::sidecarPath(temporary.string());
+
+        if (copyClips(logger, run, temporary.string(), 0, 0, "+frag_keyframe+empty_moov+default_base_moof") < 0) {
+            std::error_code error;
+            fs::remove(temporary, error);
+            return false;
+        }
+
+        bool has_activity = mergeActivity(run, temporary_activity);
+
+        json manifest;
+        manifest["output"] = output.string();
+        manifest["temporary"] = temporary.string();
+        manifest["activity"] = has_activity ? temporary_activity : "";
+        manifest["clips"] = json::array();
+
+        for (const auto &clip: run)
+            manifest["clips"].push_back(clip.path.string());
+
+        {
+            std::ofstream manifest_file(manifest_path, std::ios::trunc);
+            manifest_file << manifest.dump();
+
+            if (!manifest_file) {
+                logger->error("Compaction: could not write {}", manifest_path.string());
+                std::error_code error;
+                fs::remove(temporary, error);
+                fs::remove(temporary_activity, error);
+                return false;
+            }
+        }
+
+        finish(manifest);
+
+        logger->info("Compacted {} clips into {} ({:.0f}s)", run.size(), output.filename().string(),
+                     (double) (run.back().start - run.front().start) + run.back().duration);
+        return true;
+    }
+
+    /**
+     * Join the runs activity indexes, each padded or cut to its clip's length so the scores
+     * still line up with the merged file. Clips without an index contribute zeros.
+     * @param run
+     * @param output_path
+     * @return False when none of the clips had an index
+     */
+    bool Compactor::mergeActivity(const std::vector<ClipFile> &run, const string &output_path) {
+        std::vector<int> scores;
+        bool found = false;
+        int64_t start = (int64_t) run.front().start * 1000;
+
+        for (const auto &clip: run) {
+            std::vector<int> clip_scores;
+            std::ifstream sidecar(ActivityIndex::sidecarPath(clip.path.string()));
+
+            if (sidecar) {
+                try {
+                    json index = json::parse(sidecar);
+                    clip_scores = index["scores"].get<std::vector<int>>();
+
+                    if (!found)
+                        start = index["start"].get<int64_t>() - (clip.start - run.front().start) * 1000;
+
+                    found = true;
+                } catch (const json::exception &exception) {
+                    logger->warn("Compaction: ignoring bad activity index for {}", clip.path.string());
+                }
+            }
+
+            auto seconds = (size_t) std::lround(clip.duration);
+            clip_scores.resize(seconds, clip_scores.empty() ? 0 : clip_scores.back());
+            scores.insert(scores.end(), clip_scores.begin(), clip_scores.end());
+        }
+
+        if (!found)
+            return false;
+
+        json index;
+        index["version"] = 1;
+        index["clip"] = run.front().path.filename().string();
+        index["start"] = start;
+        index["interval"] = 1;
+        index["scores"] = scores;
+
+        std::ofstream sidecar(output_path, std::ios::trunc);
+        sidecar << index.dump();
+
+        return (bool) sidecar;
+    }
+
+    /**
+     * Swap the merged file in and remove the clips it replaces. Safe to repeat, which is
+     * what recovery does after a crash between the manifest and its removal.
+     * @param manifest
+     */
+    void Compactor::finish(const json &manifest) {
+        std::error_code error;
+        string output = manifest["output"];
+        string temporary = manifest["temporary"];
+        string activity = manifest["activity"];
+        std::vector<string> clips = manifest["clips"];
+
+        if (fs::exists(temporary))
+            fs::rename(temporary, output, error);
+
+        if (error) {
+            // The clips are all still there, drop the merge rather than retry it over them
+            logger->error("Compaction: could not move {} into place: {}", temporary, error.message());
+            fs::remove(temporary, error);
+            fs::remove(activity, error);
+            fs::remove(manifest_path, error);
+            return;
+        }
+
+        if (!activity.empty() && fs::exists(activity))
+            fs::rename(activity, ActivityIndex::sidecarPath(output), error);
+
+        // Before the removals, so clips still waiting to upload are never dropped as gone
+        if (uploader != nullptr)
+            uploader->replace(output, clips);
+
+        for (const auto &clip: clips) {
+            if (clip == output)
+                continue;
+
+            fs::remove(clip, error);
+            fs::remove(ActivityIndex::sidecarPath(clip), error);
+        }
+
+        json event;
+        event["type"] = "compacted";
+        event["camera"] = camera_id;
+        event["path"] = output;
+        event["clips"] = clips;
+        notifier->post(event);
+
+        fs::remove(manifest_path, error);
+    }
+
+    /**
+     * Finish a merge the manifest says was ready, and clear any working files left by one that wasn't
+     */
+    void Compactor::recover() {
+        std::error_code error;
+
+        if (fs::exists(manifest_path)) {
+            try {
+                std::ifstream manifest_file(manifest_path);
+                json manifest = json::parse(manifest_file);
+
+                logger->info("Compaction: finishing interrupted merge into {}", manifest["output"].get<string>());
+                finish(manifest);
+            } catch (const json::exception &exception) {
+                logger->warn("Compaction: discarding unreadable manifest");
+                fs::remove(manifest_path, error);
+            }
+        }
+
+        for (const auto &entry: fs::directory_iterator(videos_path, error)) {
+            if (entry.path().filename().string().starts_with(temporary_prefix))
+                fs::remove(entry.path(), error);
+        }
+    }
+}
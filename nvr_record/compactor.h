@@ -0,0 +1,54 @@
+//
+// Concatenates finished clips into one file per window by stream copy, in the background
+//
+
+#ifndef NEVER_CLI_COMPACTOR_H
+#define NEVER_CLI_COMPACTOR_H
+
+#include "../common.h"
+#include "clips.h"
+#include "notifier.h"
+#include "uploader.h"
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace nvr {
+
+    class Compactor {
+    public:
+        Compactor(const nvr_logger &logger, const string &camera_id, const string &output_path,
+                  const CompactionConfig &config, Notifier &notifier, Uploader *uploader);
+        ~Compactor();
+        Compactor(Compactor const &) = delete;
+        Compactor &operator=(Compactor const &) = delete;
+
+        void start();
+        void stop();
+
+    private:
+        nvr_logger logger;
+        string camera_id;
+        std::filesystem::path videos_path;
+        std::filesystem::path manifest_path;
+        CompactionConfig config;
+        Notifier *notifier;
+        Uploader *uploader;
+        time_t compacted_until = 0;
+
+        std::mutex mutex;
+        std::condition_variable wake;
+        bool running = false;
+        std::thread compactor_thread;
+
+        void run();
+        void compactWindows();
+        bool compact(const std::vector<ClipFile> &run);
+        bool mergeActivity(const std::vector<ClipFile> &run, const string &output_path);
+        void finish(const nlohmann::json &manifest);
+        void recover();
+    };
+}
+
+#endif //NEVER_CLI_COMPACTOR_H
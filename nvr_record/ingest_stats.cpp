@@ -0,0 +1,107 @@
+//
+// Packet loss, timestamp discontinuities and arrival jitter of the camera stream
+//
+
+#include "ingest_stats.h"
+
+extern "C" {
+#include <libavutil/time.h>
+}
+
+namespace nvr {
+
+    // Seconds between ingest summaries in the log
+    const int report_interval = 60;
+
+    // A DTS step this many times the usual frame interval (and at least a second) is a discontinuity
+    const double discontinuity_factor = 10.0;
+
+    IngestStats::IngestStats(const nvr_logger &logger, Metrics &metrics) {
+        this->logger = logger;
+        this->lost_total = &metrics.counter("nvr_record_rtp_lost_packets_total",
+                                            "RTP packets the camera sent that never arrived");
+        this->sequence_errors_total = &metrics.counter("nvr_record_rtp_sequence_errors_total",
+                                                       "RTP packets out of sequence");
+        this->discontinuities_total = &metrics.counter("nvr_record_timestamp_discontinuities_total",
+                                                       "Backwards or large forward jumps in the camera's timestamps");
+        this->jitter_seconds = &metrics.gauge("nvr_record_jitter_seconds",
+                                              "Interarrival jitter of frames, as in RFC 3550");
+    }
+
+    /**
+     * Forget the previous timestamps after a reconnect, the camera starts a new timeline
+     */
+    void IngestStats::reset() {
+        last_dts = AV_NOPTS_VALUE;
+        last_arrival = 0;
+    }
+
+    /**
+     * From libavformat's "RTP: missed %d packets" warning
+     * @param count
+     */
+    void IngestStats::missedPackets(int count) {
+        if (count <= 0)
+            return;
+
+        lost += count;
+        lost_total->add(count);
+    }
+
+    /**
+     * From libavformat's "bad cseq" warning
+     */
+    void IngestStats::sequenceError() {
+        sequence_errors++;
+        sequence_errors_total->add();
+    }
+
+    /**
+     * Called for every packet read, before it is written
+     * @param packet
+     * @param time_base Of the input stream
+     */
+    void IngestStats::packet(const AVPacket *packet, AVRational time_base) {
+        int64_t now = av_gettime_relative();
+        frames++;
+
+        if (packet->dts != AV_NOPTS_VALUE) {
+            double timestamp = (double) packet->dts * av_q2d(time_base);
+
+            if (last_dts != AV_NOPTS_VALUE) {
+                double step = timestamp - last_timestamp;
+
+                if (step <= 0 || (average_interval > 0 && step > std::max(1.0, average_interval * discontinuity_factor))) {
+                    discontinuities++;
+                    discontinuities_total->add();
+                    logger->warn("Ingest: timestamp jumped by {:.3f}s", step);
+                } else {
+                    average_interval = average_interval == 0 ? step : average_interval * 0.95 + step * 0.05;
+
+                    // RFC 3550 6.4.1: difference in spacing between arrival and send time, smoothed by 1/16
+                    double transit_change = (double) (now - last_arrival) / AV_TIME_BASE - step;
+                    jitter += (std::abs(transit_change) - jitter) / 16.0;
+                    jitter_seconds->set(jitter);
+                }
+            }
+
+            last_dts = packet->dts;
+            last_timestamp = timestamp;
+            last_arrival = now;
+        }
+
+        if (last_report == 0)
+            last_report = now;
+        else if (now - last_report >= (int64_t) report_interval * AV_TIME_BASE)
+            report(now);
+    }
+
+    void IngestStats::report(int64_t now) {
+        logger->info("Ingest: {} frames in {}s, {} RTP packets lost, {} out of sequence, {} timestamp "
+                     "discontinuities, jitter {:.1f}ms", frames, (now - last_report) / AV_TIME_BASE, lost,
+                     sequence_errors, discontinuities, jitter * 1000.0);
+
+        last_report = now;
+        frames = lost = sequence_errors = discontinuities = 0;
+    }
+}
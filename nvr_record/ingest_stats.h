@@ -0,0 +1,51 @@
+//
+// Packet loss, timestamp discontinuities and arrival jitter of the camera stream
+//
+
+#ifndef NEVER_CLI_INGEST_STATS_H
+#define NEVER_CLI_INGEST_STATS_H
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+#include "../common.h"
+#include "metrics.h"
+
+namespace nvr {
+
+    class IngestStats {
+    public:
+        IngestStats(const nvr_logger &logger, Metrics &metrics);
+        IngestStats(IngestStats const &) = delete;
+        IngestStats &operator=(IngestStats const &) = delete;
+
+        void packet(const AVPacket *packet, AVRational time_base);
+        void missedPackets(int count);
+        void sequenceError();
+        void reset();
+
+    private:
+        nvr_logger logger;
+        Counter *lost_total;
+        Counter *sequence_errors_total;
+        Counter *discontinuities_total;
+        Gauge *jitter_seconds;
+
+        int64_t last_dts = AV_NOPTS_VALUE;
+        int64_t last_arrival = 0;
+        double last_timestamp = 0;
+        double average_interval = 0;
+        double jitter = 0;
+
+        int64_t last_report = 0;
+        uint64_t frames = 0;
+        uint64_t lost = 0;
+        uint64_t sequence_errors = 0;
+        uint64_t discontinuities = 0;
+
+        void report(int64_t now);
+    };
+}
+
+#endif //NEVER_CLI_INGEST_STATS_H
@@ -0,0 +1,227 @@
+//
+// Lock-free recorder counters and histograms, served in Prometheus text format
+//
+
+#include "metrics.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+namespace nvr {
+
+    const std::vector<double> write_buckets = {0.0001, 0.0005, 0.001, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 1};
+    const std::vector<double> fetch_buckets = {0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30};
+
+    Histogram::Histogram(std::vector<double> bounds) : bounds(std::move(bounds)), buckets(this->bounds.size() + 1) {
+    }
+
+    void Histogram::observe(double seconds) {
+        size_t bucket = 0;
+
+        while (bucket < bounds.size() && seconds > bounds[bucket])
+            bucket++;
+
+        buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+        count.fetch_add(1, std::memory_order_relaxed);
+        sum_us.fetch_add((uint64_t) (std::max(seconds, 0.0) * 1000000.0), std::memory_order_relaxed);
+    }
+
+    string Histogram::render(const string &name, const string &labels) const {
+        string text;
+        uint64_t cumulative = 0;
+
+        // Buckets are stored individually, Prometheus wants them cumulative
+        for (size_t i = 0; i < bounds.size(); i++) {
+            cumulative += buckets[i].load(std::memory_order_relaxed);
+            text += fmt::format("{}_bucket{{{},le=\"{}\"}} {}\n", name, labels, bounds[i], cumulative);
+        }
+
+        cumulative += buckets[bounds.size()].load(std::memory_order_relaxed);
+        text += fmt::format("{}_bucket{{{},le=\"+Inf\"}} {}\n", name, labels, cumulative);
+        text += fmt::format("{}_sum{{{}}} {}\n", name, labels,
+                            (double) sum_us.load(std::memory_order_relaxed) / 1000000.0);
+        text += fmt::format("{}_count{{{}}} {}\n", name, labels, count.load(std::memory_order_relaxed));
+
+        return text;
+    }
+
+    /**
+     * @param logger
+     * @param camera_id Added as the camera label on every series
+     */
+    Metrics::Metrics(const nvr_logger &logger, const string &camera_id) {
+        this->logger = logger;
+        this->camera_id = camera_id;
+        this->labels = fmt::format("camera=\"{}\"", camera_id);
+        this->socket_path = "/tmp/nvr-metrics-" + camera_id + ".sock";
+    }
+
+    Metrics::~Metrics() {
+        stop();
+    }
+
+    Counter &Metrics::counter(const string &name, const string &help) {
+        std::lock_guard<std::mutex> lock(mutex);
+        Counter &counter = counters.emplace_back();
+
+        entries.push_back({name, help, "counter", &counter, nullptr, nullptr});
+        return counter;
+    }
+
+    Gauge &Metrics::gauge(const string &name, const string &help) {
+        std::lock_guard<std::mutex> lock(mutex);
+        Gauge &gauge = gauges.emplace_back();
+
+        entries.push_back({name, help, "gauge", nullptr, &gauge, nullptr});
+        return gauge;
+    }
+
+    Histogram &Metrics::histogram(const string &name, const string &help, std::vector<double> bounds) {
+        std::lock_guard<std::mutex> lock(mutex);
+        Histogram &histogram = histograms.emplace_back(std::move(bounds));
+
+        entries.push_back({name, help, "histogram", nullptr, nullptr, &histogram});
+        return histogram;
+    }
+
+    string Metrics::render() {
+        std::lock_guard<std::mutex> lock(mutex);
+        string text;
+
+        for (const auto &entry: entries) {
+            text += fmt::format("# HELP {} {}\n# TYPE {} {}\n", entry.name, entry.help, entry.name, entry.type);
+
+            if (entry.counter != nullptr)
+                text += fmt::format("{}{{{}}} {}\n", entry.name, labels, entry.counter->get());
+            else if (entry.gauge != nullptr)
+                text += fmt::format("{}{{{}}} {}\n", entry.name, labels, entry.gauge->get());
+            else
+                text += entry.histogram->render(entry.name, labels);
+        }
+
+        return text;
+    }
+
+    /**
+     * Serve the metrics over HTTP
+     * @param port Loopback TCP port, or 0 for /tmp/nvr-metrics-<camera>.sock
+     * @return
+     */
+    bool Metrics::start(int port) {
+        if (running)
+            return true;
+
+        string location;
+
+        if (port > 0) {
+            struct sockaddr_in address{};
+            address.sin_family = AF_INET;
+            address.sin_port = htons(port);
+            address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+            int reuse = 1;
+            server_sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+            if (server_sock == -1 || bind(server_sock, (struct sockaddr *) &address, sizeof(address)) < 0) {
+                logger->error("Could not bind metrics port {}", port);
+                close(server_sock);
+                server_sock = -1;
+                return false;
+            }
+
+            location = fmt::format("http://127.0.0.1:{}/metrics", port);
+        } else {
+            struct sockaddr_un address{};
+            address.sun_family = AF_UNIX;
+            strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+
+            unlink(socket_path.c_str());
+            server_sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+            if (server_sock == -1 || bind(server_sock, (struct sockaddr *) &address, sizeof(address)) < 0) {
+                logger->error("Could not bind metrics socket {}", socket_path);
+                close(server_sock);
+                server_sock = -1;
+                return false;
+            }
+
+            location = socket_path;
+        }
+
+        if (listen(server_sock, 8) < 0) {
+            logger->error("Could not listen for metrics requests on {}", location);
+            close(server_sock);
+            server_sock = -1;
+            return false;
+        }
+
+        running = true;
+        server_thread = std::thread(&Metrics::serve, this);
+
+        logger->info("Serving metrics on {}", location);
+        return true;
+    }
+
+    void Metrics::stop() {
+        if (!running)
+            return;
+
+        running = false;
+        shutdown(server_sock, SHUT_RDWR);
+        close(server_sock);
+        server_sock = -1;
+
+        if (server_thread.joinable())
+            server_thread.join();
+
+        unlink(socket_path.c_str());
+    }
+
+    void Metrics::serve() {
+        while (running) {
+            int client_sock = accept(server_sock, nullptr, nullptr);
+
+            if (client_sock < 0) {
+                if (!running)
+                    break;
+
+                continue;
+            }
+
+            handleConnection(client_sock);
+            close(client_sock);
+        }
+    }
+
+    /**
+     * Answers any request with the current metrics, scrapes are rare enough to serve one at a time
+     * @param client_sock
+     */
+    void Metrics::handleConnection(int client_sock) {
+        char buffer[2048];
+        string request;
+
+        struct timeval timeout{0, 200000};
+        setsockopt(client_sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        while (request.size() < sizeof(buffer) * 4 && request.find("\r\n\r\n") == string::npos) {
+            ssize_t bytes = recv(client_sock, buffer, sizeof(buffer), 0);
+
+            if (bytes <= 0)
+                break;
+
+            request.append(buffer, bytes);
+        }
+
+        string body = render();
+        string response = "HTTP/1.1 200 OK\r\n"
+                          "Content-Type: text/plain; version=0.0.4\r\n"
+                          "Connection: close\r\n"
+                          "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+
+        send(client_sock, response.data(), response.size(), MSG_NOSIGNAL);
+    }
+}
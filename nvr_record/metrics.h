@@ -0,0 +1,99 @@
+//
+// Lock-free recorder counters and histograms, served in Prometheus text format
+//
+
+#ifndef NEVER_CLI_METRICS_H
+#define NEVER_CLI_METRICS_H
+
+#include "../common.h"
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace nvr {
+
+    class Counter {
+    public:
+        void add(uint64_t amount = 1) { value.fetch_add(amount, std::memory_order_relaxed); }
+        uint64_t get() const { return value.load(std::memory_order_relaxed); }
+
+    private:
+        std::atomic<uint64_t> value{0};
+    };
+
+    class Gauge {
+    public:
+        void set(double amount) { value.store(amount, std::memory_order_relaxed); }
+        double get() const { return value.load(std::memory_order_relaxed); }
+
+    private:
+        std::atomic<double> value{0};
+    };
+
+    /**
+     * Fixed buckets, each observation is a scan of a handful of bounds and three relaxed adds
+     */
+    class Histogram {
+    public:
+        explicit Histogram(std::vector<double> bounds);
+        void observe(double seconds);
+        string render(const string &name, const string &labels) const;
+
+    private:
+        std::vector<double> bounds;
+        std::deque<std::atomic<uint64_t>> buckets;
+        std::atomic<uint64_t> count{0};
+        std::atomic<uint64_t> sum_us{0};
+    };
+
+    class Metrics {
+    public:
+        Metrics(const nvr_logger &logger, const string &camera_id);
+        ~Metrics();
+        Metrics(Metrics const &) = delete;
+        Metrics &operator=(Metrics const &) = delete;
+
+        Counter &counter(const string &name, const string &help);
+        Gauge &gauge(const string &name, const string &help);
+        Histogram &histogram(const string &name, const string &help, std::vector<double> bounds);
+
+        string render();
+        bool start(int port);
+        void stop();
+
+    private:
+        struct Entry {
+            string name;
+            string help;
+            string type;
+            Counter *counter;
+            Gauge *gauge;
+            Histogram *histogram;
+        };
+
+        nvr_logger logger;
+        string camera_id;
+        string labels;
+        std::mutex mutex;
+        std::vector<Entry> entries;
+        std::deque<Counter> counters;
+        std::deque<Gauge> gauges;
+        std::deque<Histogram> histograms;
+
+        string socket_path;
+        int server_sock = -1;
+        std::atomic<bool> running = false;
+        std::thread server_thread;
+
+        void serve();
+        void handleConnection(int client_sock);
+    };
+
+    // Bucket bounds in seconds for disk writes and for network fetches
+    extern const std::vector<double> write_buckets;
+    extern const std::vector<double> fetch_buckets;
+}
+
+#endif //NEVER_CLI_METRICS_H
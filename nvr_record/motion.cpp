@@ -0,0 +1,285 @@
+//
+// Motion detection on the sub stream, block differencing of a small luma plane
+//
+
+#include "motion.h"
+#include "../simd.h"
+
+extern "C" {
+#include <libavutil/time.h>
+}
+
+namespace nvr {
+
+    // Sub stream is scaled to this before comparing, 16x16 blocks make a 20x11 grid
+    const int analysis_width = 320;
+    const int analysis_height = 176;
+    const int block_size = 16;
+    const int block_columns = analysis_width / block_size;
+    const int block_rows = analysis_height / block_size;
+
+    // More than this share of blocks changing at once is lighting (IR switch, clouds, lights on), not motion
+    const double global_change = 0.8;
+
+    // Without a frame analysed for this long the detector is blind and recording carries on regardless
+    const int64_t stall_timeout = 5 * AV_TIME_BASE;
+
+    // Time allowed for the sub stream to connect and deliver its first frame, the gate stays closed meanwhile
+    const int64_t startup_timeout = 20 * AV_TIME_BASE;
+
+    // Seconds between attempts to reopen the sub stream
+    const int reconnect_delay = 5;
+
+    /**
+     * @param logger
+     * @param config
+     * @param stream_url Full sub stream URL, with credentials
+     * @param sanitized_url For logging
+     * @param metrics
+     */
+    MotionDetector::MotionDetector(const nvr_logger &logger, const MotionConfig &config, string stream_url,
+                                   string sanitized_url, Metrics &metrics) {
+        this->logger = logger;
+        this->config = config;
+        this->stream_url = std::move(stream_url);
+        this->sanitized_url = std::move(sanitized_url);
+        this->events_total = &metrics.counter("nvr_record_motion_events_total", "Motion events seen on the sub stream");
+        this->motion_state = &metrics.gauge("nvr_record_motion", "1 while motion is seen");
+
+        buildMask();
+    }
+
+    MotionDetector::~MotionDetector() {
+        stop();
+    }
+
+    void MotionDetector::start() {
+        if (running)
+            return;
+
+        running = true;
+        started = av_gettime_relative();
+        detector_thread = std::thread(&MotionDetector::run, this);
+
+        logger->info("Motion detection on '{}' at {} fps, recording {}s past the last motion", sanitized_url,
+                     config.fps, config.post_roll);
+    }
+
+    void MotionDetector::stop() {
+        if (!running)
+            return;
+
+        running = false;
+
+        if (detector_thread.joinable())
+            detector_thread.join();
+    }
+
+    /**
+     * Whether the main stream should be recorded. Fails open, a detector that
+     * can't see the sub stream (or never connects) never stops the recording.
+     * @return
+     */
+    bool MotionDetector::active() {
+        int64_t now = av_gettime_relative();
+
+        // Closed until the first analysis, so every start doesn't record a clip of nothing
+        if (last_analysis == 0)
+            return now - started > startup_timeout;
+
+        if (now - last_analysis > stall_timeout)
+            return true;
+
+        return now - last_motion < (int64_t) config.post_roll * AV_TIME_BASE;
+    }
+
+    /**
+     * Mark the blocks whose centre falls in a masked region
+     */
+    void MotionDetector::buildMask() {
+        masked.assign(block_columns * block_rows, false);
+
+        for (int row = 0; row < block_rows; row++) {
+            for (int column = 0; column < block_columns; column++) {
+                double x = (column + 0.5) / block_columns;
+                double y = (row + 0.5) / block_rows;
+
+                for (const auto &region: config.mask) {
+                    if (x >= region.x && x < region.x + region.width && y >= region.y && y < region.y + region.height)
+                        masked[row * block_columns + column] = true;
+                }
+            }
+        }
+    }
+
+    int MotionDetector::interrupt(void *opaque) {
+        return !static_cast<MotionDetector *>(opaque)->running;
+    }
+
+    bool MotionDetector::open() {
+        AVDictionary *params = nullptr;
+        av_dict_set(&params, "rtsp_flags", "prefer_tcp", 0);
+        av_dict_set(&params, "timeout", "5000000", 0);
+
+        format_context = avformat_alloc_context();
+        format_context->interrupt_callback = {interrupt, this};
+
+        int result = avformat_open_input(&format_context, stream_url.c_str(), nullptr, &params);
+        av_dict_free(&params);
+
+        if (result != 0) {
+            logger->warn("Motion: cannot open '{}'", sanitized_url);
+            return false;
+        }
+
+        if (avformat_find_stream_info(format_context, nullptr) < 0) {
+            logger->warn("Motion: cannot find stream info");
+            return false;
+        }
+
+        const AVCodec *decoder = nullptr;
+        stream_index = av_find_best_stream(format_context, AVMEDIA_TYPE_VIDEO, -1, -1, &decoder, 0);
+
+        if (stream_index < 0 || decoder == nullptr) {
+            logger->warn("Motion: no decodable video stream");
+            return false;
+        }
+
+        for (unsigned int i = 0; i < format_context->nb_streams; i++) {
+            if ((int) i != stream_index)
+                format_context->streams[i]->discard = AVDISCARD_ALL;
+        }
+
+        codec_context = avcodec_alloc_context3(decoder);
+        avcodec_parameters_to_context(codec_context, format_context->streams[stream_index]->codecpar);
+
+        // Motion doesn't need a pretty picture: one thread, no deblocking, skip frames nothing refers to
+        codec_context->thread_count = 1;
+        codec_context->flags2 |= AV_CODEC_FLAG2_FAST;
+        codec_context->skip_loop_filter = AVDISCARD_ALL;
+        codec_context->skip_frame = AVDISCARD_NONREF;
+
+        if (avcodec_open2(codec_context, decoder, nullptr) < 0) {
+            logger->warn("Motion: cannot open {} decoder", decoder->name);
+            return false;
+        }
+
+        previous.clear();
+        return true;
+    }
+
+    void MotionDetector::close() {
+        if (codec_context != nullptr)
+            avcodec_free_context(&codec_context);
+
+        if (format_context != nullptr)
+            avformat_close_input(&format_context);
+
+        if (scaler != nullptr) {
+            sws_freeContext(scaler);
+            scaler = nullptr;
+        }
+    }
+
+    void MotionDetector::run() {
+        AVPacket *packet = av_packet_alloc();
+        AVFrame *frame = av_frame_alloc();
+
+        while (running) {
+            if (open()) {
+                while (running && av_read_frame(format_context, packet) >= 0) {
+                    if (packet->stream_index == stream_index && avcodec_send_packet(codec_context, packet) >= 0) {
+                        while (avcodec_receive_frame(codec_context, frame) >= 0) {
+                            int64_t now = av_gettime_relative();
+
+                            // Decode everything the stream needs, but only look at fps frames a second
+                            if (now >= next_analysis) {
+                                next_analysis = now + AV_TIME_BASE / std::max(config.fps, 1);
+                                analyze(frame);
+                            }
+
+                            av_frame_unref(frame);
+                        }
+                    }
+
+                    av_packet_unref(packet);
+                }
+
+                if (running)
+                    logger->warn("Motion: sub stream ended, recording continuously until it is back");
+            }
+
+            close();
+
+            for (int i = 0; i < reconnect_delay * 10 && running; i++)
+                av_usleep(100000);
+        }
+
+        av_frame_free(&frame);
+        av_packet_free(&packet);
+    }
+
+    void MotionDetector::analyze(const AVFrame *frame) {
+        scaler = sws_getCachedContext(scaler, frame->width, frame->height, (AVPixelFormat) frame->format,
+                                      analysis_width, analysis_height, AV_PIX_FMT_GRAY8, SWS_AREA,
+                                      nullptr, nullptr, nullptr);
+
+        if (scaler == nullptr)
+            return;
+
+        current.resize(analysis_width * analysis_height);
+
+        uint8_t *destination[1] = {current.data()};
+        int destination_stride[1] = {analysis_width};
+        sws_scale(scaler, frame->data, frame->linesize, 0, frame->height, destination, destination_stride);
+
+        int64_t now = av_gettime_relative();
+        last_analysis = now;
+
+        if (previous.size() != current.size()) {
+            std::swap(previous, current);
+            return;
+        }
+
+        int changed = 0;
+        int watched = 0;
+        const uint64_t block_threshold = (uint64_t) config.sensitivity * block_size * block_size;
+
+        for (int row = 0; row < block_rows; row++) {
+            for (int column = 0; column < block_columns; column++) {
+                if (masked[row * block_columns + column])
+                    continue;
+
+                uint64_t difference = 0;
+                size_t offset = (size_t) row * block_size * analysis_width + column * block_size;
+
+                // One 16 byte SAD per block row
+                for (int line = 0; line < block_size; line++, offset += analysis_width)
+                    difference += sumAbsDiff(current.data() + offset, previous.data() + offset, block_size);
+
+                watched++;
+
+                if (difference > block_threshold)
+                    changed++;
+            }
+        }
+
+        std::swap(previous, current);
+
+        bool motion = changed >= config.min_blocks && changed <= watched * global_change;
+
+        if (motion) {
+            last_motion = now;
+
+            if (!in_motion) {
+                logger->info("Motion: {} of {} blocks changed", changed, watched);
+                events_total->add();
+            }
+        }
+
+        if (motion != in_motion) {
+            in_motion = motion;
+            motion_state->set(motion ? 1 : 0);
+        }
+    }
+}
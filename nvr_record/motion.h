@@ -0,0 +1,69 @@
+//
+// Motion detection on the sub stream, block differencing of a small luma plane
+//
+
+#ifndef NEVER_CLI_MOTION_H
+#define NEVER_CLI_MOTION_H
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libswscale/swscale.h>
+}
+
+#include "../common.h"
+#include "metrics.h"
+#include <atomic>
+#include <thread>
+#include <vector>
+
+namespace nvr {
+
+    class MotionDetector {
+    public:
+        MotionDetector(const nvr_logger &logger, const MotionConfig &config, string stream_url,
+                       string sanitized_url, Metrics &metrics);
+        ~MotionDetector();
+        MotionDetector(MotionDetector const &) = delete;
+        MotionDetector &operator=(MotionDetector const &) = delete;
+
+        void start();
+        void stop();
+        bool active();
+
+    private:
+        nvr_logger logger;
+        MotionConfig config;
+        string stream_url;
+        string sanitized_url;
+        Counter *events_total;
+        Gauge *motion_state;
+
+        AVFormatContext *format_context = nullptr;
+        AVCodecContext *codec_context = nullptr;
+        SwsContext *scaler = nullptr;
+        int stream_index = -1;
+
+        std::vector<uint8_t> current;
+        std::vector<uint8_t> previous;
+        std::vector<bool> masked;
+        int64_t next_analysis = 0;
+        bool in_motion = false;
+
+        std::atomic<bool> running = false;
+        std::atomic<int64_t> last_motion = 0;
+        std::atomic<int64_t> last_analysis = 0;
+        int64_t started = 0;
+        std::thread detector_thread;
+
+        void run();
+        bool open();
+        void close();
+        void analyze(const AVFrame *frame);
+        void buildMask();
+
+        static int interrupt(void *opaque);
+    };
+}
+
+#endif //NEVER_CLI_MOTION_H
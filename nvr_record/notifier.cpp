@@ -0,0 +1,327 @@
+//
+// Clip and snapshot notifications to the Never socket, sent off the packet loop
+//
+
+#include "notifier.h"
+
+#include <algorithm>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+using json = nlohmann::json;
+namespace fs = std::filesystem;
+
+namespace nvr {
+
+    const char *notification_socket = "/tmp/nvr.socket";
+
+    // Events waiting for the sender; snapshots give way first when it is full
+    const size_t max_queued = 256;
+
+    // Datagrams handed to one sendmmsg call
+    const size_t max_batch = 32;
+
+    const std::chrono::milliseconds min_backoff{250};
+    const std::chrono::milliseconds max_backoff{30000};
+
+    /**
+     * @param logger
+     * @param journal_path Clip events that could not be delivered are kept here until the listener is back
+     * @param metrics
+     */
+    Notifier::Notifier(const nvr_logger &logger, string journal_path, Metrics &metrics) {
+        this->logger = logger;
+        this->journal_path = std::move(journal_path);
+        this->queue_depth = &metrics.gauge("nvr_record_notification_queue", "Notifications waiting to be sent");
+        this->sent_total = &metrics.counter("nvr_record_notifications_sent_total", "Notifications delivered");
+        this->journaled_total = &metrics.counter("nvr_record_notifications_journaled_total",
+                                                 "Notifications written to the journal while the listener was down");
+        this->dropped_total = &metrics.counter("nvr_record_notifications_dropped_total",
+                                               "Snapshot notifications superseded or dropped");
+        this->next_attempt = std::chrono::steady_clock::now();
+
+        std::error_code error;
+        this->journal_pending = fs::file_size(this->journal_path, error) > 0 && !error;
+    }
+
+    Notifier::~Notifier() {
+        stop();
+    }
+
+    void Notifier::start() {
+        if (running)
+            return;
+
+        running = true;
+        sender_thread = std::thread(&Notifier::run, this);
+
+        if (journal_pending)
+            logger->info("Replaying undelivered notifications from {}", journal_path);
+    }
+
+    /**
+     * Send or journal whatever is queued, then stop the sender
+     */
+    void Notifier::stop() {
+        if (!running)
+            return;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            running = false;
+        }
+
+        wake.notify_one();
+
+        if (sender_thread.joinable())
+            sender_thread.join();
+
+        closeSocket();
+    }
+
+    /**
+     * Queue an event without blocking. A newer snapshot replaces one still queued,
+     * clip events are never dropped.
+     * @param event
+     */
+    void Notifier::post(const json &event) {
+        Notification notification = {event.value("type", ""), event.dump()};
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            if (notification.type == "snapshot") {
+                auto queued = std::find_if(queue.begin(), queue.end(), [](const Notification &queued) {
+                    return queued.type == "snapshot";
+                });
+
+                if (queued != queue.end()) {
+                    queue.erase(queued);
+                    dropped_total->add();
+                }
+            }
+
+            if (queue.size() >= max_queued) {
+                auto oldest_snapshot = std::find_if(queue.begin(), queue.end(), [](const Notification &queued) {
+                    return queued.type == "snapshot";
+                });
+
+                if (oldest_snapshot != queue.end()) {
+                    queue.erase(oldest_snapshot);
+                    dropped_total->add();
+                }
+            }
+
+            queue.push_back(std::move(notification));
+            queue_depth->set((double) queue.size());
+        }
+
+        wake.notify_one();
+    }
+
+    void Notifier::run() {
+        while (true) {
+            std::vector<Notification> batch;
+
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+
+                // Disconnected with a journal to replay, wake up for the retry even if nothing new arrives
+                if (sock < 0 && journal_pending)
+                    wake.wait_until(lock, next_attempt, [this] { return !running || !queue.empty(); });
+                else
+                    wake.wait(lock, [this] { return !running || !queue.empty(); });
+
+                if (!running && queue.empty())
+                    break;
+
+                while (!queue.empty()) {
+                    batch.push_back(std::move(queue.front()));
+                    queue.pop_front();
+                }
+
+                queue_depth->set(0);
+            }
+
+            deliver(batch);
+        }
+
+        // One last try on the way out, anything left over waits in the journal
+        if (sock < 0)
+            next_attempt = std::chrono::steady_clock::now();
+
+        std::vector<Notification> none;
+        deliver(none);
+    }
+
+    void Notifier::deliver(std::vector<Notification> &batch) {
+        if (sock < 0 && std::chrono::steady_clock::now() >= next_attempt && !connectSocket()) {
+            if (backoff.count() == 0)
+                logger->warn("Notification socket {} unavailable, journaling clip events", notification_socket);
+
+            scheduleRetry();
+        }
+
+        // Older events go out first so the listener sees clips in order
+        if (sock >= 0 && journal_pending && !replayJournal())
+            scheduleRetry();
+
+        if (sock < 0 || journal_pending) {
+            spill(batch, 0);
+            return;
+        }
+
+        size_t sent = sendBatch(batch);
+
+        if (sent < batch.size()) {
+            logger->warn("Notification socket unavailable: {}, retrying in {}ms", strerror(errno),
+                         std::max(backoff, min_backoff).count());
+            spill(batch, sent);
+            scheduleRetry();
+        } else {
+            backoff = std::chrono::milliseconds(0);
+        }
+    }
+
+    bool Notifier::connectSocket() {
+        if ((sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1)
+            return false;
+
+        struct sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        strncpy(address.sun_path, notification_socket, sizeof(address.sun_path) - 1);
+
+        if (::connect(sock, (struct sockaddr *) &address, sizeof(address)) == -1) {
+            closeSocket();
+            return false;
+        }
+
+        return true;
+    }
+
+    void Notifier::closeSocket() {
+        if (sock >= 0) {
+            close(sock);
+            sock = -1;
+        }
+    }
+
+    void Notifier::scheduleRetry() {
+        closeSocket();
+
+        backoff = std::min(std::max(backoff * 2, min_backoff), max_backoff);
+        next_attempt = std::chrono::steady_clock::now() + backoff;
+    }
+
+    /**
+     * One datagram per event, up to max_batch per system call
+     * @param batch
+     * @return Number of events sent before the first failure
+     */
+    size_t Notifier::sendBatch(const std::vector<Notification> &batch) {
+        size_t sent = 0;
+
+        while (sent < batch.size()) {
+            size_t count = std::min(max_batch, batch.size() - sent);
+            std::vector<struct iovec> vectors(count);
+            std::vector<struct mmsghdr> messages(count);
+
+            for (size_t i = 0; i < count; i++) {
+                const string &payload = batch[sent + i].payload;
+
+                vectors[i].iov_base = (void *) payload.data();
+                vectors[i].iov_len = payload.size();
+                messages[i] = {};
+                messages[i].msg_hdr.msg_iov = &vectors[i];
+                messages[i].msg_hdr.msg_iovlen = 1;
+            }
+
+            int result = sendmmsg(sock, messages.data(), count, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+            if (result <= 0)
+                break;
+
+            sent += result;
+            sent_total->add(result);
+        }
+
+        return sent;
+    }
+
+    /**
+     * @return true once the journal is delivered and removed
+     */
+    bool Notifier::replayJournal() {
+        std::vector<Notification> journaled;
+
+        {
+            std::ifstream journal(journal_path);
+            string line;
+
+            while (std::getline(journal, line)) {
+                if (!line.empty())
+                    journaled.push_back({"clip", line});
+            }
+        }
+
+        size_t sent = sendBatch(journaled);
+
+        if (sent < journaled.size()) {
+            // Keep the rest, rewritten so a crash mid-way can't lose or duplicate the tail
+            string temporary_path = journal_path + ".tmp";
+
+            {
+                std::ofstream journal(temporary_path, std::ios::trunc);
+
+                for (size_t i = sent; i < journaled.size(); i++)
+                    journal << journaled[i].payload << '\n';
+            }
+
+            std::error_code error;
+            fs::rename(temporary_path, journal_path, error);
+            return false;
+        }
+
+        std::error_code error;
+        fs::remove(journal_path, error);
+        journal_pending = false;
+
+        if (!journaled.empty())
+            logger->info("Delivered {} journaled notifications", journaled.size());
+
+        return true;
+    }
+
+    /**
+     * Append undelivered clip events to the journal. Snapshots are not kept, a newer one will follow.
+     * @param batch
+     * @param offset First undelivered event
+     */
+    void Notifier::spill(const std::vector<Notification> &batch, size_t offset) {
+        std::ofstream journal;
+
+        for (size_t i = offset; i < batch.size(); i++) {
+            if (batch[i].type == "snapshot") {
+                dropped_total->add();
+                continue;
+            }
+
+            if (!journal.is_open()) {
+                std::error_code error;
+                fs::create_directories(fs::path(journal_path).parent_path(), error);
+                journal.open(journal_path, std::ios::app);
+            }
+
+            journal << batch[i].payload << '\n';
+            journaled_total->add();
+            journal_pending = true;
+        }
+
+        if (journal.is_open()) {
+            journal.flush();
+
+            if (!journal)
+                logger->error("Could not write notification journal {}", journal_path);
+        }
+    }
+}
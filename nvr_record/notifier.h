@@ -0,0 +1,66 @@
+//
+// Clip and snapshot notifications to the Never socket, sent off the packet loop
+//
+
+#ifndef NEVER_CLI_NOTIFIER_H
+#define NEVER_CLI_NOTIFIER_H
+
+#include "../common.h"
+#include "metrics.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace nvr {
+
+    struct Notification {
+        string type;
+        string payload;
+    };
+
+    class Notifier {
+    public:
+        Notifier(const nvr_logger &logger, string journal_path, Metrics &metrics);
+        ~Notifier();
+        Notifier(Notifier const &) = delete;
+        Notifier &operator=(Notifier const &) = delete;
+
+        void start();
+        void stop();
+        void post(const nlohmann::json &event);
+
+    private:
+        nvr_logger logger;
+        string journal_path;
+        Gauge *queue_depth;
+        Counter *sent_total;
+        Counter *journaled_total;
+        Counter *dropped_total;
+
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::deque<Notification> queue;
+        std::atomic<bool> running = false;
+        std::thread sender_thread;
+
+        int sock = -1;
+        bool journal_pending = false;
+        std::chrono::milliseconds backoff{0};
+        std::chrono::steady_clock::time_point next_attempt;
+
+        void run();
+        void deliver(std::vector<Notification> &batch);
+        bool connectSocket();
+        void closeSocket();
+        void scheduleRetry();
+        size_t sendBatch(const std::vector<Notification> &batch);
+        bool replayJournal();
+        void spill(const std::vector<Notification> &batch, size_t offset);
+    };
+}
+
+#endif //NEVER_CLI_NOTIFIER_H
@@ -4,7 +4,6 @@
 #pragma clang diagnostic push
 #pragma ide diagnostic ignored "misc-no-recursion"
 
-#include <sys/un.h>
 #include "recorder.h"
 #include "../common.h"
 
@@ -14,12 +13,28 @@ namespace fs = std::filesystem;
 
 namespace nvr {
 
+    // A longer GOP than this (about 20s at 30fps) is not kept for pre-roll
+    const size_t max_pre_roll_packets = 600;
+
     std::shared_ptr<Recorder> Recorder::instance() {
         static std::shared_ptr<Recorder> s{new Recorder};
         return s;
     }
 
-    void Recorder::logCallback([[maybe_unused]] void *ptr, int level, const char *fmt, va_list vargs) {
+    void Recorder::logCallback(void *ptr, int level, const char *fmt, va_list vargs) {
+        // rtpdec's own view of the network, only visible through its log lines. The motion
+        // detector's sub stream logs through here too, so only count the main stream's.
+        if (ptr != nullptr && ptr == instance()->input_format_context && instance()->ingest_stats != nullptr) {
+            if (strstr(fmt, "missed %d packets") != nullptr) {
+                va_list args;
+                va_copy(args, vargs);
+                instance()->ingest_stats->missedPackets(va_arg(args, int));
+                va_end(args);
+            } else if (strstr(fmt, "bad cseq") != nullptr) {
+                instance()->ingest_stats->sequenceError();
+            }
+        }
+
         if (level <= AV_LOG_ERROR) {
             vprintf(fmt, vargs);
         } else {
@@ -43,6 +58,7 @@ namespace nvr {
                     if (dot_pos == std::string::npos) return;
                     segment_source_file_name.replace(dot_pos, dot_path.length(), "");
 
+                    int64_t finalize_started = av_gettime_relative();
                     path segment_file_dest_path = (segment_dest_file_name.c_str());
                     path segment_file_src_path = (segment_source_file_name.c_str());
 
@@ -57,6 +73,13 @@ namespace nvr {
 
                     instance()->logger->info("Removing temporary clip from '{}'", segment_file_src_path.string());
                     fs::remove(segment_file_src_path);
+
+                    if (instance()->activity != nullptr)
+                        instance()->activity->finishClip(segment_file_dest_path.string());
+
+                    instance()->clips_total->add();
+                    instance()->finalize_latency->observe(
+                            (double) (av_gettime_relative() - finalize_started) / AV_TIME_BASE);
                     instance()->notifyClip(segment_file_dest_path.string());
                 } else if (string_fmt.find(string("starts")) != std::string::npos) {
                     auto segment_file_name_string = string(segment_file_name);
@@ -98,13 +121,120 @@ namespace nvr {
         this->port = config.port;
         this->snapshot_interval = config.snapshot_interval;
         this->logger = buildLogger(config);
-        this->connectSocket();
+        this->setupMetrics(config);
+
+        path journal_path = path(config.output_path) / "logs" / config.stream_id / "notifications.jsonl";
+        this->notifier = std::make_shared<Notifier>(this->logger, journal_path.string(), *this->metrics);
+        this->notifier->start();
+
+        if (config.ring_size > 0) {
+            this->ring = std::make_shared<RingStore>(this->logger, RingStore::filePath(config.output_path,
+                                                                                       config.stream_id),
+                                                     config.ring_size, *this->metrics);
+
+            // Without its ring the camera still records, to clip files
+            if (!this->ring->open()) {
+                this->logger->error("Ring storage unavailable, recording to clips");
+                this->ring = nullptr;
+            }
+        }
+
+        // Both work on clip files, which a ring doesn't have
+        if (this->ring != nullptr && (config.activity_index || config.compaction.enabled))
+            this->logger->warn("Activity index and compaction are not used with ring storage");
+
+        if (config.activity_index && this->ring == nullptr)
+            this->activity = std::make_shared<ActivityIndex>(this->logger);
+
+        // Without a sub stream the detector would decode the full main stream, record continuously instead
+        if (config.motion.enabled && config.sub_stream_url == config.stream_url)
+            this->logger->warn("Motion recording needs subStreamURL, recording continuously");
+
+        if (config.motion.enabled && config.sub_stream_url != config.stream_url) {
+            this->motion_post_roll = config.motion.post_roll;
+
+            string sub_stream_url = buildStreamURL(config.sub_stream_url, this->ip_address, this->port,
+                                                   this->rtsp_password, this->rtsp_username);
+            this->motion = std::make_shared<MotionDetector>(this->logger, config.motion, sub_stream_url,
+                                                            sanitizeStreamURL(sub_stream_url, this->rtsp_password),
+                                                            *this->metrics);
+        }
+
+        // Uploads follow clip events, which a ring doesn't send
+        if (config.upload.enabled && this->ring != nullptr)
+            this->logger->warn("Uploads are not used with ring storage");
+
+        if (config.upload.enabled && this->ring == nullptr) {
+            path queue_path = path(config.output_path) / "logs" / config.stream_id / "uploads.json";
+            this->uploader = std::make_shared<Uploader>(this->logger, config.stream_id, config.upload,
+                                                        queue_path.string(), *this->metrics);
+            this->uploader->start();
+        }
+
+        // After the uploader, which has to have its queue loaded before a merge touches it
+        if (config.compaction.enabled && this->ring == nullptr) {
+            this->compactor = std::make_shared<Compactor>(this->logger, config.stream_id, config.output_path,
+                                                          config.compaction, *this->notifier, this->uploader.get());
+            this->compactor->start();
+        }
+
         this->configured = true;
     }
 
+    /**
+     * Register the recorder's series. They are always counted, the endpoint is only opened when configured.
+     * @param config
+     */
+    void Recorder::setupMetrics(const CameraConfig &config) {
+        metrics = std::make_shared<Metrics>(logger, config.stream_id);
+
+        packets_total = &metrics->counter("nvr_record_packets_total", "Packets read from the camera");
+        bytes_total = &metrics->counter("nvr_record_bytes_total", "Bytes read from the camera");
+        keyframes_total = &metrics->counter("nvr_record_keyframes_total", "Keyframes read from the camera");
+        write_errors = &metrics->counter("nvr_record_write_errors_total", "Packets the muxer failed to write");
+        write_latency = &metrics->histogram("nvr_record_write_seconds", "Time spent in av_interleaved_write_frame",
+                                            write_buckets);
+        snapshot_latency = &metrics->histogram("nvr_record_snapshot_seconds", "Time to fetch a snapshot",
+                                               fetch_buckets);
+        snapshot_failures = &metrics->counter("nvr_record_snapshot_failures_total", "Snapshots that failed");
+        reconnects = &metrics->counter("nvr_record_reconnects_total", "Connection attempts after a failure");
+        connect_latency = &metrics->histogram("nvr_record_connect_seconds", "Time to open the camera stream",
+                                              fetch_buckets);
+        connected_state = &metrics->gauge("nvr_record_connected", "1 while connected to the camera");
+        clips_total = &metrics->counter("nvr_record_clips_total", "Clips finished");
+        finalize_latency = &metrics->histogram("nvr_record_clip_finalize_seconds",
+                                               "Time to move a finished clip into place", write_buckets);
+
+        ingest_stats = std::make_shared<IngestStats>(logger, *metrics);
+
+        if (config.metrics_enabled)
+            metrics->start(config.metrics_port);
+    }
+
     void Recorder::quit() {
         this->logger->info("Exiting...");
 
+        if (this->motion != nullptr)
+            this->motion->stop();
+
+        clearPreRoll();
+
+        // The ring holds the last fragment in memory until the muxer is closed
+        if (this->ring != nullptr && this->output_format_context != nullptr)
+            closeMuxer();
+
+        if (this->compactor != nullptr)
+            this->compactor->stop();
+
+        // Its multi handle has to go before curl_global_cleanup below
+        this->uploader = nullptr;
+
+        if (this->notifier != nullptr)
+            this->notifier->stop();
+
+        if (this->metrics != nullptr)
+            this->metrics->stop();
+
         if (this->curl_handle != nullptr) {
             curl_easy_cleanup(this->curl_handle);
             curl_global_cleanup();
@@ -129,6 +259,10 @@ namespace nvr {
 
         this->input_index = -1;
 
+        int64_t connect_started = av_gettime_relative();
+        if (this->error_count > 0)
+            reconnects->add();
+
         AVDictionary *params = nullptr;
         av_dict_set(&params, "rtsp_flags", "prefer_tcp", AV_DICT_APPEND);
 
@@ -167,13 +301,24 @@ namespace nvr {
         if (this->input_index < 0)
             return handleError("Cannot find input video stream");
 
+        // Audio and data streams are neither recorded nor measured
+        for (int i = 0; i < input_format_context->nb_streams; i++) {
+            if (i != input_index)
+                input_format_context->streams[i]->discard = AVDISCARD_ALL;
+        }
+
         this->connected = true;
+        ingest_stats->reset();
+        connected_state->set(1);
+        connect_latency->observe((double) (av_gettime_relative() - connect_started) / AV_TIME_BASE);
+
         return true;
     }
 
     bool Recorder::handleError(const string &message, bool close_input) {
         this->error_count += 1;
         logger->error(message);
+        connected_state->set(0);
 
         if (close_input)
             avformat_close_input(&this->input_format_context);
@@ -220,7 +365,13 @@ namespace nvr {
 
         if (snapshot_file) {
             curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, snapshot_file);
-            curl_easy_perform(curl_handle);
+
+            int64_t fetch_started = av_gettime_relative();
+            CURLcode result = curl_easy_perform(curl_handle);
+            snapshot_latency->observe((double) (av_gettime_relative() - fetch_started) / AV_TIME_BASE);
+
+            if (result != CURLE_OK)
+                snapshot_failures->add();
 
             fclose(snapshot_file);
             this->logger->info("Validating snapshot");
@@ -245,6 +396,7 @@ namespace nvr {
             this->notifySnapshot(snapshot_file_path);
         } else {
             this->logger->error("Invalid JPEG!\r\n");
+            snapshot_failures->add();
             remove(snapshot_file_path.c_str());
         }
     }
@@ -264,23 +416,36 @@ namespace nvr {
 
     int Recorder::setupMuxer() {
         AVDictionary *params = nullptr;
-        string output_file_str = generateOutputFilename(this->camera_id, this->output_path, video, true);
 
-        // Segment muxer
-        output_format = (AVOutputFormat *) av_guess_format("segment", output_file_str.c_str(), nullptr);
+        if (ring != nullptr) {
+            // One continuous fragmented MP4, cut into fragments at key frames by the muxer and stored by the ring
+            output_format = (AVOutputFormat *) av_guess_format("mp4", nullptr, nullptr);
+            avformat_alloc_output_context2(&this->output_format_context, output_format, nullptr, nullptr);
 
-        // Allocate output format context
-        avformat_alloc_output_context2(&this->output_format_context, output_format, nullptr, output_file_str.c_str());
+            output_format_context->pb = ring->openSession(av_gettime() / 1000);
+            output_format_context->flags |= AVFMT_FLAG_CUSTOM_IO;
 
-        av_opt_set_int(output_format_context->priv_data, "keyint", 30, 0);
-        av_opt_set_int(output_format_context->priv_data, "g", 1, 0);
-        av_opt_set_int(output_format_context->priv_data, "bufsize", 100, 0);
+            av_dict_set(&params, "movflags", "+frag_keyframe+empty_moov+default_base_moof", 0);
+        } else {
+            string output_file_str = generateOutputFilename(this->camera_id, this->output_path, video, true);
 
-        // Set our muxer options
-        av_dict_set(&params, "strftime", "true", 0);
-        av_dict_set(&params, "reset_timestamps", "true", 0);
-        av_dict_set(&params, "segment_time", std::to_string(clip_runtime).c_str(), 0);
-        av_dict_set(&params, "movflags", "+frag_keyframe", 0);
+            // Segment muxer
+            output_format = (AVOutputFormat *) av_guess_format("segment", output_file_str.c_str(), nullptr);
+
+            // Allocate output format context
+            avformat_alloc_output_context2(&this->output_format_context, output_format, nullptr,
+                                           output_file_str.c_str());
+
+            av_opt_set_int(output_format_context->priv_data, "keyint", 30, 0);
+            av_opt_set_int(output_format_context->priv_data, "g", 1, 0);
+            av_opt_set_int(output_format_context->priv_data, "bufsize", 100, 0);
+
+            // Set our muxer options
+            av_dict_set(&params, "strftime", "true", 0);
+            av_dict_set(&params, "reset_timestamps", "true", 0);
+            av_dict_set(&params, "segment_time", std::to_string(clip_runtime).c_str(), 0);
+            av_dict_set(&params, "movflags", "+frag_keyframe", 0);
+        }
 
         // Set flags on output format context
         if (output_format_context->oformat->flags & AVFMT_GLOBALHEADER)
@@ -296,8 +461,9 @@ namespace nvr {
         if (avcodec_parameters_copy(output_stream->codecpar, input_stream->codecpar) < 0)
             return handleError("Cannot copy parameters to stream");
 
-        // Allow macOS/iOS to play this natively
-        output_stream->codecpar->codec_tag = MKTAG('h', 'v', 'c', '1');
+        // Allow macOS/iOS to play HEVC natively, other codecs get the muxer's own tag (mp4 rejects hvc1 for H.264)
+        output_stream->codecpar->codec_tag =
+                output_stream->codecpar->codec_id == AV_CODEC_ID_HEVC ? MKTAG('h', 'v', 'c', '1') : 0;
         av_opt_set_int(output_stream->priv_data, "keyint", 30, 0);
         av_opt_set_int(output_stream->priv_data, "g", 1, 0);
         av_opt_set_int(output_stream->priv_data, "bufsize", 100, 0);
@@ -324,8 +490,11 @@ namespace nvr {
         // Initialize the AVPacket
         packet = av_packet_alloc();
 
-        // Build the muxer
-        this->setupMuxer();
+        // Build the muxer, with motion detection it is built when the first event starts
+        if (motion == nullptr)
+            this->setupMuxer();
+        else
+            motion->start();
 
         // Take first snapshot
         this->takeSnapshot();
@@ -343,11 +512,14 @@ namespace nvr {
                 continue;
             }
 
+            // Only video is timed, counted and written, other streams' timestamps are in their own time base
             if (packet->stream_index != input_index) {
-                logger->warn("Not right index: '{}' (from packet), input_index: '{}'", packet->stream_index,
-                             input_index);
+                av_packet_unref(packet);
+                continue;
             }
 
+            ingest_stats->packet(packet, input_stream->time_base);
+
             // This is _literally_ just to keep clang happy i.e. not marking it as unreachable
             duration += packet->duration;
 
@@ -363,10 +535,14 @@ namespace nvr {
 
             last_pts = packet->pts;
 
-            packet->stream_index = output_stream->id;
-            packet->pos = -1;
+            packets_total->add();
+            bytes_total->add(packet->size);
+
+            if (packet->flags & AV_PKT_FLAG_KEY)
+                keyframes_total->add();
 
-            av_interleaved_write_frame(output_format_context, packet);
+            if (motion == nullptr || followMotion(packet))
+                writePacket(packet);
 
             // Finished writing clip
             if (duration_counter >= (double) this->clip_runtime)
@@ -382,6 +558,7 @@ namespace nvr {
         }
 
         this->logger->warn("Recording loop exited");
+        connected_state->set(0);
 
         quit();
         av_packet_free(&packet);
@@ -389,73 +566,109 @@ namespace nvr {
         return EXIT_SUCCESS;
     }
 
-    bool Recorder::connectSocket() {
-        if (socket_connected)
-            return socket_connected;
+    void Recorder::writePacket(AVPacket *packet) {
+        // Scores are per video frame, in the video stream's time base
+        if (activity != nullptr && packet->stream_index == input_index)
+            activity->packet(packet, input_stream->time_base);
+
+        packet->stream_index = output_stream->id;
+        packet->pos = -1;
+
+        int64_t write_started = av_gettime_relative();
+
+        if (av_interleaved_write_frame(output_format_context, packet) < 0)
+            write_errors->add();
+
+        write_latency->observe((double) (av_gettime_relative() - write_started) / AV_TIME_BASE);
+    }
+
+    /**
+     * Start or stop recording with the motion detector. While idle the packets since
+     * the last key frame are kept, so an event starts with what led up to it.
+     * @param packet
+     * @return Whether to write the packet
+     */
+    bool Recorder::followMotion(AVPacket *packet) {
+        bool key = packet->flags & AV_PKT_FLAG_KEY;
+
+        if (!motion->active()) {
+            if (output_format_context != nullptr) {
+                logger->info("No motion for {} seconds, stopping recording", motion_post_roll);
+
+                // Ends the segment, which moves the clip into place and announces it
+                closeMuxer();
+            }
+
+            if (key)
+                clearPreRoll();
+
+            // A pre-roll has to start on a key frame to be playable
+            if (key || !pre_roll.empty())
+                pre_roll.push_back(av_packet_clone(packet));
 
-        auto socket_path = string("/tmp/nvr.socket");
+            if (pre_roll.size() > max_pre_roll_packets)
+                clearPreRoll();
 
-        if ((camera_socket = socket(AF_UNIX, SOCK_DGRAM, 0)) == -1) {
-            logger->error("Could not initialize Never socket at '{}'", socket_path);
             return false;
         }
 
-        struct sockaddr_un serv_addr{};
-        bzero(&serv_addr, sizeof(serv_addr));
-        serv_addr.sun_family = AF_UNIX;
+        if (output_format_context == nullptr) {
+            if (pre_roll.empty() && !key)
+                return false;
 
-        strncpy(serv_addr.sun_path, socket_path.c_str(), sizeof(serv_addr.sun_path));
-        if (::connect(camera_socket, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) == -1) {
-            logger->error("Error on connecting to socket {}", socket_path);
-            return false;
+            logger->info("Motion, recording with {} packets of pre-roll", pre_roll.size());
+
+            if (this->setupMuxer() != EXIT_SUCCESS)
+                return false;
+
+            for (auto buffered: pre_roll)
+                writePacket(buffered);
+
+            clearPreRoll();
         }
 
+        return true;
+    }
+
+    void Recorder::closeMuxer() {
+        av_write_trailer(output_format_context);
+
+        if (ring != nullptr)
+            ring->closeSession(&output_format_context->pb);
 
-        socket_connected = true;
-        return socket_connected;
+        avformat_free_context(output_format_context);
+        output_format_context = nullptr;
+        output_stream = nullptr;
     }
 
-    void Recorder::notifyClip(string clip_path) {
-        this->connectSocket();
+    void Recorder::clearPreRoll() {
+        for (auto buffered: pre_roll)
+            av_packet_free(&buffered);
+
+        pre_roll.clear();
+    }
 
+    void Recorder::notifyClip(string clip_path) {
         json request;
 
         request["path"] = clip_path;
         request["type"] = "clip";
         request["camera"] = camera_id;
 
-        auto raw = request.dump();
+        notifier->post(request);
 
-       if (send(camera_socket, raw.data(), raw.size(), 0) == -1) {
-            logger->error("Could not notify socket of new clip at: {}", clip_path);
-        }
-
-       this->closeSocket();
+        if (uploader != nullptr)
+            uploader->enqueue(clip_path);
     }
 
     void Recorder::notifySnapshot(string snapshot_path) {
-        this->connectSocket();
-
         json request;
 
         request["path"] = snapshot_path;
         request["type"] = "snapshot";
         request["camera"] = camera_id;
 
-        auto raw = request.dump();
-        if (send(camera_socket, raw.c_str(), raw.size(), 0) == -1) {
-            logger->error("Could not notify socket of new snapshot at: {}", snapshot_path);
-        }
-
-        this->closeSocket();
-    }
-
-    void Recorder::closeSocket() {
-        if (!this->socket_connected)
-            return;
-
-        close(this->camera_socket);
-        this->socket_connected = false;
+        notifier->post(request);
     }
 
 } // nvr
@@ -19,6 +19,15 @@ extern "C" {
 
 #include "nlohmann/json.hpp"
 #include "../common.h"
+#include "metrics.h"
+#include "notifier.h"
+#include "ingest_stats.h"
+#include "activity.h"
+#include "motion.h"
+#include "compactor.h"
+#include "ring_store.h"
+#include "uploader.h"
+#include <deque>
 #include <string>
 #include <iostream>
 #include <thread>
@@ -68,22 +77,47 @@ namespace nvr {
         bool configured = false;
         int port{};
         bool connected = false;
-        bool socket_connected = false;
         int input_index = -1;
         long clip_runtime = 0;
         long snapshot_interval = 0;
         int error_count = 0;
-        int camera_socket{};
+
+        std::shared_ptr<Metrics> metrics;
+        std::shared_ptr<Notifier> notifier;
+        std::shared_ptr<IngestStats> ingest_stats;
+        std::shared_ptr<ActivityIndex> activity;
+        std::shared_ptr<MotionDetector> motion;
+        std::shared_ptr<Compactor> compactor;
+        std::shared_ptr<RingStore> ring;
+        std::shared_ptr<Uploader> uploader;
+        std::deque<AVPacket *> pre_roll;
+        int motion_post_roll = 0;
+        Counter *packets_total{};
+        Counter *bytes_total{};
+        Counter *keyframes_total{};
+        Counter *write_errors{};
+        Histogram *write_latency{};
+        Histogram *snapshot_latency{};
+        Counter *snapshot_failures{};
+        Counter *reconnects{};
+        Histogram *connect_latency{};
+        Gauge *connected_state{};
+        Counter *clips_total{};
+        Histogram *finalize_latency{};
+
+        void setupMetrics(const CameraConfig &config);
 
         int record();
+        void writePacket(AVPacket *packet);
+        bool followMotion(AVPacket *packet);
+        void clearPreRoll();
 
         int setupMuxer();
+        void closeMuxer();
 
         void takeSnapshot();
 
         void validateSnapshot(string snapshot_file_path);
-        bool connectSocket();
-        void closeSocket();
         bool handleError(const string &message, bool close_input = true);
     };
 
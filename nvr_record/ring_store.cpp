@@ -0,0 +1,418 @@
+//
+// Fixed-size pre-allocated recording file per camera, written as a ring of MP4 fragments
+//
+
+#include "ring_store.h"
+
+extern "C" {
+#include <libavutil/time.h>
+}
+
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+namespace nvr {
+
+    const char ring_magic[8] = {'N', 'V', 'R', 'R', 'I', 'N', 'G', '1'};
+    const uint32_t ring_version = 1;
+
+    // Header and index regions are page aligned
+    const uint64_t ring_alignment = 4096;
+
+    // Room for ftyp + moov, a few hundred bytes in practice
+    const uint64_t init_capacity = 1024 * 1024;
+
+    // One index slot per this many bytes of ring, fragments are a GOP so much bigger than this
+    const uint64_t bytes_per_slot = 64 * 1024;
+    const uint64_t min_index_slots = 1024;
+    const uint64_t max_index_slots = 1024 * 1024;
+
+    // Smaller than this and a few high bitrate GOPs would wrap the ring
+    const int64_t min_ring_size = 64 * 1024 * 1024;
+
+    // Buffer between the muxer and the ring, a fragment is collected in memory before it is written
+    const int io_buffer_size = 64 * 1024;
+
+    static uint64_t alignUp(uint64_t value) {
+        return (value + ring_alignment - 1) / ring_alignment * ring_alignment;
+    }
+
+    /**
+     * @param logger
+     * @param file_path
+     * @param size Total size of the file in bytes, fixed at creation
+     * @param metrics
+     */
+    RingStore::RingStore(const nvr_logger &logger, string file_path, int64_t size, Metrics &metrics) {
+        this->logger = logger;
+        this->file_path = std::move(file_path);
+        this->size = size;
+        this->fragments_total = &metrics.counter("nvr_record_ring_fragments_total", "Fragments written to the ring");
+        this->bytes_total = &metrics.counter("nvr_record_ring_bytes_total", "Bytes written to the ring");
+        this->evicted_total = &metrics.counter("nvr_record_ring_evicted_total",
+                                               "Fragments overwritten to make room");
+        this->errors_total = &metrics.counter("nvr_record_ring_errors_total", "Fragments that could not be written");
+        this->span_seconds = &metrics.gauge("nvr_record_ring_span_seconds", "Time covered by the ring");
+    }
+
+    RingStore::~RingStore() {
+        if (fd >= 0)
+            close(fd);
+    }
+
+    /**
+     * The camera's ring, <output>/videos/<camera>/<camera>.ring
+     * @param output_path
+     * @param camera_id
+     * @return
+     */
+    string RingStore::filePath(const string &output_path, const string &camera_id) {
+        return (fs::path(output_path) / "videos" / camera_id / (camera_id + ".ring")).string();
+    }
+
+    /**
+     * Read a ring's header and the fragments it still holds, oldest first
+     * @param fd
+     * @param header
+     * @param entries
+     * @return False when the file isn't a ring
+     */
+    bool RingStore::readIndex(int fd, RingHeader &header, std::vector<RingEntry> &entries) {
+        if (pread(fd, &header, sizeof(header), 0) != sizeof(header))
+            return false;
+
+        if (memcmp(header.magic, ring_magic, sizeof(ring_magic)) != 0 || header.version != ring_version)
+            return false;
+
+        // Every region has to lie inside the file before anything is sized or read from it
+        struct stat file_stat{};
+
+        if (fstat(fd, &file_stat) != 0 || header.file_size != (uint64_t) file_stat.st_size)
+            return false;
+
+        auto fits = [&header](uint64_t offset, uint64_t length) {
+            return offset <= header.file_size && length <= header.file_size - offset;
+        };
+
+        if (header.header_size != sizeof(RingHeader) || header.index_capacity == 0 ||
+            header.index_capacity > header.file_size / sizeof(RingEntry) ||
+            !fits(header.init_offset, header.init_capacity) || header.init_length > header.init_capacity ||
+            !fits(header.index_offset, header.index_capacity * sizeof(RingEntry)) ||
+            !fits(header.data_offset, header.data_size) || header.head > header.data_size)
+            return false;
+
+        std::vector<RingEntry> slots(header.index_capacity);
+        auto index_bytes = (ssize_t) (slots.size() * sizeof(RingEntry));
+
+        if (pread(fd, slots.data(), index_bytes, (off_t) header.index_offset) != index_bytes)
+            return false;
+
+        entries.clear();
+
+        for (const auto &slot: slots) {
+            if (slot.sequence != 0 && slot.length > 0 && slot.offset <= header.data_size &&
+                slot.length <= header.data_size - slot.offset)
+                entries.push_back(slot);
+        }
+
+        std::sort(entries.begin(), entries.end(), [](const RingEntry &a, const RingEntry &b) {
+            return a.sequence < b.sequence;
+        });
+
+        return true;
+    }
+
+    /**
+     * Open the camera's ring, carrying on where it left off, or allocate it
+     * @return
+     */
+    bool RingStore::open() {
+        fs::create_directories(fs::path(file_path).parent_path());
+
+        fd = ::open(file_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+        if (fd < 0) {
+            logger->error("Ring: cannot open {}: {}", file_path, strerror(errno));
+            return false;
+        }
+
+        std::vector<RingEntry> entries;
+
+        if (readIndex(fd, header, entries) && header.file_size == (uint64_t) size) {
+            live.assign(entries.begin(), entries.end());
+
+            // The header is written after the slot, a crash in between leaves it behind the index
+            if (!live.empty()) {
+                const RingEntry &newest = live.back();
+
+                header.head = newest.offset + newest.length;
+                header.next_sequence = std::max(header.next_sequence, newest.sequence + 1);
+                writeHeader();
+            }
+
+            logger->info("Ring: continuing {} with {} fragments", file_path, live.size());
+            return true;
+        }
+
+        return create();
+    }
+
+    /**
+     * Allocate the whole file up front and lay out an empty ring in it
+     * @return
+     */
+    bool RingStore::create() {
+        if (size < min_ring_size) {
+            logger->error("Ring: {} MB is too small, at least {} MB is needed", size / 1024 / 1024,
+                          min_ring_size / 1024 / 1024);
+            return false;
+        }
+
+        int result = posix_fallocate(fd, 0, size);
+
+        if (result == 0 && ftruncate(fd, size) != 0)
+            result = errno;
+
+        if (result != 0) {
+            logger->error("Ring: cannot allocate {} bytes for {}: {}", size, file_path, strerror(result));
+            return false;
+        }
+
+        header = {};
+        memcpy(header.magic, ring_magic, sizeof(ring_magic));
+        header.version = ring_version;
+        header.header_size = sizeof(RingHeader);
+        header.file_size = size;
+        header.init_offset = ring_alignment;
+        header.init_capacity = init_capacity;
+        header.index_offset = header.init_offset + init_capacity;
+        header.index_capacity = std::clamp((uint64_t) size / bytes_per_slot, min_index_slots, max_index_slots);
+        header.data_offset = alignUp(header.index_offset + header.index_capacity * sizeof(RingEntry));
+        header.data_size = size - header.data_offset;
+        header.next_sequence = 1;
+
+        // A file that held an older ring may still have slots in this range
+        std::vector<uint8_t> zeros(header.data_offset - header.index_offset, 0);
+
+        if (pwrite(fd, zeros.data(), zeros.size(), (off_t) header.index_offset) != (ssize_t) zeros.size() ||
+            !writeHeader()) {
+            logger->error("Ring: cannot initialize {}: {}", file_path, strerror(errno));
+            return false;
+        }
+
+        live.clear();
+        logger->info("Ring: allocated {} MB at {}, {} index slots", size / 1024 / 1024, file_path,
+                     header.index_capacity);
+        return true;
+    }
+
+    bool RingStore::writeHeader() {
+        return pwrite(fd, &header, sizeof(header), 0) == sizeof(header);
+    }
+
+    bool RingStore::writeSlot(uint64_t sequence, const RingEntry &entry) {
+        off_t slot = (off_t) (header.index_offset + ((sequence - 1) % header.index_capacity) * sizeof(RingEntry));
+        return pwrite(fd, &entry, sizeof(entry), slot) == sizeof(entry);
+    }
+
+    /**
+     * Store the session's init segment. Fragments are only playable with the init segment they
+     * were muxed with, so a changed stream (new codec or resolution) drops everything before it.
+     * @return
+     */
+    bool RingStore::writeInit() {
+        if (init.empty() || init.size() > header.init_capacity) {
+            logger->error("Ring: unusable init segment of {} bytes", init.size());
+            return false;
+        }
+
+        if (header.init_length > 0 && !live.empty()) {
+            std::vector<uint8_t> stored(header.init_length);
+            bool same = pread(fd, stored.data(), stored.size(), (off_t) header.init_offset) == (ssize_t) stored.size()
+                        && stored == init;
+
+            if (!same) {
+                logger->warn("Ring: stream parameters changed, dropping {} older fragments", live.size());
+                evict(0, header.data_size);
+            }
+        }
+
+        if (pwrite(fd, init.data(), init.size(), (off_t) header.init_offset) != (ssize_t) init.size())
+            return false;
+
+        header.init_length = init.size();
+        init_written = writeHeader();
+        return init_written;
+    }
+
+    /**
+     * Forget the oldest fragments overlapping the range about to be written. Fragments go round
+     * the ring in order, so the ones in the way are always at the front.
+     * @param from Relative to the data region
+     * @param length
+     */
+    void RingStore::evict(uint64_t from, uint64_t length) {
+        uint64_t to = from + length;
+        RingEntry empty{};
+
+        while (!live.empty()) {
+            const RingEntry &oldest = live.front();
+
+            if (oldest.offset >= to || oldest.offset + oldest.length <= from)
+                break;
+
+            writeSlot(oldest.sequence, empty);
+            live.pop_front();
+            evicted_total->add();
+        }
+    }
+
+    /**
+     * A muxer writing into the ring. Each call starts a new session, the first fragment
+     * written is marked so readers know timestamps restart there.
+     * @param wall_start Unix milliseconds of the first packet the muxer will get
+     * @return
+     */
+    AVIOContext *RingStore::openSession(int64_t wall_start) {
+        auto buffer = (unsigned char *) av_malloc(io_buffer_size);
+        AVIOContext *context = avio_alloc_context(buffer, io_buffer_size, 1, this, nullptr, nullptr, nullptr);
+
+        context->write_data_type = writeData;
+        context->seekable = 0;
+
+        init.clear();
+        init_written = false;
+        fragment.clear();
+        session_start = true;
+        session_wall_start = wall_start;
+        session_first_time = AV_NOPTS_VALUE;
+
+        return context;
+    }
+
+    /**
+     * Call after av_write_trailer, writes the last fragment and frees the context
+     * @param context
+     */
+    void RingStore::closeSession(AVIOContext **context) {
+        if (*context == nullptr)
+            return;
+
+        avio_flush(*context);
+        commit();
+
+        av_freep(&(*context)->buffer);
+        avio_context_free(context);
+    }
+
+    /**
+     * Sorts the muxer's output by the markers the MP4 muxer writes: the header is the init
+     * segment and every sync or boundary point starts a new fragment.
+     */
+    int RingStore::writeData(void *opaque, avio_write_buffer buffer, int length, enum AVIODataMarkerType type,
+                             int64_t time) {
+        auto store = static_cast<RingStore *>(opaque);
+
+        switch (type) {
+            case AVIO_DATA_MARKER_HEADER:
+                store->init.insert(store->init.end(), buffer, buffer + length);
+                break;
+            case AVIO_DATA_MARKER_SYNC_POINT:
+            case AVIO_DATA_MARKER_BOUNDARY_POINT:
+                store->commit();
+                store->fragment_time = time;
+                store->fragment_flags = type == AVIO_DATA_MARKER_SYNC_POINT ? ring_sync : 0;
+                store->fragment.insert(store->fragment.end(), buffer, buffer + length);
+                break;
+            case AVIO_DATA_MARKER_TRAILER:
+                // The fragmented muxer's mfra, fragments are found through the ring's own index
+                store->commit();
+                break;
+            default:
+                store->fragment.insert(store->fragment.end(), buffer, buffer + length);
+                break;
+        }
+
+        return length;
+    }
+
+    /**
+     * Write the collected fragment at the head: evict what it overlaps, write the data,
+     * then index it. The index never points at data that is being overwritten.
+     */
+    void RingStore::commit() {
+        if (fragment.empty())
+            return;
+
+        if (!init_written && !writeInit()) {
+            errors_total->add();
+            fragment.clear();
+            return;
+        }
+
+        uint64_t length = fragment.size();
+
+        if (length > header.data_size / 4) {
+            logger->error("Ring: dropping a {} byte fragment, the ring is too small for this stream", length);
+            errors_total->add();
+            fragment.clear();
+            return;
+        }
+
+        // Fragments are never split, the end of the ring is skipped when one doesn't fit
+        if (header.head + length > header.data_size) {
+            evict(header.head, header.data_size - header.head);
+            header.head = 0;
+        }
+
+        evict(header.head, length);
+
+        auto position = (off_t) (header.data_offset + header.head);
+
+        if (pwrite(fd, fragment.data(), length, position) != (ssize_t) length) {
+            logger->error("Ring: write failed: {}", strerror(errno));
+            errors_total->add();
+            fragment.clear();
+            return;
+        }
+
+        // Start writeback now rather than letting minutes of video pile up in the page cache
+        sync_file_range(fd, position, (off_t) length, SYNC_FILE_RANGE_WRITE);
+
+        if (session_first_time == AV_NOPTS_VALUE)
+            session_first_time = fragment_time != AV_NOPTS_VALUE ? fragment_time : 0;
+
+        RingEntry entry{};
+        entry.sequence = header.next_sequence++;
+        entry.offset = header.head;
+        entry.length = (uint32_t) length;
+        entry.flags = fragment_flags | (session_start ? ring_session_start : 0);
+        entry.start = fragment_time != AV_NOPTS_VALUE ?
+                      session_wall_start + (fragment_time - session_first_time) / 1000 :
+                      av_gettime() / 1000;
+
+        // The slot is shared with the fragment one lap of the index ago
+        while (!live.empty() && live.front().sequence + header.index_capacity <= entry.sequence) {
+            live.pop_front();
+            evicted_total->add();
+        }
+
+        writeSlot(entry.sequence, entry);
+        live.push_back(entry);
+
+        header.head += length;
+        writeHeader();
+
+        session_start = false;
+        fragment.clear();
+
+        fragments_total->add();
+        bytes_total->add(length);
+        span_seconds->set((double) (live.back().start - live.front().start) / 1000.0);
+    }
+}
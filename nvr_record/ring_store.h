@@ -0,0 +1,115 @@
+//
+// Fixed-size pre-allocated recording file per camera, written as a ring of MP4 fragments
+//
+
+#ifndef NEVER_CLI_RING_STORE_H
+#define NEVER_CLI_RING_STORE_H
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+#include "../common.h"
+#include "metrics.h"
+#include <deque>
+#include <vector>
+
+namespace nvr {
+
+    // libavformat 61 made the buffers handed to write callbacks const
+#if LIBAVFORMAT_VERSION_MAJOR >= 61
+    using avio_write_buffer = const uint8_t *;
+#else
+    using avio_write_buffer = uint8_t *;
+#endif
+
+    /**
+     * Start of the file. Followed by the init segment (ftyp + moov) region, the index and the data ring.
+     * Offsets are in bytes, integers in host byte order.
+     */
+    struct RingHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t header_size;
+        uint64_t file_size;
+        uint64_t init_offset;
+        uint64_t init_capacity;
+        uint64_t init_length;
+        uint64_t index_offset;
+        uint64_t index_capacity;
+        uint64_t data_offset;
+        uint64_t data_size;
+        // Next write position, relative to data_offset
+        uint64_t head;
+        uint64_t next_sequence;
+    };
+
+    /**
+     * One moof + mdat, found at slot (sequence - 1) % index_capacity. Sequence 0 is an empty slot.
+     */
+    struct RingEntry {
+        uint64_t sequence;
+        // Relative to data_offset
+        uint64_t offset;
+        uint32_t length;
+        uint32_t flags;
+        // Unix milliseconds of the fragment's first frame
+        int64_t start;
+    };
+
+    // Fragment starts with a key frame
+    const uint32_t ring_sync = 1;
+
+    // First fragment after the recorder (re)started the muxer, timestamps restart here
+    const uint32_t ring_session_start = 2;
+
+    class RingStore {
+    public:
+        RingStore(const nvr_logger &logger, string file_path, int64_t size, Metrics &metrics);
+        ~RingStore();
+        RingStore(RingStore const &) = delete;
+        RingStore &operator=(RingStore const &) = delete;
+
+        bool open();
+        AVIOContext *openSession(int64_t wall_start);
+        void closeSession(AVIOContext **context);
+
+        static string filePath(const string &output_path, const string &camera_id);
+        static bool readIndex(int fd, RingHeader &header, std::vector<RingEntry> &entries);
+
+    private:
+        nvr_logger logger;
+        string file_path;
+        int64_t size;
+        int fd = -1;
+        RingHeader header{};
+        std::deque<RingEntry> live;
+
+        std::vector<uint8_t> init;
+        bool init_written = false;
+        std::vector<uint8_t> fragment;
+        int64_t fragment_time = AV_NOPTS_VALUE;
+        uint32_t fragment_flags = 0;
+        bool session_start = false;
+        int64_t session_wall_start = 0;
+        int64_t session_first_time = AV_NOPTS_VALUE;
+
+        Counter *fragments_total;
+        Counter *bytes_total;
+        Counter *evicted_total;
+        Counter *errors_total;
+        Gauge *span_seconds;
+
+        bool create();
+        bool writeHeader();
+        bool writeInit();
+        bool writeSlot(uint64_t sequence, const RingEntry &entry);
+        void evict(uint64_t from, uint64_t length);
+        void commit();
+
+        static int writeData(void *opaque, avio_write_buffer buffer, int length, enum AVIODataMarkerType type,
+                             int64_t time);
+    };
+}
+
+#endif //NEVER_CLI_RING_STORE_H
@@ -0,0 +1,435 @@
+//
+// Background clip upload in ranged chunks, bandwidth capped and resumable across restarts
+//
+
+#include "uploader.h"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+using json = nlohmann::json;
+namespace fs = std::filesystem;
+
+namespace nvr {
+
+    // Retry delay after a failed chunk doubles from the first to the last
+    const auto first_retry = std::chrono::seconds(5);
+    const auto last_retry = std::chrono::minutes(5);
+
+    // With nothing to do, or outside the upload windows, look again this often
+    const auto idle_check = std::chrono::minutes(1);
+
+    // A transfer moving less than a byte a second for this long is given up and retried
+    const long stall_seconds = 60;
+
+    struct ChunkReader {
+        int fd;
+        off_t offset;
+        off_t remaining;
+    };
+
+    /**
+     * @param logger
+     * @param camera_id
+     * @param config
+     * @param queue_path Pending uploads and their progress, reloaded on start
+     * @param metrics
+     */
+    Uploader::Uploader(const nvr_logger &logger, const string &camera_id, const UploadConfig &config,
+                       string queue_path, Metrics &metrics) {
+        this->logger = logger;
+        this->camera_id = camera_id;
+        this->config = config;
+        this->queue_path = std::move(queue_path);
+        this->queue_depth = &metrics.gauge("nvr_record_upload_queue", "Clips waiting to be uploaded");
+        this->bytes_total = &metrics.counter("nvr_record_upload_bytes_total", "Bytes uploaded");
+        this->uploads_total = &metrics.counter("nvr_record_uploads_total", "Clips uploaded");
+        this->failures_total = &metrics.counter("nvr_record_upload_failures_total", "Chunks that failed to upload");
+
+        curl_global_init(CURL_GLOBAL_DEFAULT);
+        this->multi = curl_multi_init();
+    }
+
+    Uploader::~Uploader() {
+        stop();
+        curl_multi_cleanup(multi);
+    }
+
+    void Uploader::start() {
+        if (running)
+            return;
+
+        loadQueue();
+
+        logger->info("Uploading clips to {}, {} queued{}", config.url, queue.size(),
+                     config.rate_limit > 0 ? fmt::format(", at most {} KB/s", config.rate_limit) : "");
+
+        running = true;
+        uploader_thread = std::thread(&Uploader::run, this);
+    }
+
+    void Uploader::stop() {
+        if (!running)
+            return;
+
+        running = false;
+        curl_multi_wakeup(multi);
+
+        if (uploader_thread.joinable())
+            uploader_thread.join();
+    }
+
+    /**
+     * Queue a finished clip. Called from the packet loop, so only a stat and a small file write.
+     * @param clip_path
+     */
+    void Uploader::enqueue(const string &clip_path) {
+        std::error_code error;
+        auto size = (int64_t) fs::file_size(clip_path, error);
+
+        if (error) {
+            logger->warn("Not uploading {}: {}", clip_path, error.message());
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            for (const auto &queued: queue) {
+                if (queued.path == clip_path)
+                    return;
+            }
+
+            queue.push_back({clip_path, 0, size});
+            queue_depth->set((double) queue.size());
+            saveQueue();
+        }
+
+        curl_multi_wakeup(multi);
+    }
+
+    /**
+     * Swap compacted clips in the queue for the file that replaced them. Clips already sent
+     * are on the remote, the merged file is only needed when some of them were still queued.
+     * Called before the clips are removed, so the upload loop never finds them gone.
+     * @param merged_path
+     * @param clip_paths
+     */
+    void Uploader::replace(const string &merged_path, const std::vector<string> &clip_paths) {
+        std::error_code error;
+        auto size = (int64_t) fs::file_size(merged_path, error);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            auto replaced = [&](const Upload &queued) {
+                return queued.path == merged_path ||
+                       std::find(clip_paths.begin(), clip_paths.end(), queued.path) != clip_paths.end();
+            };
+
+            auto first = std::find_if(queue.begin(), queue.end(), replaced);
+
+            if (first == queue.end())
+                return;
+
+            // The merged file takes the place of its oldest clip, the queue stays in recording order
+            auto position = first - queue.begin();
+            queue.erase(std::remove_if(first, queue.end(), replaced), queue.end());
+
+            if (error) {
+                logger->error("Not uploading {}: {}", merged_path, error.message());
+            } else {
+                queue.insert(queue.begin() + position, {merged_path, 0, size});
+                logger->info("Uploading {} in place of its compacted clips", merged_path);
+            }
+
+            queue_depth->set((double) queue.size());
+            saveQueue();
+        }
+
+        curl_multi_wakeup(multi);
+    }
+
+    void Uploader::loadQueue() {
+        std::ifstream queue_file(queue_path);
+
+        if (!queue_file)
+            return;
+
+        try {
+            json saved = json::parse(queue_file);
+            std::lock_guard<std::mutex> lock(mutex);
+
+            for (const auto &upload: saved)
+                queue.push_back({upload["path"], upload["offset"], upload["size"]});
+
+            queue_depth->set((double) queue.size());
+        } catch (const json::exception &exception) {
+            logger->warn("Discarding unreadable upload queue {}", queue_path);
+        }
+    }
+
+    /**
+     * Rewrite the queue file, called with the mutex held
+     */
+    void Uploader::saveQueue() {
+        json saved = json::array();
+
+        for (const auto &upload: queue)
+            saved.push_back({{"path", upload.path}, {"offset", upload.offset}, {"size", upload.size}});
+
+        string temporary_path = queue_path + ".tmp";
+        std::error_code error;
+        fs::create_directories(fs::path(queue_path).parent_path(), error);
+
+        {
+            std::ofstream queue_file(temporary_path, std::ios::trunc);
+            queue_file << saved.dump();
+
+            if (!queue_file) {
+                logger->error("Could not write upload queue {}", queue_path);
+                return;
+            }
+        }
+
+        fs::rename(temporary_path, queue_path, error);
+    }
+
+    /**
+     * Sleep until the timeout, a new clip or stop
+     * @param timeout
+     */
+    void Uploader::wait(std::chrono::milliseconds timeout) {
+        if (running)
+            curl_multi_poll(multi, nullptr, 0, (int) timeout.count(), nullptr);
+    }
+
+    bool Uploader::inWindow() const {
+        if (config.windows.empty())
+            return true;
+
+        time_t now = time(nullptr);
+        struct tm local{};
+        localtime_r(&now, &local);
+        int minute = local.tm_hour * 60 + local.tm_min;
+
+        for (const auto &window: config.windows) {
+            bool inside = window.start <= window.end ? minute >= window.start && minute < window.end :
+                          minute >= window.start || minute < window.end;
+
+            if (inside)
+                return true;
+        }
+
+        return false;
+    }
+
+    /**
+     * url/<camera>/<clip file name>
+     * @param clip_path
+     * @return
+     */
+    string Uploader::remoteURL(const string &clip_path) const {
+        string url = config.url;
+
+        if (url.back() != '/')
+            url += '/';
+
+        return url + camera_id + "/" + fs::path(clip_path).filename().string();
+    }
+
+    void Uploader::run() {
+        // Uploads get the disk and the CPU only when recording doesn't want them
+        lowerThreadPriority(logger);
+
+        std::chrono::milliseconds retry = first_retry;
+        bool window_open = true;
+
+        while (running) {
+            Upload upload;
+            size_t queued;
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                queued = queue.size();
+
+                if (!queue.empty())
+                    upload = queue.front();
+            }
+
+            if (upload.path.empty()) {
+                wait(idle_check);
+                continue;
+            }
+
+            if (inWindow() != window_open) {
+                window_open = !window_open;
+                logger->info("Upload window {}, {} clips queued", window_open ? "open" : "closed", queued);
+            }
+
+            if (!window_open) {
+                wait(idle_check);
+                continue;
+            }
+
+            Upload sent = upload;
+            ChunkResult result = sendChunk(sent);
+
+            if (!running)
+                break;
+
+            if (result == ChunkResult::failed) {
+                failures_total->add();
+                wait(retry);
+                retry = std::min<std::chrono::milliseconds>(retry * 2, last_retry);
+                continue;
+            }
+
+            retry = first_retry;
+
+            std::lock_guard<std::mutex> lock(mutex);
+
+            // Compaction may have replaced the clip while the chunk was in flight
+            auto current = std::find_if(queue.begin(), queue.end(), [&upload](const Upload &queued) {
+                return queued.path == upload.path && queued.offset == upload.offset && queued.size == upload.size;
+            });
+
+            if (current == queue.end())
+                continue;
+
+            if (result == ChunkResult::gone || sent.offset >= sent.size) {
+                if (result == ChunkResult::sent) {
+                    uploads_total->add();
+                    logger->info("Uploaded {}", sent.path);
+                }
+
+                queue.erase(current);
+            } else {
+                *current = sent;
+            }
+
+            queue_depth->set((double) queue.size());
+            saveQueue();
+        }
+    }
+
+    size_t Uploader::readChunk(char *buffer, size_t size, size_t count, void *opaque) {
+        auto reader = static_cast<ChunkReader *>(opaque);
+        auto wanted = (size_t) std::min<off_t>((off_t) (size * count), reader->remaining);
+
+        if (wanted == 0)
+            return 0;
+
+        ssize_t read = pread(reader->fd, buffer, wanted, reader->offset);
+
+        if (read <= 0)
+            return CURL_READFUNC_ABORT;
+
+        reader->offset += read;
+        reader->remaining -= read;
+        return (size_t) read;
+    }
+
+    /**
+     * PUT the next chunk of a clip with its place in the file in Content-Range, so the
+     * receiver can put it together and a restart carries on from the last chunk accepted.
+     * @param upload Its offset moves past the chunk once the server accepts it
+     * @return
+     */
+    ChunkResult Uploader::sendChunk(Upload &upload) {
+        int fd = open(upload.path.c_str(), O_RDONLY | O_CLOEXEC);
+
+        if (fd < 0) {
+            logger->warn("Dropping upload of {}: {}", upload.path, strerror(errno));
+            return ChunkResult::gone;
+        }
+
+        struct stat file_stat{};
+        fstat(fd, &file_stat);
+
+        // Compaction replaces a clip with the merged file under the same name, send that instead
+        if (file_stat.st_size != upload.size) {
+            logger->info("{} changed on disk, uploading it again from the start", upload.path);
+            upload.offset = 0;
+            upload.size = file_stat.st_size;
+        }
+
+        if (upload.size == 0) {
+            close(fd);
+            return ChunkResult::gone;
+        }
+
+        off_t length = std::min<off_t>((off_t) config.chunk_size * 1024 * 1024, upload.size - upload.offset);
+        ChunkReader reader = {fd, (off_t) upload.offset, length};
+
+        posix_fadvise(fd, reader.offset, length, POSIX_FADV_SEQUENTIAL);
+
+        struct curl_slist *headers = nullptr;
+        headers = curl_slist_append(headers, fmt::format("Content-Range: bytes {}-{}/{}", upload.offset,
+                                                         upload.offset + length - 1, upload.size).c_str());
+        headers = curl_slist_append(headers, "Content-Type: video/mp4");
+        headers = curl_slist_append(headers, "Expect:");
+
+        if (!config.authorization.empty())
+            headers = curl_slist_append(headers, ("Authorization: " + config.authorization).c_str());
+
+        string url = remoteURL(upload.path);
+        CURL *handle = curl_easy_init();
+        curl_easy_setopt(handle, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(handle, CURLOPT_UPLOAD, 1L);
+        curl_easy_setopt(handle, CURLOPT_READFUNCTION, readChunk);
+        curl_easy_setopt(handle, CURLOPT_READDATA, &reader);
+        curl_easy_setopt(handle, CURLOPT_INFILESIZE_LARGE, (curl_off_t) length);
+        curl_easy_setopt(handle, CURLOPT_HTTPHEADER, headers);
+        curl_easy_setopt(handle, CURLOPT_NOSIGNAL, 1L);
+        curl_easy_setopt(handle, CURLOPT_CONNECTTIMEOUT, 10L);
+        curl_easy_setopt(handle, CURLOPT_LOW_SPEED_LIMIT, 1L);
+        curl_easy_setopt(handle, CURLOPT_LOW_SPEED_TIME, stall_seconds);
+
+        if (config.rate_limit > 0)
+            curl_easy_setopt(handle, CURLOPT_MAX_SEND_SPEED_LARGE, (curl_off_t) config.rate_limit * 1024);
+
+        curl_multi_add_handle(multi, handle);
+
+        int transfers = 1;
+
+        while (transfers > 0 && running) {
+            curl_multi_perform(multi, &transfers);
+
+            if (transfers > 0)
+                curl_multi_poll(multi, nullptr, 0, 1000, nullptr);
+        }
+
+        CURLcode result = CURLE_ABORTED_BY_CALLBACK;
+        int pending;
+
+        while (CURLMsg *message = curl_multi_info_read(multi, &pending)) {
+            if (message->msg == CURLMSG_DONE && message->easy_handle == handle)
+                result = message->data.result;
+        }
+
+        long status = 0;
+        curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &status);
+
+        curl_multi_remove_handle(multi, handle);
+        curl_easy_cleanup(handle);
+        curl_slist_free_all(headers);
+
+        // Sent video won't be read again, don't let it push recording out of the page cache
+        posix_fadvise(fd, (off_t) upload.offset, length, POSIX_FADV_DONTNEED);
+        close(fd);
+
+        if (result != CURLE_OK || status < 200 || status >= 300) {
+            if (running)
+                logger->warn("Upload of {} failed at byte {}: {}", url, upload.offset,
+                             result != CURLE_OK ? curl_easy_strerror(result) : fmt::format("HTTP {}", status));
+
+            return ChunkResult::failed;
+        }
+
+        upload.offset += length;
+        bytes_total->add(length);
+        return ChunkResult::sent;
+    }
+}
@@ -0,0 +1,72 @@
+//
+// Background clip upload in ranged chunks, bandwidth capped and resumable across restarts
+//
+
+#ifndef NEVER_CLI_UPLOADER_H
+#define NEVER_CLI_UPLOADER_H
+
+#include "../common.h"
+#include "metrics.h"
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace nvr {
+
+    struct Upload {
+        string path;
+        int64_t offset;
+        int64_t size;
+    };
+
+    enum class ChunkResult {
+        sent,
+        failed,
+        gone
+    };
+
+    class Uploader {
+    public:
+        Uploader(const nvr_logger &logger, const string &camera_id, const UploadConfig &config, string queue_path,
+                 Metrics &metrics);
+        ~Uploader();
+        Uploader(Uploader const &) = delete;
+        Uploader &operator=(Uploader const &) = delete;
+
+        void start();
+        void stop();
+        void enqueue(const string &clip_path);
+        void replace(const string &merged_path, const std::vector<string> &clip_paths);
+
+    private:
+        nvr_logger logger;
+        string camera_id;
+        UploadConfig config;
+        string queue_path;
+        Gauge *queue_depth;
+        Counter *bytes_total;
+        Counter *uploads_total;
+        Counter *failures_total;
+
+        std::mutex mutex;
+        std::deque<Upload> queue;
+        std::atomic<bool> running = false;
+        std::thread uploader_thread;
+        CURLM *multi;
+
+        void run();
+        ChunkResult sendChunk(Upload &upload);
+        bool inWindow() const;
+        string remoteURL(const string &clip_path) const;
+        void wait(std::chrono::milliseconds timeout);
+        void loadQueue();
+        void saveQueue();
+
+        static size_t readChunk(char *buffer, size_t size, size_t count, void *opaque);
+    };
+}
+
+#endif //NEVER_CLI_UPLOADER_H
@@ -0,0 +1,34 @@
+#include "server.h"
+
+std::shared_ptr<nvr::Server> server;
+
+void quit(int sig) {
+    server->stop();
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3 || argc > 4) {
+        spdlog::error("usage: {} output-path address [max-connections]\n"
+                      "i.e. {} /mnt/nvr 8080\n"
+                      "     {} /mnt/nvr /tmp/nvr-serve.sock\n"
+                      "Serve the recorder's videos/ and snapshots/ over HTTP, on a loopback port, host:port or a\n"
+                      "Unix socket.\n", argv[0], argv[0], argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    int max_connections = argc == 4 ? atoi(argv[3]) : 64;
+    auto logger = spdlog::stdout_color_mt("serve");
+
+    server = std::make_shared<nvr::Server>(logger, argv[1], max_connections);
+
+    if (!server->listen(argv[2]))
+        return EXIT_FAILURE;
+
+    signal(SIGINT, quit);
+    signal(SIGTERM, quit);
+    signal(SIGPIPE, SIG_IGN);
+
+    server->run();
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,632 @@
+//
+// Local HTTP/1.1 file server for recorded clips and snapshots, sendfile with range requests
+//
+
+#include "server.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+namespace fs = std::filesystem;
+
+namespace nvr {
+
+    // Request line and headers, anything bigger is not a media player asking for a file
+    const size_t max_request_size = 8192;
+
+    // Keep-alive connections with nothing going on for this long are closed
+    const int idle_timeout = 30;
+
+    // Bytes per sendfile call, so one large file doesn't hold up the other connections
+    const size_t send_chunk = 1024 * 1024;
+
+    const int max_events = 64;
+
+    /**
+     * @param logger
+     * @param root Recorder output path, holding videos/ and snapshots/
+     * @param max_connections Past this new connections wait in the listen backlog
+     */
+    Server::Server(const nvr_logger &logger, const string &root, int max_connections) {
+        this->logger = logger;
+        this->root = fs::path(root);
+        this->max_connections = std::max(max_connections, 1);
+    }
+
+    Server::~Server() {
+        while (!connections.empty())
+            closeConnection(connections.begin()->first);
+
+        if (listen_fd >= 0)
+            close(listen_fd);
+
+        if (epoll_fd >= 0)
+            close(epoll_fd);
+    }
+
+    /**
+     * @param address A Unix socket path (anything with a slash), a port on loopback, or host:port
+     * @return
+     */
+    bool Server::listen(const string &address) {
+        if (address.find('/') != string::npos) {
+            struct sockaddr_un socket_address{};
+            socket_address.sun_family = AF_UNIX;
+
+            if (address.size() >= sizeof(socket_address.sun_path)) {
+                logger->error("Socket path too long: {}", address);
+                return false;
+            }
+
+            strncpy(socket_address.sun_path, address.c_str(), sizeof(socket_address.sun_path) - 1);
+            unlink(address.c_str());
+
+            listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+            if (bind(listen_fd, (struct sockaddr *) &socket_address, sizeof(socket_address)) < 0) {
+                logger->error("Cannot bind {}: {}", address, strerror(errno));
+                return false;
+            }
+        } else {
+            size_t colon = address.rfind(':');
+            string host = colon == string::npos ? "127.0.0.1" : address.substr(0, colon);
+            int port = atoi(address.substr(colon == string::npos ? 0 : colon + 1).c_str());
+
+            struct sockaddr_in socket_address{};
+            socket_address.sin_family = AF_INET;
+            socket_address.sin_port = htons(port);
+
+            if (port <= 0 || inet_pton(AF_INET, host.c_str(), &socket_address.sin_addr) != 1) {
+                logger->error("Invalid listen address: {}", address);
+                return false;
+            }
+
+            listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+            int reuse = 1;
+            setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+            if (bind(listen_fd, (struct sockaddr *) &socket_address, sizeof(socket_address)) < 0) {
+                logger->error("Cannot bind {}: {}", address, strerror(errno));
+                return false;
+            }
+        }
+
+        if (::listen(listen_fd, 128) < 0) {
+            logger->error("Cannot listen on {}: {}", address, strerror(errno));
+            return false;
+        }
+
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        watch(listen_fd, EPOLLIN, EPOLL_CTL_ADD);
+
+        logger->info("Serving {} on {}, at most {} connections", root.string(), address, max_connections);
+        return true;
+    }
+
+    void Server::run() {
+        struct epoll_event events[max_events];
+        running = true;
+
+        while (running) {
+            int count = epoll_wait(epoll_fd, events, max_events, 1000);
+
+            if (count < 0 && errno != EINTR) {
+                logger->error("epoll_wait failed: {}", strerror(errno));
+                break;
+            }
+
+            for (int i = 0; i < count; i++) {
+                int fd = events[i].data.fd;
+
+                if (fd == listen_fd) {
+                    accept();
+                    continue;
+                }
+
+                auto found = connections.find(fd);
+
+                if (found == connections.end())
+                    continue;
+
+                if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+                    closeConnection(fd);
+                    continue;
+                }
+
+                if (events[i].events & EPOLLIN)
+                    receive(found->second);
+
+                // Receiving may have finished and closed the connection
+                found = connections.find(fd);
+
+                if (found != connections.end() && (events[i].events & EPOLLOUT) && send(found->second))
+                    finish(found->second);
+            }
+
+            expire();
+        }
+    }
+
+    void Server::stop() {
+        running = false;
+    }
+
+    void Server::watch(int fd, uint32_t events, int operation) {
+        struct epoll_event event{};
+        event.events = events;
+        event.data.fd = fd;
+        epoll_ctl(epoll_fd, operation, fd, &event);
+    }
+
+    void Server::accept() {
+        while (true) {
+            // At the limit stop taking connections, the kernel queues them until one closes
+            if ((int) connections.size() >= max_connections) {
+                if (accepting) {
+                    watch(listen_fd, 0, EPOLL_CTL_MOD);
+                    accepting = false;
+                }
+
+                return;
+            }
+
+            int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+            if (fd < 0)
+                return;
+
+            Connection &connection = connections[fd];
+            connection.fd = fd;
+            connection.last_active = time(nullptr);
+
+            watch(fd, EPOLLIN | EPOLLRDHUP, EPOLL_CTL_ADD);
+        }
+    }
+
+    void Server::closeConnection(int fd) {
+        auto found = connections.find(fd);
+
+        if (found == connections.end())
+            return;
+
+        if (found->second.file >= 0)
+            close(found->second.file);
+
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+        close(fd);
+        connections.erase(found);
+
+        if (!accepting && (int) connections.size() < max_connections) {
+            watch(listen_fd, EPOLLIN, EPOLL_CTL_MOD);
+            accepting = true;
+        }
+    }
+
+    /**
+     * Close connections idle past the timeout, including ones whose reader stopped reading
+     */
+    void Server::expire() {
+        time_t now = time(nullptr);
+        std::vector<int> expired;
+
+        for (const auto &[fd, connection]: connections) {
+            if (now - connection.last_active > idle_timeout)
+                expired.push_back(fd);
+        }
+
+        for (int fd: expired)
+            closeConnection(fd);
+    }
+
+    void Server::receive(Connection &connection) {
+        char buffer[4096];
+
+        while (true) {
+            ssize_t received = recv(connection.fd, buffer, sizeof(buffer), 0);
+
+            if (received > 0) {
+                connection.input.append(buffer, received);
+
+                if (connection.input.size() > max_request_size)
+                    break;
+
+                continue;
+            }
+
+            if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+
+            // A client that is done sending still gets the responses to what it sent
+            if (received == 0) {
+                connection.peer_closed = true;
+                break;
+            }
+
+            closeConnection(connection.fd);
+            return;
+        }
+
+        connection.last_active = time(nullptr);
+        next(connection);
+    }
+
+    /**
+     * Handle the next complete request in the input, if there is one. Only called between
+     * responses, pipelined requests are answered in order.
+     * @param connection
+     */
+    void Server::next(Connection &connection) {
+        size_t end = connection.input.find("\r\n\r\n");
+
+        if (end == string::npos ? connection.input.size() > max_request_size : end > max_request_size) {
+            connection.keep_alive = false;
+            connection.input.clear();
+            respond(connection, 431, "", "Request too large\n");
+            return;
+        }
+
+        if (end == string::npos) {
+            if (connection.peer_closed)
+                closeConnection(connection.fd);
+
+            return;
+        }
+
+        string request = connection.input.substr(0, end);
+        connection.input.erase(0, end + 4);
+        handle(connection, request);
+    }
+
+    /**
+     * Percent-decode the path of a request target, without the query and the leading slash
+     * @param target
+     * @return Empty when the target isn't a usable path
+     */
+    string Server::decodePath(const string &target) {
+        string path = target.substr(0, target.find('?'));
+        string decoded;
+
+        if (path.empty() || path[0] != '/')
+            return "";
+
+        for (size_t i = 1; i < path.size(); i++) {
+            if (path[i] != '%') {
+                decoded += path[i];
+                continue;
+            }
+
+            if (i + 2 >= path.size() || !isxdigit(path[i + 1]) || !isxdigit(path[i + 2]))
+                return "";
+
+            char character = (char) std::stoi(path.substr(i + 1, 2), nullptr, 16);
+
+            if (character == '\0')
+                return "";
+
+            decoded += character;
+            i += 2;
+        }
+
+        return decoded;
+    }
+
+    string Server::contentType(const fs::path &file_path) {
+        string extension = file_path.extension().string();
+
+        if (extension == ".mp4")
+            return "video/mp4";
+
+        if (extension == ".jpeg" || extension == ".jpg")
+            return "image/jpeg";
+
+        if (extension == ".json")
+            return "application/json";
+
+        return "application/octet-stream";
+    }
+
+    static string statusText(int status) {
+        switch (status) {
+            case 200:
+                return "OK";
+            case 206:
+                return "Partial Content";
+            case 400:
+                return "Bad Request";
+            case 404:
+                return "Not Found";
+            case 405:
+                return "Method Not Allowed";
+            case 416:
+                return "Range Not Satisfiable";
+            case 431:
+                return "Request Header Fields Too Large";
+            default:
+                return "Error";
+        }
+    }
+
+    static string httpDate(time_t time) {
+        char buffer[64];
+        struct tm date{};
+        gmtime_r(&time, &date);
+        strftime(buffer, sizeof(buffer), "%a, %d %b %Y %H:%M:%S GMT", &date);
+        return buffer;
+    }
+
+    /**
+     * Parse a single byte range against the file size. Multiple ranges and anything malformed
+     * are ignored, which serves the whole file as HTTP allows.
+     * @param range Value of the Range header
+     * @param size
+     * @param first
+     * @param last
+     * @return -1 to ignore the header, 0 when it can't be satisfied, 1 for a range
+     */
+    static int parseRange(const string &range, off_t size, off_t &first, off_t &last) {
+        if (range.rfind("bytes=", 0) != 0 || range.find(',') != string::npos)
+            return -1;
+
+        string spec = range.substr(6);
+        size_t dash = spec.find('-');
+
+        if (dash == string::npos)
+            return -1;
+
+        string from = spec.substr(0, dash);
+        string to = spec.substr(dash + 1);
+        char *end = nullptr;
+
+        if (from.empty()) {
+            long long suffix = strtoll(to.c_str(), &end, 10);
+
+            if (to.empty() || *end != '\0' || suffix < 0)
+                return -1;
+
+            if (suffix == 0 || size == 0)
+                return 0;
+
+            first = std::max<off_t>(0, size - suffix);
+            last = size - 1;
+            return 1;
+        }
+
+        first = strtoll(from.c_str(), &end, 10);
+
+        if (*end != '\0' || first < 0)
+            return -1;
+
+        last = size - 1;
+
+        if (!to.empty()) {
+            long long requested = strtoll(to.c_str(), &end, 10);
+
+            if (*end != '\0' || requested < first)
+                return -1;
+
+            last = std::min<off_t>(requested, size - 1);
+        }
+
+        return first < size ? 1 : 0;
+    }
+
+    void Server::handle(Connection &connection, const string &request) {
+        std::istringstream lines(request);
+        string line;
+        std::getline(lines, line);
+
+        std::istringstream request_line(line);
+        string method, target, version;
+        request_line >> method >> target >> version;
+
+        if (version.rfind("HTTP/1.", 0) != 0) {
+            connection.keep_alive = false;
+            respond(connection, 400, "", "Bad request\n");
+            return;
+        }
+
+        connection.keep_alive = version == "HTTP/1.1";
+        string range;
+
+        while (std::getline(lines, line)) {
+            if (!line.empty() && line.back() == '\r')
+                line.pop_back();
+
+            size_t colon = line.find(':');
+
+            if (colon == string::npos)
+                continue;
+
+            string name = line.substr(0, colon);
+            string value = line.substr(colon + 1);
+            std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+            value.erase(0, value.find_first_not_of(' '));
+
+            if (name == "connection") {
+                std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+
+                if (value == "close")
+                    connection.keep_alive = false;
+                else if (value == "keep-alive")
+                    connection.keep_alive = true;
+            } else if (name == "range") {
+                range = value;
+            }
+        }
+
+        if (method != "GET" && method != "HEAD") {
+            respond(connection, 405, "Allow: GET, HEAD\r\n", "Method not allowed\n");
+            return;
+        }
+
+        // Only the two media trees, and nothing hidden (the compactor's working files start with a dot)
+        fs::path relative = decodePath(target);
+        bool allowed = !relative.empty();
+
+        for (const auto &component: relative) {
+            string part = component.string();
+
+            if (part.empty() || part == "/")
+                continue;
+
+            if (part[0] == '.')
+                allowed = false;
+        }
+
+        string tree = relative.empty() ? "" : relative.begin()->string();
+
+        if (!allowed || (tree != "videos" && tree != "snapshots")) {
+            respond(connection, 404, "", "Not found\n");
+            return;
+        }
+
+        int file = open((root / relative).c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+        struct stat file_stat{};
+
+        if (file < 0 || fstat(file, &file_stat) < 0 || !S_ISREG(file_stat.st_mode)) {
+            if (file >= 0)
+                close(file);
+
+            respond(connection, 404, "", "Not found\n");
+            return;
+        }
+
+        off_t size = file_stat.st_size;
+        off_t first = 0;
+        off_t last = size - 1;
+        int status = 200;
+
+        if (!range.empty()) {
+            int parsed = parseRange(range, size, first, last);
+
+            if (parsed == 0) {
+                close(file);
+                respond(connection, 416, fmt::format("Content-Range: bytes */{}\r\n", size), "");
+                return;
+            }
+
+            if (parsed == 1)
+                status = 206;
+            else
+                first = 0, last = size - 1;
+        }
+
+        off_t length = last - first + 1;
+
+        connection.headers = fmt::format("HTTP/1.1 {} {}\r\n", status, statusText(status));
+        connection.headers += fmt::format("Content-Type: {}\r\n", contentType(relative));
+        connection.headers += fmt::format("Content-Length: {}\r\n", length);
+        connection.headers += "Accept-Ranges: bytes\r\n";
+        connection.headers += fmt::format("Last-Modified: {}\r\n", httpDate(file_stat.st_mtime));
+
+        if (status == 206)
+            connection.headers += fmt::format("Content-Range: bytes {}-{}/{}\r\n", first, last, size);
+
+        connection.headers += connection.keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+        connection.headers_sent = 0;
+
+        if (method == "GET" && length > 0) {
+            connection.file = file;
+            connection.offset = first;
+            connection.remaining = length;
+        } else {
+            close(file);
+        }
+
+        logger->debug("{} {} {} {} bytes", method, target, status, length);
+
+        watch(connection.fd, EPOLLOUT, EPOLL_CTL_MOD);
+
+        if (send(connection))
+            finish(connection);
+    }
+
+    void Server::respond(Connection &connection, int status, const string &extra_headers, const string &body) {
+        connection.headers = fmt::format("HTTP/1.1 {} {}\r\n", status, statusText(status));
+        connection.headers += "Content-Type: text/plain\r\n";
+        connection.headers += fmt::format("Content-Length: {}\r\n", body.size());
+        connection.headers += extra_headers;
+        connection.headers += connection.keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+        connection.headers += body;
+        connection.headers_sent = 0;
+        connection.remaining = 0;
+
+        watch(connection.fd, EPOLLOUT, EPOLL_CTL_MOD);
+
+        if (send(connection))
+            finish(connection);
+    }
+
+    /**
+     * Send the headers and at most one chunk of the body
+     * @param connection
+     * @return True once the response is complete. False while it is pending, or when the
+     * connection failed and was closed.
+     */
+    bool Server::send(Connection &connection) {
+        while (connection.headers_sent < connection.headers.size()) {
+            // Hold the headers back to go out with the start of the body
+            int flags = MSG_NOSIGNAL | (connection.remaining > 0 ? MSG_MORE : 0);
+            ssize_t sent = ::send(connection.fd, connection.headers.data() + connection.headers_sent,
+                                  connection.headers.size() - connection.headers_sent, flags);
+
+            if (sent < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    closeConnection(connection.fd);
+
+                return false;
+            }
+
+            connection.headers_sent += sent;
+            connection.last_active = time(nullptr);
+        }
+
+        // One chunk per wakeup, the rest goes out once the other ready connections had their turn
+        if (connection.remaining > 0) {
+            auto chunk = (size_t) std::min<off_t>(connection.remaining, (off_t) send_chunk);
+            ssize_t sent = sendfile(connection.fd, connection.file, &connection.offset, chunk);
+
+            if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return false;
+
+            // Failed, or the file got shorter than the length already promised
+            if (sent <= 0) {
+                closeConnection(connection.fd);
+                return false;
+            }
+
+            connection.remaining -= sent;
+            connection.last_active = time(nullptr);
+        }
+
+        return connection.remaining == 0;
+    }
+
+    void Server::finish(Connection &connection) {
+        if (connection.file >= 0) {
+            close(connection.file);
+            connection.file = -1;
+        }
+
+        connection.headers.clear();
+        connection.headers_sent = 0;
+
+        if (!connection.keep_alive) {
+            closeConnection(connection.fd);
+            return;
+        }
+
+        // The end of input stays readable, watching it again would wake the loop for nothing
+        if (!connection.peer_closed)
+            watch(connection.fd, EPOLLIN | EPOLLRDHUP, EPOLL_CTL_MOD);
+
+        next(connection);
+    }
+}
@@ -0,0 +1,65 @@
+//
+// Local HTTP/1.1 file server for recorded clips and snapshots, sendfile with range requests
+//
+
+#ifndef NEVER_CLI_SERVER_H
+#define NEVER_CLI_SERVER_H
+
+#include "../common.h"
+#include <atomic>
+#include <unordered_map>
+
+namespace nvr {
+
+    struct Connection {
+        int fd = -1;
+        string input;
+        string headers;
+        size_t headers_sent = 0;
+        int file = -1;
+        off_t offset = 0;
+        off_t remaining = 0;
+        bool keep_alive = false;
+        // The client shut down its side, close once the buffered requests are answered
+        bool peer_closed = false;
+        time_t last_active = 0;
+    };
+
+    class Server {
+    public:
+        Server(const nvr_logger &logger, const string &root, int max_connections);
+        ~Server();
+        Server(Server const &) = delete;
+        Server &operator=(Server const &) = delete;
+
+        bool listen(const string &address);
+        void run();
+        void stop();
+
+    private:
+        nvr_logger logger;
+        std::filesystem::path root;
+        int max_connections;
+        int listen_fd = -1;
+        int epoll_fd = -1;
+        bool accepting = true;
+        std::atomic<bool> running = false;
+        std::unordered_map<int, Connection> connections;
+
+        void accept();
+        void receive(Connection &connection);
+        void next(Connection &connection);
+        void handle(Connection &connection, const string &request);
+        void respond(Connection &connection, int status, const string &extra_headers, const string &body);
+        bool send(Connection &connection);
+        void finish(Connection &connection);
+        void closeConnection(int fd);
+        void watch(int fd, uint32_t events, int operation);
+        void expire();
+
+        static string decodePath(const string &target);
+        static string contentType(const std::filesystem::path &file_path);
+    };
+}
+
+#endif //NEVER_CLI_SERVER_H
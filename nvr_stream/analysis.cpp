@@ -0,0 +1,237 @@
+//
+// Video-loss, freeze, black/blank and tamper detection on a small low-rate luma plane
+//
+
+#include "analysis.h"
+#include "../simd.h"
+
+#include <gst/video/video.h>
+#include <cmath>
+#include <utility>
+
+using json = nlohmann::json;
+
+namespace nvr {
+
+    // 160x90 at 2fps is plenty to tell a dead or covered camera from a live one
+    const int analysis_width = 160;
+    const int analysis_height = 90;
+    const int analysis_fps = 2;
+
+    // Seconds without a decoded frame before video loss is raised
+    const int video_loss_seconds = 10;
+
+    // Mean absolute difference per pixel at or below which two frames are the same picture. Sensor noise
+    // and keyframes in a quiet scene move the downscaled plane well past this, a stuck decoder repeats it exactly.
+    const double freeze_difference = 0.01;
+
+    // Standard deviation below which a frame has no content at all (lens cap, spray paint, flat grey)
+    const double blank_deviation = 6.0;
+
+    // Consecutive samples a changed scene must persist before it counts as tampering
+    const int tamper_samples = 3;
+
+    // Seconds between reference updates while the scene is steady
+    const int reference_interval = 30;
+
+    const char *alert_names[] = {"video-loss", "frozen", "black", "blank", "tampered"};
+
+    VideoAnalyzer::VideoAnalyzer(const nvr_logger &logger, string camera_id, const AnalysisConfig &config) {
+        this->logger = logger;
+        this->camera_id = std::move(camera_id);
+        this->config = config;
+    }
+
+    VideoAnalyzer::~VideoAnalyzer() {
+        if (watchdog_id != 0)
+            g_source_remove(watchdog_id);
+    }
+
+    DecodedBranchFormat VideoAnalyzer::branchFormat() {
+        return {"analysis", "GRAY8", analysis_width, analysis_height, analysis_fps};
+    }
+
+    GstElement *VideoAnalyzer::create() {
+        GstElement *sink = gst_element_factory_make("appsink", "analysis");
+
+        g_object_set(G_OBJECT(sink), "sync", false, nullptr);
+        g_object_set(G_OBJECT(sink), "async", false, nullptr);
+        g_object_set(G_OBJECT(sink), "max-buffers", 1, nullptr);
+        g_object_set(G_OBJECT(sink), "drop", true, nullptr);
+
+        GstAppSinkCallbacks callbacks = {nullptr, nullptr, newSample};
+        gst_app_sink_set_callbacks(GST_APP_SINK(sink), &callbacks, this, nullptr);
+
+        return sink;
+    }
+
+    /**
+     * Start watching for video loss, which can't be seen from the frames themselves
+     */
+    void VideoAnalyzer::start() {
+        last_frame_time = g_get_monotonic_time();
+        watchdog_id = g_timeout_add_seconds(1, checkVideoLoss, this);
+
+        logger->info("Video analysis enabled (freeze after {}s, black below {}, tamper above {})",
+                     config.freeze_seconds, config.black_level, config.tamper_level);
+    }
+
+    GstFlowReturn VideoAnalyzer::newSample(GstAppSink *sink, gpointer user_data) {
+        GstSample *sample = gst_app_sink_pull_sample(sink);
+
+        if (sample != nullptr) {
+            static_cast<VideoAnalyzer *>(user_data)->analyze(sample);
+            gst_sample_unref(sample);
+        }
+
+        return GST_FLOW_OK;
+    }
+
+    gboolean VideoAnalyzer::checkVideoLoss(gpointer user_data) {
+        auto *analyzer = static_cast<VideoAnalyzer *>(user_data);
+        gint64 silence = g_get_monotonic_time() - analyzer->last_frame_time;
+
+        if (silence >= (gint64) video_loss_seconds * 1000000)
+            analyzer->setAlert(video_loss, true, fmt::format("no frames for {}s", silence / 1000000));
+
+        return G_SOURCE_CONTINUE;
+    }
+
+    void VideoAnalyzer::analyze(GstSample *sample) {
+        GstBuffer *buffer = gst_sample_get_buffer(sample);
+        GstVideoInfo info;
+
+        if (buffer == nullptr || !gst_video_info_from_caps(&info, gst_sample_get_caps(sample)))
+            return;
+
+        GstMapInfo map_info = GST_MAP_INFO_INIT;
+
+        if (!gst_buffer_map(buffer, &map_info, GST_MAP_READ))
+            return;
+
+        gint64 now = g_get_monotonic_time();
+        GstClockTime pts = GST_BUFFER_PTS(buffer);
+        last_frame_time = now;
+        setAlert(video_loss, false);
+
+        // Pack the rows so the SIMD helpers see one contiguous plane
+        auto width = (size_t) GST_VIDEO_INFO_WIDTH(&info);
+        auto height = (size_t) GST_VIDEO_INFO_HEIGHT(&info);
+        auto stride = (size_t) GST_VIDEO_INFO_PLANE_STRIDE(&info, 0);
+        size_t pixels = width * height;
+
+        current.resize(pixels);
+        for (size_t row = 0; row < height && row * stride + width <= map_info.size; row++)
+            memcpy(current.data() + row * width, map_info.data + row * stride, width);
+
+        gst_buffer_unmap(buffer, &map_info);
+
+        PlaneStats stats = planeStats(current.data(), pixels);
+        double mean = (double) stats.sum / (double) pixels;
+        double deviation = std::sqrt(std::max(0.0, (double) stats.sum_squares / (double) pixels - mean * mean));
+
+        setAlert(black, mean < config.black_level && deviation < blank_deviation * 2,
+                 fmt::format("mean luma {:.0f}", mean));
+        setAlert(blank, mean >= config.black_level && deviation < blank_deviation,
+                 fmt::format("luma deviation {:.1f}", deviation));
+
+        if (previous.size() == pixels) {
+            double difference = (double) sumAbsDiff(current.data(), previous.data(), pixels) / (double) pixels;
+            bool repeated = GST_CLOCK_TIME_IS_VALID(pts) && pts == previous_pts;
+
+            if (difference > freeze_difference && !repeated)
+                frozen_since = now;
+
+            setAlert(frozen, now - frozen_since >= (gint64) config.freeze_seconds * 1000000,
+                     fmt::format("unchanged for {}s", (now - frozen_since) / 1000000));
+        } else {
+            frozen_since = now;
+        }
+
+        previous_pts = pts;
+
+        if (reference.size() == pixels) {
+            double structural = structuralDifference(current, reference);
+
+            if (structural > config.tamper_level) {
+                changed_samples++;
+
+                // The pre-tamper reference is kept, the alert ends once the scene is back to it
+                if (changed_samples >= tamper_samples)
+                    setAlert(tampered, true, fmt::format("scene changed by {:.0f}", structural));
+
+                // ...or once the new view has held still long enough to be a deliberate re-aim
+                if (candidate.size() != pixels || structuralDifference(current, candidate) > config.tamper_level) {
+                    candidate = current;
+                    candidate_time = now;
+                } else if (config.tamper_rebase_seconds > 0 &&
+                           now - candidate_time >= (gint64) config.tamper_rebase_seconds * 1000000) {
+                    logger->info("Video analysis: view steady for {}s, adopting it as the reference",
+                                 config.tamper_rebase_seconds);
+                    reference = current;
+                    reference_time = now;
+                    changed_samples = 0;
+                    candidate.clear();
+                    setAlert(tampered, false);
+                }
+            } else {
+                changed_samples = 0;
+                candidate.clear();
+                setAlert(tampered, false);
+
+                if (now - reference_time >= (gint64) reference_interval * 1000000) {
+                    reference = current;
+                    reference_time = now;
+                }
+            }
+        } else {
+            reference = current;
+            reference_time = now;
+        }
+
+        std::swap(previous, current);
+    }
+
+    /**
+     * Mean absolute difference per pixel, less the part a global brightness change (lights, IR switch) explains
+     * @param a
+     * @param b Same size as a
+     * @return
+     */
+    double VideoAnalyzer::structuralDifference(const std::vector<uint8_t> &a, const std::vector<uint8_t> &b) {
+        auto pixels = (double) a.size();
+        double mean_a = (double) planeStats(a.data(), a.size()).sum / pixels;
+        double mean_b = (double) planeStats(b.data(), b.size()).sum / pixels;
+        double difference = (double) sumAbsDiff(a.data(), b.data(), a.size()) / pixels;
+
+        return difference - std::abs(mean_a - mean_b);
+    }
+
+    /**
+     * Notify on transitions only, a covered camera is reported once rather than every frame
+     * @param alert
+     * @param on
+     * @param detail
+     */
+    void VideoAnalyzer::setAlert(VideoAlert alert, bool on, const string &detail) {
+        if (active[alert].exchange(on) == on)
+            return;
+
+        if (on)
+            logger->warn("Video alert: {} ({})", alert_names[alert], detail);
+        else
+            logger->info("Video alert cleared: {}", alert_names[alert]);
+
+        json message;
+        message["type"] = "video-alert";
+        message["camera"] = camera_id;
+        message["alert"] = alert_names[alert];
+        message["state"] = on ? "start" : "end";
+        message["time"] = g_get_real_time() / 1000;
+
+        if (on && !detail.empty())
+            message["detail"] = detail;
+
+        sendNotification(message, logger);
+    }
+}
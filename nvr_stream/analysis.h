@@ -0,0 +1,65 @@
+//
+// Video-loss, freeze, black/blank and tamper detection on a small low-rate luma plane
+//
+
+#ifndef NEVER_CLI_ANALYSIS_H
+#define NEVER_CLI_ANALYSIS_H
+
+#include "../common.h"
+#include "decoded_branch.h"
+#include <gst/gst.h>
+#include <gst/app/gstappsink.h>
+#include <atomic>
+#include <vector>
+
+namespace nvr {
+
+    enum VideoAlert {
+        video_loss,
+        frozen,
+        black,
+        blank,
+        tampered,
+        alert_count
+    };
+
+    class VideoAnalyzer {
+    public:
+        VideoAnalyzer(const nvr_logger &logger, string camera_id, const AnalysisConfig &config);
+        ~VideoAnalyzer();
+        VideoAnalyzer(VideoAnalyzer const &) = delete;
+        VideoAnalyzer &operator=(VideoAnalyzer const &) = delete;
+
+        GstElement *create();
+        void start();
+        static DecodedBranchFormat branchFormat();
+
+    private:
+        nvr_logger logger;
+        string camera_id;
+        AnalysisConfig config;
+
+        std::vector<uint8_t> current;
+        std::vector<uint8_t> previous;
+        std::vector<uint8_t> reference;
+        gint64 reference_time = 0;
+        std::vector<uint8_t> candidate;
+        gint64 candidate_time = 0;
+        gint64 frozen_since = 0;
+        GstClockTime previous_pts = GST_CLOCK_TIME_NONE;
+        int changed_samples = 0;
+        guint watchdog_id = 0;
+        std::atomic<gint64> last_frame_time = 0;
+        std::atomic<bool> active[alert_count] = {};
+
+        void analyze(GstSample *sample);
+        void setAlert(VideoAlert alert, bool on, const string &detail = "");
+
+        static double structuralDifference(const std::vector<uint8_t> &a, const std::vector<uint8_t> &b);
+
+        static GstFlowReturn newSample(GstAppSink *sink, gpointer user_data);
+        static gboolean checkVideoLoss(gpointer user_data);
+    };
+}
+
+#endif //NEVER_CLI_ANALYSIS_H
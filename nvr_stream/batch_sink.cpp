@@ -0,0 +1,282 @@
+//
+// RTP egress that sends each payloaded frame with one sendmmsg (or one UDP GSO send)
+//
+
+#include "batch_sink.h"
+
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
+#include <vector>
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+namespace nvr {
+
+    // Kernel limit on segments in a single GSO send
+    const guint max_gso_segments = 64;
+
+    // sendmmsg() messages per call, payloaders rarely emit more packets per frame
+    const guint max_batch = 64;
+
+    // Seconds between egress statistics reports
+    const int report_interval = 60;
+
+    BatchSink::BatchSink(const nvr_logger &logger, int64_t port) {
+        this->logger = logger;
+        this->port = port;
+        this->last_report = std::chrono::steady_clock::now();
+    }
+
+    BatchSink::~BatchSink() {
+        if (out_sock != -1)
+            close(out_sock);
+    }
+
+    /**
+     * Create the appsink that takes the slot of udpsink after the payloader.
+     * Buffer lists are kept intact so a frame's packets arrive together.
+     * @return
+     */
+    GstElement *BatchSink::create() {
+        if (!openSocket())
+            return nullptr;
+
+        sink = gst_element_factory_make("appsink", "udp");
+        g_object_set(G_OBJECT(sink), "sync", false, nullptr);
+        g_object_set(G_OBJECT(sink), "buffer-list", true, nullptr);
+        g_object_set(G_OBJECT(sink), "emit-signals", false, nullptr);
+
+        GstAppSinkCallbacks callbacks{};
+        callbacks.new_sample = newSample;
+        gst_app_sink_set_callbacks(GST_APP_SINK(sink), &callbacks, this, nullptr);
+
+        return sink;
+    }
+
+    bool BatchSink::openSocket() {
+        if ((out_sock = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
+            logger->error("Could not create batched RTP socket");
+            return false;
+        }
+
+        int no_segment = 0;
+        gso_supported = setsockopt(out_sock, IPPROTO_UDP, UDP_SEGMENT, &no_segment, sizeof(no_segment)) == 0;
+
+        logger->info("Batched RTP egress using sendmmsg{}", gso_supported ? " with UDP GSO" : "");
+
+        return setPort(port);
+    }
+
+    /**
+     * Point the socket at a new RTP port, e.g. after reusing an existing mountpoint
+     * @param new_port
+     * @return
+     */
+    bool BatchSink::setPort(int64_t new_port) {
+        struct sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons((uint16_t) new_port);
+
+        port = new_port;
+
+        if (connect(out_sock, (struct sockaddr *) &address, sizeof(address)) == -1) {
+            logger->error("Could not connect batched RTP socket to port {}", new_port);
+            return false;
+        }
+
+        return true;
+    }
+
+    uint64_t BatchSink::getPackets() const {
+        return packets;
+    }
+
+    uint64_t BatchSink::getSyscalls() const {
+        return syscalls;
+    }
+
+    GstFlowReturn BatchSink::newSample(GstAppSink *app_sink, gpointer user_data) {
+        auto *batch_sink = static_cast<BatchSink *>(user_data);
+        GstSample *sample = gst_app_sink_pull_sample(app_sink);
+
+        if (sample == nullptr)
+            return GST_FLOW_EOS;
+
+        GstBufferList *list = gst_sample_get_buffer_list(sample);
+
+        if (list != nullptr) {
+            guint count = gst_buffer_list_length(list);
+            std::vector<GstBuffer *> buffers(count);
+
+            for (guint index = 0; index < count; index++)
+                buffers[index] = gst_buffer_list_get(list, index);
+
+            batch_sink->sendPackets(buffers.data(), count);
+        } else {
+            GstBuffer *buffer = gst_sample_get_buffer(sample);
+
+            if (buffer != nullptr)
+                batch_sink->sendPackets(&buffer, 1);
+        }
+
+        gst_sample_unref(sample);
+        batch_sink->report();
+
+        return GST_FLOW_OK;
+    }
+
+    void BatchSink::sendPackets(GstBuffer **buffers, guint count) {
+        if (count == 0)
+            return;
+
+        // GSO needs every segment but the last to be exactly the same size
+        if (gso_supported && count > 1 && count <= max_gso_segments) {
+            size_t segment_size = gst_buffer_get_size(buffers[0]);
+            size_t total = 0;
+            bool uniform = true;
+
+            for (guint index = 0; index < count; index++) {
+                size_t size = gst_buffer_get_size(buffers[index]);
+                total += size;
+
+                if ((index < count - 1 && size != segment_size) || size > segment_size)
+                    uniform = false;
+            }
+
+            if (uniform && total <= 65000 && sendSegmented(buffers, count, segment_size))
+                return;
+        }
+
+        for (guint offset = 0; offset < count; offset += max_batch)
+            sendBatched(buffers + offset, std::min(max_batch, count - offset));
+    }
+
+    bool BatchSink::sendSegmented(GstBuffer **buffers, guint count, size_t segment_size) {
+        std::vector<GstMapInfo> maps;
+        std::vector<GstMemory *> memories;
+        std::vector<struct iovec> iovecs;
+
+        for (guint index = 0; index < count; index++) {
+            for (guint memory_index = 0; memory_index < gst_buffer_n_memory(buffers[index]); memory_index++) {
+                GstMemory *memory = gst_buffer_peek_memory(buffers[index], memory_index);
+                GstMapInfo map;
+
+                if (!gst_memory_map(memory, &map, GST_MAP_READ))
+                    continue;
+
+                maps.push_back(map);
+                memories.push_back(memory);
+                iovecs.push_back({map.data, map.size});
+            }
+        }
+
+        char control[CMSG_SPACE(sizeof(uint16_t))] = {};
+        struct msghdr message{};
+        message.msg_iov = iovecs.data();
+        message.msg_iovlen = iovecs.size();
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+
+        struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = IPPROTO_UDP;
+        header->cmsg_type = UDP_SEGMENT;
+        header->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        *((uint16_t *) CMSG_DATA(header)) = (uint16_t) segment_size;
+
+        ssize_t sent = sendmsg(out_sock, &message, MSG_DONTWAIT);
+
+        for (size_t index = 0; index < maps.size(); index++)
+            gst_memory_unmap(memories[index], &maps[index]);
+
+        if (sent < 0) {
+            if (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT) {
+                logger->warn("UDP GSO send failed ({}), falling back to sendmmsg", strerror(errno));
+                gso_supported = false;
+            }
+
+            return false;
+        }
+
+        packets += count;
+        syscalls += 1;
+        gso_sends += 1;
+
+        return true;
+    }
+
+    void BatchSink::sendBatched(GstBuffer **buffers, guint count) {
+        std::vector<GstMapInfo> maps;
+        std::vector<GstMemory *> memories;
+        std::vector<struct iovec> iovecs;
+        std::vector<size_t> first_iovec(count + 1);
+        std::vector<struct mmsghdr> messages(count);
+
+        for (guint index = 0; index < count; index++) {
+            first_iovec[index] = iovecs.size();
+
+            for (guint memory_index = 0; memory_index < gst_buffer_n_memory(buffers[index]); memory_index++) {
+                GstMemory *memory = gst_buffer_peek_memory(buffers[index], memory_index);
+                GstMapInfo map;
+
+                if (!gst_memory_map(memory, &map, GST_MAP_READ))
+                    continue;
+
+                maps.push_back(map);
+                memories.push_back(memory);
+                iovecs.push_back({map.data, map.size});
+            }
+        }
+        first_iovec[count] = iovecs.size();
+
+        // iovecs is fully built now, so pointers into it stay valid
+        for (guint index = 0; index < count; index++) {
+            messages[index] = {};
+            messages[index].msg_hdr.msg_iov = iovecs.data() + first_iovec[index];
+            messages[index].msg_hdr.msg_iovlen = first_iovec[index + 1] - first_iovec[index];
+        }
+
+        guint sent_total = 0;
+
+        while (sent_total < count) {
+            int sent = sendmmsg(out_sock, messages.data() + sent_total, count - sent_total, MSG_DONTWAIT);
+            syscalls += 1;
+
+            if (sent <= 0) {
+                // Nobody listening yet (ECONNREFUSED) or a full socket buffer, drop like udpsink does
+                if (errno != ECONNREFUSED && errno != EAGAIN)
+                    logger->debug("sendmmsg failed: {}", strerror(errno));
+                break;
+            }
+
+            sent_total += sent;
+        }
+
+        packets += sent_total;
+
+        for (size_t index = 0; index < maps.size(); index++)
+            gst_memory_unmap(memories[index], &maps[index]);
+    }
+
+    void BatchSink::report() {
+        auto now = std::chrono::steady_clock::now();
+
+        if (now - last_report < std::chrono::seconds(report_interval))
+            return;
+
+        uint64_t interval_packets = packets - reported_packets;
+        uint64_t interval_syscalls = syscalls - reported_syscalls;
+
+        if (interval_syscalls > 0)
+            logger->info("RTP egress: {} packets in {} syscalls ({:.2f} packets per syscall, {} GSO sends total)",
+                         interval_packets, interval_syscalls, (double) interval_packets / (double) interval_syscalls,
+                         gso_sends.load());
+
+        reported_packets = packets;
+        reported_syscalls = syscalls;
+        last_report = now;
+    }
+}
@@ -0,0 +1,54 @@
+//
+// RTP egress that sends each payloaded frame with one sendmmsg (or one UDP GSO send)
+//
+
+#ifndef NEVER_CLI_BATCH_SINK_H
+#define NEVER_CLI_BATCH_SINK_H
+
+#include "../common.h"
+#include <gst/gst.h>
+#include <gst/app/gstappsink.h>
+#include <sys/socket.h>
+#include <atomic>
+#include <chrono>
+
+namespace nvr {
+
+    class BatchSink {
+    public:
+        BatchSink(const nvr_logger &logger, int64_t port);
+        ~BatchSink();
+        BatchSink(BatchSink const &) = delete;
+        BatchSink &operator=(BatchSink const &) = delete;
+
+        GstElement *create();
+        bool setPort(int64_t port);
+
+        [[nodiscard]] uint64_t getPackets() const;
+        [[nodiscard]] uint64_t getSyscalls() const;
+
+    private:
+        nvr_logger logger;
+        GstElement *sink{};
+        int out_sock{-1};
+        std::atomic<int64_t> port;
+        bool gso_supported = false;
+
+        std::atomic<uint64_t> packets = 0;
+        std::atomic<uint64_t> syscalls = 0;
+        std::atomic<uint64_t> gso_sends = 0;
+        uint64_t reported_packets = 0;
+        uint64_t reported_syscalls = 0;
+        std::chrono::steady_clock::time_point last_report;
+
+        bool openSocket();
+        void sendPackets(GstBuffer **buffers, guint count);
+        bool sendSegmented(GstBuffer **buffers, guint count, size_t segment_size);
+        void sendBatched(GstBuffer **buffers, guint count);
+        void report();
+
+        static GstFlowReturn newSample(GstAppSink *app_sink, gpointer user_data);
+    };
+}
+
+#endif //NEVER_CLI_BATCH_SINK_H
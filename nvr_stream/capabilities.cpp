@@ -0,0 +1,246 @@
+//
+// Hardware capability probe, run once and shared between streamers through a cache file
+//
+
+#include "capabilities.h"
+
+#include <fcntl.h>
+#include <sys/file.h>
+
+using json = nlohmann::json;
+
+namespace nvr {
+
+    // Shared by every nvr_stream on the host, also used as the lock file
+    const char *capabilities_cache = "/tmp/nvr_capabilities.json";
+
+    // Plugins whose version changes invalidate the cache
+    const char *probed_plugins[] = {"nvcodec", "va", "vaapi", "codectimestamper", "vvas_xvcuenc", "vpx"};
+
+    // How long a test encode may take before the backend is considered broken
+    const int probe_timeout_seconds = 5;
+
+    std::once_flag Capabilities::loaded;
+    HardwareCapabilities Capabilities::capabilities;
+
+    /**
+     * Probe (or read from cache) what this host can do. Concurrent callers in
+     * other processes block on the cache lock until the first probe is written.
+     * @param logger
+     */
+    void Capabilities::load(const nvr_logger &logger) {
+        std::call_once(loaded, [&logger] {
+            string key = cacheKey();
+            int fd = open(capabilities_cache, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+
+            if (fd == -1) {
+                logger->warn("Could not open capability cache {}, probing without it", capabilities_cache);
+                capabilities = probe(logger);
+                return;
+            }
+
+            flock(fd, LOCK_EX);
+
+            if (readCache(fd, key, capabilities)) {
+                logger->debug("Using cached hardware capabilities");
+            } else {
+                capabilities = probe(logger);
+
+                // Finding nothing may only mean a driver wasn't ready yet, the next start probes again
+                if (capabilities.nvidia || capabilities.vaapi || capabilities.u30)
+                    writeCache(fd, key, capabilities);
+            }
+
+            flock(fd, LOCK_UN);
+            close(fd);
+
+            logger->info("Hardware capabilities: nvidia={} vaapi={} u30={} timestamper={}",
+                         capabilities.nvidia, capabilities.vaapi, capabilities.u30, capabilities.timestamper);
+        });
+    }
+
+    const HardwareCapabilities &Capabilities::get() {
+        load(spdlog::default_logger());
+        return capabilities;
+    }
+
+    /**
+     * Boot ID, GStreamer version plus the version and path of every plugin we probe. Drivers
+     * and devices can change across a reboot without any plugin changing.
+     * @return
+     */
+    string Capabilities::cacheKey() {
+        string boot_id;
+        std::ifstream boot_file("/proc/sys/kernel/random/boot_id");
+        std::getline(boot_file, boot_id);
+
+        gchar *version = gst_version_string();
+        string key = boot_id + ";" + version;
+        g_free(version);
+
+        for (auto name: probed_plugins) {
+            GstPlugin *plugin = gst_registry_find_plugin(gst_registry_get(), name);
+            key += ";";
+            key += name;
+
+            if (plugin == nullptr)
+                continue;
+
+            key += "=";
+            key += gst_plugin_get_version(plugin);
+
+            const gchar *filename = gst_plugin_get_filename(plugin);
+            if (filename != nullptr) {
+                key += "@";
+                key += filename;
+            }
+
+            gst_object_unref(plugin);
+        }
+
+        return key;
+    }
+
+    HardwareCapabilities Capabilities::probe(const nvr_logger &logger) {
+        HardwareCapabilities result;
+
+        logger->info("Probing hardware capabilities");
+
+        if (hasFeature("nvcodec", "nvh265dec") && gst_registry_check_feature_version(gst_registry_get(), "nvh265dec", 1, 22, 0))
+            result.nvidia = canOpen(logger, "nvh264dec") && canOpen(logger, "nvh265dec");
+
+        if (hasFeature("vaapi", "vaapivp8enc") && gst_registry_check_feature_version(gst_registry_get(), "vaapidecodebin", 1, 22, 0))
+            result.vaapi = canEncode(logger, "videotestsrc num-buffers=1 ! video/x-raw,width=320,height=240 ! "
+                                             "vaapivp8enc ! fakesink");
+
+        if (hasFeature("vvas_xvcuenc", "vvas_xvcuenc"))
+            result.u30 = canEncode(logger, "videotestsrc num-buffers=1 ! video/x-raw,format=NV12,width=320,height=240 ! "
+                                           "vvas_xvcuenc ! fakesink");
+
+        result.timestamper = hasFeature("codectimestamper", "h264timestamper") &&
+                             gst_registry_check_feature_version(gst_registry_get(), "h264timestamper", 1, 22, 0);
+
+        return result;
+    }
+
+    bool Capabilities::readCache(int fd, const string &key, HardwareCapabilities &result) {
+        string contents;
+        char buffer[1024];
+        ssize_t length;
+
+        lseek(fd, 0, SEEK_SET);
+        while ((length = read(fd, buffer, sizeof(buffer))) > 0)
+            contents.append(buffer, length);
+
+        json cache = json::parse(contents, nullptr, false);
+
+        if (cache.is_discarded() || !cache.is_object() || !cache.contains("key") || cache["key"] != key)
+            return false;
+
+        result.nvidia = cache.value("nvidia", false);
+        result.vaapi = cache.value("vaapi", false);
+        result.u30 = cache.value("u30", false);
+        result.timestamper = cache.value("timestamper", false);
+        return true;
+    }
+
+    void Capabilities::writeCache(int fd, const string &key, const HardwareCapabilities &result) {
+        json cache = {
+                {"key",         key},
+                {"nvidia",      result.nvidia},
+                {"vaapi",       result.vaapi},
+                {"u30",         result.u30},
+                {"timestamper", result.timestamper}
+        };
+
+        string contents = cache.dump();
+
+        if (ftruncate(fd, 0) == -1 || pwrite(fd, contents.data(), contents.size(), 0) != (ssize_t) contents.size())
+            spdlog::warn("Could not write capability cache {}", capabilities_cache);
+    }
+
+    bool Capabilities::hasFeature(const char *plugin_name, const char *feature_name) {
+        GstPlugin *plugin = gst_registry_find_plugin(gst_registry_get(), plugin_name);
+
+        if (plugin == nullptr)
+            return false;
+
+        gst_object_unref(plugin);
+
+        GstPluginFeature *feature = gst_registry_lookup_feature(gst_registry_get(), feature_name);
+
+        if (feature == nullptr)
+            return false;
+
+        gst_object_unref(feature);
+        return true;
+    }
+
+    /**
+     * Decoders with no matching encoder are checked by opening the device (NULL -> READY)
+     * @param logger
+     * @param feature
+     * @return
+     */
+    bool Capabilities::canOpen(const nvr_logger &logger, const char *feature) {
+        GstElement *element = gst_element_factory_make(feature, nullptr);
+
+        if (element == nullptr)
+            return false;
+
+        bool opened = gst_element_set_state(element, GST_STATE_READY) != GST_STATE_CHANGE_FAILURE;
+        gst_element_set_state(element, GST_STATE_NULL);
+        gst_object_unref(element);
+
+        if (!opened)
+            logger->warn("{} is installed but could not open its device", feature);
+
+        return opened;
+    }
+
+    /**
+     * Run a one frame test pipeline to completion
+     * @param logger
+     * @param description gst-launch style pipeline ending in a sink
+     * @return true if it reached EOS without an error
+     */
+    bool Capabilities::canEncode(const nvr_logger &logger, const char *description) {
+        GError *error = nullptr;
+        GstElement *pipeline = gst_parse_launch(description, &error);
+
+        if (pipeline == nullptr || error != nullptr) {
+            logger->warn("Could not build test pipeline '{}': {}", description,
+                         error != nullptr ? error->message : "unknown error");
+
+            if (error != nullptr)
+                g_error_free(error);
+            if (pipeline != nullptr)
+                gst_object_unref(pipeline);
+
+            return false;
+        }
+
+        bool encoded = false;
+
+        if (gst_element_set_state(pipeline, GST_STATE_PLAYING) != GST_STATE_CHANGE_FAILURE) {
+            GstBus *bus = gst_element_get_bus(pipeline);
+            GstMessage *message = gst_bus_timed_pop_filtered(bus, probe_timeout_seconds * GST_SECOND,
+                                                             (GstMessageType) (GST_MESSAGE_EOS | GST_MESSAGE_ERROR));
+
+            if (message != nullptr) {
+                encoded = GST_MESSAGE_TYPE(message) == GST_MESSAGE_EOS;
+                gst_message_unref(message);
+            }
+
+            gst_object_unref(bus);
+        }
+
+        if (!encoded)
+            logger->warn("Test encode failed: '{}'", description);
+
+        gst_element_set_state(pipeline, GST_STATE_NULL);
+        gst_object_unref(pipeline);
+
+        return encoded;
+    }
+}
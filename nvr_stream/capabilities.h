@@ -0,0 +1,40 @@
+//
+// Hardware capability probe, run once and shared between streamers through a cache file
+//
+
+#ifndef NEVER_CLI_CAPABILITIES_H
+#define NEVER_CLI_CAPABILITIES_H
+
+#include "../common.h"
+#include <gst/gst.h>
+#include <mutex>
+
+namespace nvr {
+
+    struct HardwareCapabilities {
+        bool nvidia = false;
+        bool vaapi = false;
+        bool u30 = false;
+        bool timestamper = false;
+    };
+
+    class Capabilities {
+    public:
+        static void load(const nvr_logger &logger);
+        static const HardwareCapabilities &get();
+
+    private:
+        static std::once_flag loaded;
+        static HardwareCapabilities capabilities;
+
+        static string cacheKey();
+        static HardwareCapabilities probe(const nvr_logger &logger);
+        static bool readCache(int fd, const string &key, HardwareCapabilities &result);
+        static void writeCache(int fd, const string &key, const HardwareCapabilities &result);
+        static bool hasFeature(const char *plugin, const char *feature);
+        static bool canOpen(const nvr_logger &logger, const char *feature);
+        static bool canEncode(const nvr_logger &logger, const char *description);
+    };
+}
+
+#endif //NEVER_CLI_CAPABILITIES_H
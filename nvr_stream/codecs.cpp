@@ -0,0 +1,186 @@
+//
+// Software streaming codecs, their CPU presets and what Janus needs to know about them
+//
+
+#include "codecs.h"
+
+#include <sys/resource.h>
+#include <utility>
+
+namespace nvr {
+
+    // Seconds between CPU cost reports
+    const int cost_report_interval = 60;
+
+    // Keyframe at least every 8 seconds at 15fps so late joiners without PLI still get a picture
+    const int max_keyframe_distance = 120;
+
+    // Expected encode cost at the same bitrate, openh264 and x264 in their fastest modes should
+    // be well below libvpx realtime. Not measured here, check the host's CodecCostMeter logs.
+    const StreamCodec software_codecs[] = {
+            {"openh264", "h264", "openh264enc", "rtph264pay", 0},
+            {"h264",     "h264", "x264enc",     "rtph264pay", 1},
+            {"vp8",      "vp8",  "vp8enc",      "rtpvp8pay",  2},
+            {"vp9",      "vp9",  "vp9enc",      "rtpvp9pay",  3},
+    };
+
+    StreamCodec selectCodec(const std::vector<string> &names, const nvr_logger &logger) {
+        const StreamCodec *selected = nullptr;
+
+        for (const auto &name: names) {
+            const StreamCodec *match = nullptr;
+
+            for (const auto &codec: software_codecs) {
+                if (codec.name == name)
+                    match = &codec;
+            }
+
+            if (match == nullptr) {
+                logger->warn("Unknown codec '{}', ignoring it", name);
+                continue;
+            }
+
+            GstElementFactory *factory = gst_element_factory_find(match->encoder.c_str());
+
+            if (factory == nullptr) {
+                logger->warn("Codec '{}' needs {}, which is not installed", name, match->encoder);
+                continue;
+            }
+
+            gst_object_unref(factory);
+
+            if (selected == nullptr || match->cost_rank < selected->cost_rank)
+                selected = match;
+        }
+
+        if (selected == nullptr)
+            return software_codecs[2];
+
+        return *selected;
+    }
+
+    StreamCodec hardwareCodec(const string &janus_codec) {
+        if (janus_codec == "h264")
+            return {"h264", "h264", "", "rtph264pay", 0};
+
+        return {"vp8", "vp8", "", "rtpvp8pay", 0};
+    }
+
+    /**
+     * Presets trade picture quality for CPU only, bitrate stays the same. The per-preset
+     * values below are untested defaults, tune them against the CodecCostMeter logs.
+     */
+    GstElement *createEncoder(const StreamCodec &codec, const string &preset, int64_t bitrate_kbps, const char *name) {
+        GstElement *encoder = gst_element_factory_make(codec.encoder.c_str(), name);
+        int level = preset == "low-cpu" ? 0 : preset == "quality" ? 2 : 1;
+
+        if (encoder == nullptr)
+            return nullptr;
+
+        if (codec.name == "vp8") {
+            const int cpu_used[] = {16, 8, 4};
+
+            g_object_set(G_OBJECT(encoder), "deadline", (gint64) 1, nullptr);
+            g_object_set(G_OBJECT(encoder), "cpu-used", cpu_used[level], nullptr);
+            g_object_set(G_OBJECT(encoder), "threads", 2, nullptr);
+            g_object_set(G_OBJECT(encoder), "end-usage", 1, nullptr); // CBR
+            g_object_set(G_OBJECT(encoder), "error-resilient", 1, nullptr);
+            g_object_set(G_OBJECT(encoder), "keyframe-max-dist", max_keyframe_distance, nullptr);
+            g_object_set(G_OBJECT(encoder), "target-bitrate", (gint) (bitrate_kbps * 1000), nullptr);
+        } else if (codec.name == "vp9") {
+            const int cpu_used[] = {9, 7, 5};
+
+            g_object_set(G_OBJECT(encoder), "deadline", (gint64) 1, nullptr);
+            g_object_set(G_OBJECT(encoder), "cpu-used", cpu_used[level], nullptr);
+            g_object_set(G_OBJECT(encoder), "threads", 2, nullptr);
+            g_object_set(G_OBJECT(encoder), "row-mt", true, nullptr);
+            g_object_set(G_OBJECT(encoder), "end-usage", 1, nullptr);
+            g_object_set(G_OBJECT(encoder), "lag-in-frames", 0, nullptr);
+            g_object_set(G_OBJECT(encoder), "error-resilient", 1, nullptr);
+            g_object_set(G_OBJECT(encoder), "keyframe-max-dist", max_keyframe_distance, nullptr);
+            g_object_set(G_OBJECT(encoder), "target-bitrate", (gint) (bitrate_kbps * 1000), nullptr);
+        } else if (codec.name == "h264") {
+            // ultrafast, superfast, veryfast
+            const int speed_preset[] = {1, 2, 3};
+
+            g_object_set(G_OBJECT(encoder), "speed-preset", speed_preset[level], nullptr);
+            g_object_set(G_OBJECT(encoder), "tune", 0x4, nullptr); // zerolatency
+            g_object_set(G_OBJECT(encoder), "threads", 2, nullptr);
+            g_object_set(G_OBJECT(encoder), "bitrate", (guint) bitrate_kbps, nullptr);
+            g_object_set(G_OBJECT(encoder), "key-int-max", max_keyframe_distance, nullptr);
+
+            // Without B-frames, CABAC, 8x8 transforms and weighted P prediction (which superfast and veryfast
+            // turn on) x264 emits constrained baseline, the profile codecFmtp advertises and every browser decodes
+            g_object_set(G_OBJECT(encoder), "bframes", 0, nullptr);
+            g_object_set(G_OBJECT(encoder), "cabac", false, nullptr);
+            g_object_set(G_OBJECT(encoder), "dct8x8", false, nullptr);
+            g_object_set(G_OBJECT(encoder), "option-string", "weightp=0", nullptr);
+        } else if (codec.name == "openh264") {
+            g_object_set(G_OBJECT(encoder), "complexity", level, nullptr);
+            g_object_set(G_OBJECT(encoder), "usage-type", 0, nullptr); // camera video
+            g_object_set(G_OBJECT(encoder), "rate-control", 1, nullptr); // bitrate
+            g_object_set(G_OBJECT(encoder), "bitrate", (guint) (bitrate_kbps * 1000), nullptr);
+            g_object_set(G_OBJECT(encoder), "gop-size", max_keyframe_distance, nullptr);
+        }
+
+        return encoder;
+    }
+
+    GstElement *createPayloader(const StreamCodec &codec, const char *name) {
+        GstElement *payloader = gst_element_factory_make(codec.payloader.c_str(), name);
+
+        g_object_set(G_OBJECT(payloader), "pt", 96, nullptr);
+
+        if (codec.janus_codec == "h264")
+            g_object_set(G_OBJECT(payloader), "config-interval", -1, nullptr);
+
+        return payloader;
+    }
+
+    string codecFmtp(const string &janus_codec) {
+        // Constrained baseline 3.1, packetization mode 1 is what rtph264pay sends
+        if (janus_codec == "h264")
+            return "profile-level-id=42e01f;packetization-mode=1";
+
+        if (janus_codec == "vp9")
+            return "profile-id=0";
+
+        return "";
+    }
+
+    CodecCostMeter::CodecCostMeter(const nvr_logger &logger, string description) {
+        this->logger = logger;
+        this->description = std::move(description);
+    }
+
+    void CodecCostMeter::start() {
+        last_wall = g_get_monotonic_time();
+        last_cpu = cpuTime();
+
+        g_timeout_add_seconds(cost_report_interval, sample, this);
+    }
+
+    gint64 CodecCostMeter::cpuTime() {
+        struct rusage usage{};
+        getrusage(RUSAGE_SELF, &usage);
+
+        return (gint64) (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 +
+               usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+    }
+
+    gboolean CodecCostMeter::sample(gpointer user_data) {
+        auto *meter = static_cast<CodecCostMeter *>(user_data);
+        gint64 wall = g_get_monotonic_time();
+        gint64 cpu = cpuTime();
+
+        if (wall > meter->last_wall) {
+            double cores = (double) (cpu - meter->last_cpu) / (double) (wall - meter->last_wall);
+            meter->logger->info("CPU cost: {:.1f}% of a core for {}", cores * 100.0, meter->description);
+        }
+
+        meter->last_wall = wall;
+        meter->last_cpu = cpu;
+
+        return G_SOURCE_CONTINUE;
+    }
+}
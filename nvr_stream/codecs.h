@@ -0,0 +1,78 @@
+//
+// Software streaming codecs, their CPU presets and what Janus needs to know about them
+//
+
+#ifndef NEVER_CLI_CODECS_H
+#define NEVER_CLI_CODECS_H
+
+#include "../common.h"
+#include <gst/gst.h>
+#include <vector>
+
+namespace nvr {
+
+    struct StreamCodec {
+        string name;
+        string janus_codec;
+        string encoder;
+        string payloader;
+        int cost_rank; // lower is cheaper to encode, used to pick between codecs viewers support
+    };
+
+    /**
+     * The cheapest installed codec out of the ones viewers can play
+     * @param names Codec names from the camera config (vp8, vp9, h264, openh264)
+     * @param logger
+     * @return vp8 if none of them are usable
+     */
+    StreamCodec selectCodec(const std::vector<string> &names, const nvr_logger &logger);
+
+    /**
+     * Codec produced by a hardware encoder, for the payloader and Janus
+     * @param janus_codec vp8 or h264
+     * @return
+     */
+    StreamCodec hardwareCodec(const string &janus_codec);
+
+    /**
+     * Create the software encoder for a codec, configured for a CPU preset
+     * @param codec
+     * @param preset low-cpu, balanced or quality
+     * @param bitrate_kbps
+     * @param name Element name
+     * @return
+     */
+    GstElement *createEncoder(const StreamCodec &codec, const string &preset, int64_t bitrate_kbps, const char *name);
+
+    GstElement *createPayloader(const StreamCodec &codec, const char *name);
+
+    /**
+     * Janus fmtp line matching what our encoders produce, empty when none is needed
+     * @param janus_codec
+     * @return
+     */
+    string codecFmtp(const string &janus_codec);
+
+    /**
+     * Logs this process' CPU use (one nvr_stream is one stream) so presets can be compared
+     */
+    class CodecCostMeter {
+    public:
+        CodecCostMeter(const nvr_logger &logger, string description);
+        CodecCostMeter(CodecCostMeter const &) = delete;
+        CodecCostMeter &operator=(CodecCostMeter const &) = delete;
+
+        void start();
+
+    private:
+        nvr_logger logger;
+        string description;
+        gint64 last_wall = 0;
+        gint64 last_cpu = 0;
+
+        static gint64 cpuTime();
+        static gboolean sample(gpointer user_data);
+    };
+}
+
+#endif //NEVER_CLI_CODECS_H
@@ -0,0 +1,62 @@
+//
+// Extra consumers of decoded frames hanging off the tee between decoder and encoder
+//
+
+#include "decoded_branch.h"
+
+namespace nvr {
+
+    bool attachDecodedBranch(GstElement *pipeline, GstElement *tee, const DecodedBranchFormat &format, GstElement *sink,
+                             const nvr_logger &logger) {
+        string prefix = format.name + "_";
+
+        GstElement *queue = gst_element_factory_make("queue", (prefix + "queue").c_str());
+        GstElement *rate = nullptr;
+        GstElement *convert = gst_element_factory_make("videoconvert", (prefix + "convert").c_str());
+        GstElement *scale = gst_element_factory_make("videoscale", (prefix + "scale").c_str());
+        GstElement *caps_filter = gst_element_factory_make("capsfilter", (prefix + "caps").c_str());
+
+        g_object_set(G_OBJECT(queue), "leaky", 2, nullptr);
+        g_object_set(G_OBJECT(queue), "max-size-buffers", 1, nullptr);
+        g_object_set(G_OBJECT(queue), "max-size-bytes", 0, nullptr);
+        g_object_set(G_OBJECT(queue), "max-size-time", 0, nullptr);
+
+        if (format.max_fps > 0) {
+            rate = gst_element_factory_make("videorate", (prefix + "rate").c_str());
+            g_object_set(G_OBJECT(rate), "drop-only", true, nullptr);
+            g_object_set(G_OBJECT(rate), "max-rate", format.max_fps, nullptr);
+        }
+
+        GstCaps *caps = gst_caps_new_empty_simple("video/x-raw");
+
+        if (!format.format.empty())
+            gst_caps_set_simple(caps, "format", G_TYPE_STRING, format.format.c_str(), nullptr);
+
+        if (format.width > 0)
+            gst_caps_set_simple(caps, "width", G_TYPE_INT, format.width, nullptr);
+
+        if (format.height > 0)
+            gst_caps_set_simple(caps, "height", G_TYPE_INT, format.height, nullptr);
+
+        g_object_set(G_OBJECT(caps_filter), "caps", caps, nullptr);
+        gst_caps_unref(caps);
+
+        gst_bin_add_many(GST_BIN(pipeline), queue, convert, scale, caps_filter, sink, nullptr);
+
+        if (rate != nullptr)
+            gst_bin_add(GST_BIN(pipeline), rate);
+
+        bool linked = rate != nullptr ?
+                      gst_element_link_many(tee, queue, rate, convert, scale, caps_filter, sink, nullptr) :
+                      gst_element_link_many(tee, queue, convert, scale, caps_filter, sink, nullptr);
+
+        if (!linked) {
+            logger->error("Could not link decoded frame branch '{}'", format.name);
+            return false;
+        }
+
+        logger->info("Decoded frame branch '{}' attached ({} {}x{} max {}fps)", format.name,
+                     format.format.empty() ? "any format" : format.format, format.width, format.height, format.max_fps);
+        return true;
+    }
+}
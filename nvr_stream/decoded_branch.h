@@ -0,0 +1,40 @@
+//
+// Extra consumers of decoded frames hanging off the tee between decoder and encoder
+//
+
+#ifndef NEVER_CLI_DECODED_BRANCH_H
+#define NEVER_CLI_DECODED_BRANCH_H
+
+#include "../common.h"
+#include <gst/gst.h>
+
+namespace nvr {
+
+    /**
+     * What a decoded branch wants its frames to look like. Zero keeps the
+     * decoder's value, an empty format keeps the decoder's format.
+     */
+    struct DecodedBranchFormat {
+        string name;
+        string format;
+        int width;
+        int height;
+        int max_fps;
+    };
+
+    /**
+     * Attach tee -> leaky queue -> [videorate] -> videoconvert -> videoscale -> caps -> sink.
+     * The queue holds a single frame and drops older ones, so a slow branch can never
+     * hold back the encoder.
+     * @param pipeline
+     * @param tee Decoded frame tee
+     * @param format
+     * @param sink Branch sink, added to the pipeline here
+     * @param logger
+     * @return
+     */
+    bool attachDecodedBranch(GstElement *pipeline, GstElement *tee, const DecodedBranchFormat &format, GstElement *sink,
+                             const nvr_logger &logger);
+}
+
+#endif //NEVER_CLI_DECODED_BRANCH_H
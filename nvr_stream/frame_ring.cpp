@@ -0,0 +1,195 @@
+//
+// Decoded frames published into a shared memory ring for local analytics
+//
+
+#include "frame_ring.h"
+
+#include <gst/video/video.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+namespace nvr {
+
+    // Slots start cache line aligned
+    const size_t slot_alignment = 64;
+
+    static size_t alignSlot(size_t size) {
+        return (size + slot_alignment - 1) & ~(slot_alignment - 1);
+    }
+
+    /**
+     * @param logger
+     * @param stream_id Consumers open /dev/shm/nvr-frames-<stream_id>
+     * @param slots Frames kept, the oldest is overwritten when consumers fall behind
+     */
+    FrameRing::FrameRing(const nvr_logger &logger, const string &stream_id, int slots) {
+        this->logger = logger;
+        this->name = "/nvr-frames-" + stream_id;
+        this->slot_count = (uint32_t) std::max(slots, 2);
+    }
+
+    FrameRing::~FrameRing() {
+        unmap();
+        shm_unlink(name.c_str());
+    }
+
+    /**
+     * Sink for a decoded branch
+     * @return
+     */
+    GstElement *FrameRing::create() {
+        GstElement *sink = gst_element_factory_make("appsink", "frame_ring");
+
+        g_object_set(G_OBJECT(sink), "sync", false, nullptr);
+        g_object_set(G_OBJECT(sink), "async", false, nullptr);
+        g_object_set(G_OBJECT(sink), "max-buffers", 1, nullptr);
+        g_object_set(G_OBJECT(sink), "drop", true, nullptr);
+
+        GstAppSinkCallbacks callbacks = {nullptr, nullptr, newSample};
+        gst_app_sink_set_callbacks(GST_APP_SINK(sink), &callbacks, this, nullptr);
+
+        return sink;
+    }
+
+    const string &FrameRing::getName() const {
+        return name;
+    }
+
+    GstFlowReturn FrameRing::newSample(GstAppSink *sink, gpointer user_data) {
+        GstSample *sample = gst_app_sink_pull_sample(sink);
+
+        if (sample != nullptr) {
+            static_cast<FrameRing *>(user_data)->publish(sample);
+            gst_sample_unref(sample);
+        }
+
+        return GST_FLOW_OK;
+    }
+
+    /**
+     * (Re)create the shared memory object sized for frames of frame_size bytes
+     * @param frame_size
+     * @return
+     */
+    bool FrameRing::map(uint32_t frame_size) {
+        unmap();
+
+        // Readers still holding the old object see it go stale and reopen by name
+        shm_unlink(name.c_str());
+
+        int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+
+        if (fd == -1) {
+            logger->error("Could not create frame ring {}: {}", name, strerror(errno));
+            return false;
+        }
+
+        size_t header_size = alignSlot(sizeof(FrameRingHeader));
+        size_t size = alignSlot(sizeof(FrameSlotHeader) + frame_size);
+        mapping_size = header_size + size * slot_count;
+
+        if (ftruncate(fd, (off_t) mapping_size) == -1) {
+            logger->error("Could not size frame ring {}: {}", name, strerror(errno));
+            close(fd);
+            return false;
+        }
+
+        void *address = mmap(nullptr, mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+
+        if (address == MAP_FAILED) {
+            logger->error("Could not map frame ring {}: {}", name, strerror(errno));
+            return false;
+        }
+
+        mapping = static_cast<uint8_t *>(address);
+        slot_size = (uint32_t) size;
+
+        auto *header = new(mapping) FrameRingHeader{};
+        header->slot_count = slot_count;
+        header->slot_size = slot_size;
+        header->header_size = (uint32_t) header_size;
+        header->frames_written = 0;
+        header->stale = 0;
+        header->version = frame_ring_version;
+
+        for (uint32_t i = 0; i < slot_count; i++)
+            new(mapping + header_size + (size_t) i * slot_size) FrameSlotHeader{};
+
+        // Written last, readers wait for the magic before trusting anything else
+        std::atomic_thread_fence(std::memory_order_release);
+        header->magic = frame_ring_magic;
+
+        logger->info("Publishing decoded frames to /dev/shm{} ({} slots of {} bytes)", name, slot_count, slot_size);
+        return true;
+    }
+
+    void FrameRing::unmap() {
+        if (mapping == nullptr)
+            return;
+
+        reinterpret_cast<FrameRingHeader *>(mapping)->stale = 1;
+        munmap(mapping, mapping_size);
+
+        mapping = nullptr;
+        mapping_size = 0;
+        slot_size = 0;
+    }
+
+    /**
+     * Copy a frame into the next slot. Never waits on readers: a slot being read
+     * is simply overwritten and the reader notices the sequence change.
+     * @param sample
+     */
+    void FrameRing::publish(GstSample *sample) {
+        GstBuffer *buffer = gst_sample_get_buffer(sample);
+        GstVideoInfo info;
+
+        if (buffer == nullptr || !gst_video_info_from_caps(&info, gst_sample_get_caps(sample)))
+            return;
+
+        auto frame_size = (uint32_t) GST_VIDEO_INFO_SIZE(&info);
+
+        if (mapping == nullptr || sizeof(FrameSlotHeader) + frame_size > slot_size) {
+            if (!map(frame_size))
+                return;
+        }
+
+        GstMapInfo map_info = GST_MAP_INFO_INIT;
+
+        if (!gst_buffer_map(buffer, &map_info, GST_MAP_READ))
+            return;
+
+        auto *header = reinterpret_cast<FrameRingHeader *>(mapping);
+        uint64_t frame_number = frames++;
+        uint8_t *slot = mapping + header->header_size + (size_t) (frame_number % slot_count) * slot_size;
+        auto *slot_header = reinterpret_cast<FrameSlotHeader *>(slot);
+        auto size = (uint32_t) std::min<size_t>(map_info.size, slot_size - sizeof(FrameSlotHeader));
+
+        // Odd while writing
+        uint64_t sequence = slot_header->sequence.load(std::memory_order_relaxed);
+        slot_header->sequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        slot_header->frame_number = frame_number;
+        slot_header->pts_ns = GST_CLOCK_TIME_IS_VALID(GST_BUFFER_PTS(buffer)) ? (int64_t) GST_BUFFER_PTS(buffer) : -1;
+        slot_header->wall_time_us = g_get_real_time();
+        slot_header->width = GST_VIDEO_INFO_WIDTH(&info);
+        slot_header->height = GST_VIDEO_INFO_HEIGHT(&info);
+        slot_header->size = size;
+
+        memset(slot_header->format, 0, sizeof(slot_header->format));
+        strncpy(slot_header->format, GST_VIDEO_INFO_NAME(&info), sizeof(slot_header->format) - 1);
+
+        for (int plane = 0; plane < 4; plane++) {
+            slot_header->stride[plane] = GST_VIDEO_INFO_PLANE_STRIDE(&info, plane);
+            slot_header->offset[plane] = (uint32_t) GST_VIDEO_INFO_PLANE_OFFSET(&info, plane);
+        }
+
+        memcpy(slot + sizeof(FrameSlotHeader), map_info.data, size);
+        gst_buffer_unmap(buffer, &map_info);
+
+        slot_header->sequence.store(sequence + 2, std::memory_order_release);
+        header->frames_written.store(frame_number + 1, std::memory_order_release);
+    }
+}
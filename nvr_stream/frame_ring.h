@@ -0,0 +1,77 @@
+//
+// Decoded frames published into a shared memory ring for local analytics
+//
+
+#ifndef NEVER_CLI_FRAME_RING_H
+#define NEVER_CLI_FRAME_RING_H
+
+#include "../common.h"
+#include <gst/gst.h>
+#include <gst/app/gstappsink.h>
+#include <atomic>
+
+namespace nvr {
+
+    // "NVRF"
+    const uint32_t frame_ring_magic = 0x4652564e;
+    const uint32_t frame_ring_version = 1;
+
+    /**
+     * Start of the shared memory object, followed by slot_count slots of
+     * slot_size bytes. Each slot is a FrameSlotHeader then the frame data.
+     */
+    struct FrameRingHeader {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t slot_count;
+        uint32_t slot_size;
+        std::atomic<uint64_t> frames_written;
+        std::atomic<uint32_t> stale; // set before the object is replaced (resolution change) or removed
+        uint32_t header_size;
+    };
+
+    /**
+     * Readers copy the slot out and keep it only if sequence was even and
+     * unchanged before and after, otherwise the writer lapped them.
+     */
+    struct FrameSlotHeader {
+        std::atomic<uint64_t> sequence;
+        uint64_t frame_number;
+        int64_t pts_ns;
+        int64_t wall_time_us;
+        char format[8];
+        uint32_t width;
+        uint32_t height;
+        uint32_t stride[4];
+        uint32_t offset[4];
+        uint32_t size;
+    };
+
+    class FrameRing {
+    public:
+        FrameRing(const nvr_logger &logger, const string &stream_id, int slots);
+        ~FrameRing();
+        FrameRing(FrameRing const &) = delete;
+        FrameRing &operator=(FrameRing const &) = delete;
+
+        GstElement *create();
+        [[nodiscard]] const string &getName() const;
+
+    private:
+        nvr_logger logger;
+        string name;
+        uint32_t slot_count;
+        uint32_t slot_size = 0;
+        size_t mapping_size = 0;
+        uint8_t *mapping = nullptr;
+        uint64_t frames = 0;
+
+        bool map(uint32_t frame_size);
+        void unmap();
+        void publish(GstSample *sample);
+
+        static GstFlowReturn newSample(GstAppSink *sink, gpointer user_data);
+    };
+}
+
+#endif //NEVER_CLI_FRAME_RING_H
@@ -3,7 +3,10 @@
 //
 
 #include "janus.h"
+#include "codecs.h"
 
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include <utility>
 
 using json = nlohmann::json;
@@ -21,6 +24,11 @@ namespace nvr {
         this->logger = logger;
     }
 
+    Janus::~Janus() {
+        // The reader may have noticed a lost connection already, its threads still need joining
+        disconnect();
+    }
+
     bool Janus::isConnected() const {
         return this->connected;
     }
@@ -33,22 +41,42 @@ namespace nvr {
         return this->_stream_id;
     }
 
+    /**
+     * Register a handler for messages Janus sends without a matching transaction
+     * (session events, plugin events, timeouts). Called on the reader thread.
+     * @param handler
+     */
+    void Janus::onEvent(EventHandler handler) {
+        std::lock_guard<std::mutex> lock(pending_mutex);
+        this->event_handler = std::move(handler);
+    }
+
+    /**
+     * Create mountpoints with an RTCP port (RTP port + 1) so Janus relays
+     * viewers' PLI/FIR back to us
+     * @param enabled
+     */
+    void Janus::setRTCPFeedback(bool enabled) {
+        this->rtcp_feedback = enabled;
+    }
+
     void Janus::keepAlive() {
-        std::thread{
+        if (keep_alive_thread.joinable())
+            return;
+
+        keep_alive_thread = std::thread{
                 [this]() {
-                    auto result = std::async(std::launch::async, [&] {
-                        while (connected) {
-                            if (!sendKeepAlive())
-                                std::this_thread::sleep_for(std::chrono::seconds(1));
-                            else
-                                std::this_thread::sleep_for(std::chrono::seconds(15));
-                        }
-
-                        return;
-                    });
-                    result.get();
+                    std::unique_lock<std::mutex> lock(keep_alive_mutex);
+
+                    while (connected) {
+                        lock.unlock();
+                        auto interval = sendKeepAlive() ? std::chrono::seconds(15) : std::chrono::seconds(1);
+                        lock.lock();
+
+                        keep_alive_condition.wait_for(lock, interval, [this] { return !connected; });
+                    }
                 }
-        }.detach();
+        };
     }
 
 
@@ -60,6 +88,9 @@ namespace nvr {
         if (connected)
             return connected;
 
+        // Reap the threads and socket of a connection the reader saw drop
+        disconnect();
+
         logger->info("Connecting to Janus with socket '{}'", janus_socket);
 
         if ((out_sock = socket(AF_UNIX, SOCK_SEQPACKET, 0)) == -1) {
@@ -75,25 +106,59 @@ namespace nvr {
 
         if (::connect(out_sock, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) == -1) {
             logger->error("Could not connect to Janus");
+            close(out_sock);
+            out_sock = -1;
             return false;
         }
 
         connected = true;
+        reader_thread = std::thread(&Janus::readResponses, this);
+
         return connected;
     }
 
+    /**
+     * Disconnect from Janus. The mountpoint is left in place so the next
+     * streamer for this camera can reuse it without viewers renegotiating.
+     * @return
+     */
     bool Janus::disconnect() {
-        if (streaming && _stream_id != -1)
-            if (!destroyStream(_stream_id))
-                logger->warn("Could not destroy Janus stream with ID '{}'", _stream_id);
+        {
+            std::lock_guard<std::mutex> lock(keep_alive_mutex);
+            connected = false;
+        }
+        keep_alive_condition.notify_all();
 
+        // Wakes the reader out of recv()
+        if (out_sock != -1)
+            shutdown(out_sock, SHUT_RDWR);
 
-        close(out_sock);
+        if (reader_thread.joinable() && reader_thread.get_id() != std::this_thread::get_id())
+            reader_thread.join();
 
-        connected = false;
+        if (keep_alive_thread.joinable() && keep_alive_thread.get_id() != std::this_thread::get_id())
+            keep_alive_thread.join();
+
+        if (out_sock != -1) {
+            close(out_sock);
+            out_sock = -1;
+        }
+
+        forgetSession();
         return true;
     }
 
+    /**
+     * Sessions and handles die with the connection, the next attach creates new ones
+     */
+    void Janus::forgetSession() {
+        std::lock_guard<std::mutex> lock(session_mutex);
+        _session_id = -1;
+        _handler_id = -1;
+        _stream_id = -1;
+        streaming = false;
+    }
+
     /**
      * Find the stream ID by a description
      * @param description
@@ -147,6 +212,8 @@ namespace nvr {
 
 
     int64_t Janus::getSessionID() {
+        std::lock_guard<std::mutex> lock(session_mutex);
+
         if (_session_id > 0)
             return _session_id;
 
@@ -158,11 +225,18 @@ namespace nvr {
         json response = performRequest(request);
         json data = response["data"];
 
+        if (!data.contains("id")) {
+            logger->error("Could not create Janus session: {}", response.dump());
+            return -1;
+        }
+
         _session_id = data["id"];
         return _session_id;
     }
 
     int64_t Janus::getPluginHandlerID(int64_t session_id) {
+        std::lock_guard<std::mutex> lock(session_mutex);
+
         if (_handler_id > 0)
             return _handler_id;
 
@@ -176,6 +250,11 @@ namespace nvr {
         json response = performRequest(request);
         json data = response["data"];
 
+        if (!data.contains("id")) {
+            logger->error("Could not attach to streaming plugin: {}", response.dump());
+            return -1;
+        }
+
         _handler_id = data["id"];
         return _handler_id;
     }
@@ -203,74 +282,189 @@ namespace nvr {
         return false;
     }
 
-    json Janus::performRequest(const json &request) const {
-        string request_str = request.dump();
+    /**
+     * Send a request and hand its reply to a handler on the reader thread.
+     * Handlers must not block on another request.
+     * @param request Request with or without a transaction, one is added if missing
+     * @param handler Called once with the reply, or with an error response on disconnect
+     * @param wait_for_event Skip the 'ack' Janus sends for asynchronous plugin messages
+     */
+    void Janus::sendRequest(json request, ResponseHandler handler, bool wait_for_event) {
+        if (!request.contains("transaction"))
+            request["transaction"] = generateRandom();
+
+        const string transaction = request["transaction"];
+        const string request_str = request.dump();
+
+        {
+            // Checked under the same lock failPendingRequests() takes, so a request is either
+            // refused here or failed there, never left waiting on a dead socket
+            std::unique_lock<std::mutex> lock(pending_mutex);
+
+            if (!connected) {
+                lock.unlock();
+                handler(errorResponse("not connected"));
+                return;
+            }
 
-        if (send(out_sock, request_str.data(), request_str.size(), 0) == -1) {
-            logger->error("Could not send request: {}", request_str);
+            pending[transaction] = {std::move(handler), wait_for_event};
+        }
+
+        ssize_t sent;
+        {
+            // SOCK_SEQPACKET keeps each request as one record, the lock keeps writers from interleaving
+            std::lock_guard<std::mutex> lock(send_mutex);
+            sent = send(out_sock, request_str.data(), request_str.size(), MSG_NOSIGNAL);
         }
 
-        char *buffer;
-        clock_t begin = clock();
-        string raw_response = string();
-        int total_bytes = 0;
+        if (sent == -1) {
+            logger->error("Could not send request: {}", request_str);
 
-        while (true) {
-            buffer = (char *) malloc((BUFSIZ + 1) * sizeof(char));
-            int bytes = (int) read(out_sock, buffer, BUFSIZ);
-            total_bytes += bytes;
+            ResponseHandler failed;
+            {
+                std::lock_guard<std::mutex> lock(pending_mutex);
+                auto entry = pending.find(transaction);
 
-            if (bytes <= 0 && total_bytes > 0) {
-                free(buffer);
-                break;
+                if (entry != pending.end()) {
+                    failed = std::move(entry->second.handler);
+                    pending.erase(entry);
+                }
             }
 
-            raw_response.append(buffer);
-            free(buffer);
+            if (failed)
+                failed(errorResponse("send failed"));
+        }
+    }
+
+    std::future<json> Janus::sendRequest(json request, bool wait_for_event) {
+        auto promise = std::make_shared<std::promise<json>>();
+        auto future = promise->get_future();
+
+        sendRequest(std::move(request), [promise](const json &response) {
+            promise->set_value(response);
+        }, wait_for_event);
+
+        return future;
+    }
+
+    json Janus::performRequest(const json &request, bool wait_for_event) {
+        json tracked = request;
+
+        if (!tracked.contains("transaction"))
+            tracked["transaction"] = generateRandom();
+
+        const string transaction = tracked["transaction"];
+        auto future = sendRequest(std::move(tracked), wait_for_event);
+
+        if (future.wait_for(std::chrono::seconds(5)) == std::future_status::ready)
+            return future.get();
+
+        logger->error("Timed out waiting for reply from Janus");
+
+        {
+            std::lock_guard<std::mutex> lock(pending_mutex);
+            pending.erase(transaction);
+        }
+
+        return errorResponse("timeout");
+    }
+
+    /**
+     * Single reader for the Janus socket. Every recv() on a SOCK_SEQPACKET socket
+     * returns exactly one message, so no re-framing is needed.
+     */
+    void Janus::readResponses() {
+        std::vector<char> buffer(BUFSIZ);
+
+        while (connected) {
+            // Peek with MSG_TRUNC to learn the full record size before consuming it
+            ssize_t length = recv(out_sock, buffer.data(), buffer.size(), MSG_PEEK | MSG_TRUNC);
 
-            // Using the fact that we need to have the same number of opening/closing tags with JSON for it to be valid
-            auto o_tag_count = std::ranges::count(raw_response, '{');
-            auto c_tag_count = std::ranges::count(raw_response, '}');
+            if (length < 0 && errno == EINTR)
+                continue;
 
-            if (abs(o_tag_count) == abs(c_tag_count))
+            if (length <= 0)
                 break;
 
-            clock_t end = clock();
-            double time_spent = (double) (end - begin) / CLOCKS_PER_SEC;
+            if ((size_t) length > buffer.size())
+                buffer.resize(length);
 
-            if (time_spent >= 5) {
-                logger->error("Timed out waiting for reply from Janus");
+            length = recv(out_sock, buffer.data(), buffer.size(), 0);
+
+            if (length <= 0)
                 break;
-            }
+
+            dispatchResponse(buffer.data(), length);
         }
 
+        {
+            std::lock_guard<std::mutex> lock(keep_alive_mutex);
 
-        if (!raw_response.ends_with('}')) {
-            auto last_pos = raw_response.find_last_of('}');
-            auto initial_raw_response = string(raw_response);
+            if (connected)
+                logger->error("Lost connection to Janus");
 
-            raw_response = raw_response.substr(0, last_pos + 1);
+            connected = false;
+        }
+        keep_alive_condition.notify_all();
 
-            if (initial_raw_response.size() > raw_response.size()) {
-                logger->warn("Removed {} bytes from end of response",
-                             (initial_raw_response.size() - raw_response.size()));
-            }
+        // After failing the requests, a getSessionID() waiting on one holds the session lock
+        failPendingRequests();
+        forgetSession();
+    }
+
+    void Janus::dispatchResponse(const char *data, size_t length) {
+        json response = json::parse(data, data + length, nullptr, false);
+
+        if (response.is_discarded()) {
+            logger->error("Raw response is not valid JSON: '{}'", string(data, length));
+            return;
         }
 
-        if (raw_response.empty() || !raw_response.starts_with('{')) {
-            logger->error("Raw response is not valid JSON: '{}'", raw_response);
-        } else {
-            try {
-                json response = json::parse(raw_response);
-                return response;
-            } catch (json::exception &exception) {
-                logger->error("Could not parse JSON: {}", exception.what());
-                logger->error("Full response: {}", raw_response);
+        ResponseHandler handler;
+        EventHandler events;
+
+        {
+            std::lock_guard<std::mutex> lock(pending_mutex);
+            auto entry = response.contains("transaction") && response["transaction"].is_string()
+                         ? pending.find(response["transaction"].get<string>())
+                         : pending.end();
+
+            if (entry != pending.end()) {
+                // Asynchronous plugin requests are acknowledged first, the real reply follows
+                if (entry->second.wait_for_event && response.value("janus", "") == "ack")
+                    return;
+
+                handler = std::move(entry->second.handler);
+                pending.erase(entry);
+            } else {
+                events = event_handler;
             }
         }
 
+        if (handler)
+            handler(response);
+        else if (events)
+            events(response);
+        else
+            logger->debug("Unhandled Janus message: {}", response.dump());
+    }
+
+    void Janus::failPendingRequests() {
+        std::unordered_map<string, PendingRequest> failed;
+
+        {
+            std::lock_guard<std::mutex> lock(pending_mutex);
+            failed.swap(pending);
+        }
+
+        for (auto &[transaction, request]: failed)
+            request.handler(errorResponse("disconnected"));
+    }
+
+    json Janus::errorResponse(const string &reason) {
         json response;
         response["message"] = "error";
+        response["reason"] = reason;
 
         return response;
     }
@@ -328,11 +522,12 @@ namespace nvr {
      * Create a Media JSON array for the stream
      * @param port RTP streaming port
      * @param media_id Media ID
-     * @param codec Media codec, either vp8 or h264
+     * @param codec Media codec: vp8, vp9 or h264
+     * @param rtcp_feedback Also listen for RTCP on port + 1
      *
      * @return
      */
-    json Janus::buildMedia(int64_t port, int64_t media_id, const string& codec) {
+    json Janus::buildMedia(int64_t port, int64_t media_id, const string& codec, bool rtcp_feedback) {
         json media;
 
         media["mid"] = std::to_string(media_id);
@@ -342,30 +537,159 @@ namespace nvr {
         media["port"] = port;
         media["pt"] = 96;
 
+        if (rtcp_feedback)
+            media["rtcpport"] = port + 1;
+
+        string fmtp = codecFmtp(codec);
+        if (!fmtp.empty())
+            media["fmtp"] = fmtp;
+
         media = json::array({media});
         return media;
     }
 
+    /**
+     * Attach to this camera's mountpoint, reusing an existing one when its codec
+     * still matches. Looks up the stable ID first, then falls back to a mountpoint
+     * with a matching description (e.g. one created with a random ID).
+     * @param camera_id Readable camera ID with hyphen
+     * @param port RTP streaming port, updated to the existing mountpoint's port when reused
+     * @param codec Media codec: vp8, vp9 or h264
+     * @return true if streaming
+     */
+    bool Janus::attachStream(const string &camera_id, int64_t &port, const string &codec) {
+        int64_t stream_id = stableStreamID(camera_id);
+        json info = getStreamInfo(stream_id);
+
+        if (info.is_null()) {
+            int64_t existing_id = findStreamID(camera_id);
+
+            if (existing_id != -1) {
+                stream_id = existing_id;
+                info = getStreamInfo(stream_id);
+            }
+        }
+
+        if (!info.is_null()) {
+            json video;
+
+            if (info.contains("media"))
+                for (auto &media: info["media"])
+                    if (media.value("type", "") == "video")
+                        video = media;
+
+            // Mountpoints from before RTCP feedback was enabled would never relay PLI/FIR
+            bool rtcp_matches = !rtcp_feedback || (video.contains("port") && video.contains("rtcpport") &&
+                                                   video["rtcpport"] == video["port"].get<int64_t>() + 1);
+
+            if (video.value("codec", "") == codec && video.contains("port") && rtcp_matches) {
+                int64_t existing_port = video["port"];
+
+                if (existing_port != port)
+                    logger->info("Mountpoint '{}' listens on port {}, using it instead of {}", stream_id,
+                                 existing_port, port);
+
+                port = existing_port;
+                _stream_id = stream_id;
+                streaming = true;
+
+                if (info.value("description", "") != camera_id)
+                    editStream(stream_id, camera_id);
+
+                logger->info("Reusing Janus stream '{}' with ID '{}' on port {}", camera_id, stream_id, port);
+                return streaming;
+            }
+
+            if (video.value("codec", "") != codec)
+                logger->info("Mountpoint '{}' has codec '{}', recreating it with '{}'", stream_id,
+                             video.value("codec", "unknown"), codec);
+            else
+                logger->info("Mountpoint '{}' has no RTCP port, recreating it with one", stream_id);
+
+            destroyStream(stream_id);
+        }
+
+        return createStream(camera_id, stream_id, port, codec);
+    }
+
+    /**
+     * Get the detailed info for a mountpoint
+     * @param stream_id
+     * @return The info object, or null if no such mountpoint exists
+     */
+    json Janus::getStreamInfo(int64_t stream_id) {
+        json body;
+
+        body["request"] = "info";
+        body["id"] = stream_id;
+
+        json request = buildMessage(body);
+        json response = performRequest(request);
+        json response_data = response["plugindata"]["data"];
+
+        if (response_data.contains("info"))
+            return response_data["info"];
+
+        return nullptr;
+    }
+
+    /**
+     * Update a mountpoint's description and metadata in place
+     * @param stream_id
+     * @param camera_id
+     * @return
+     */
+    bool Janus::editStream(int64_t stream_id, const string &camera_id) {
+        json body;
+        json metadata;
+
+        metadata["cameraID"] = camera_id;
+
+        body["request"] = "edit";
+        body["id"] = stream_id;
+        body["new_description"] = camera_id;
+        body["new_metadata"] = to_string(metadata);
+
+        json request = buildMessage(body);
+        json response = performRequest(request);
+        json response_data = response["plugindata"]["data"];
+
+        if (response_data.contains("error")) {
+            logger->warn("Could not edit stream '{}': {}", stream_id, response_data["error"].dump());
+            return false;
+        }
+
+        return true;
+    }
+
     /**
      * Create a stream on Janus
      * @param camera_id Readable camera ID with hyphen
+     * @param stream_id Mountpoint ID to create
      * @param port RTP streaming port
-     * @param codec Media codec, either vp8 or h264
+     * @param codec Media codec: vp8, vp9 or h264
      * @return true if created
      */
-    bool Janus::createStream(const string &camera_id, int64_t port, string codec) {
+    bool Janus::createStream(const string &camera_id, int64_t stream_id, int64_t port, const string &codec) {
         json body;
         json metadata;
 
         logger->info("Creating Janus stream '{}'", camera_id);
 
-        int64_t media_id = generateMediaID();
+        if (rtcp_feedback && !isPortFree(port + 1)) {
+            logger->error("RTCP port {} is in use, cannot create the stream on port {}", port + 1, port);
+            streaming = false;
+            return streaming;
+        }
+
         metadata["cameraID"] = camera_id;
 
         body["request"] = "create";
+        body["id"] = stream_id;
         body["name"] = camera_id;
+        body["description"] = camera_id;
         body["type"] = "rtp";
-        body["media"] = buildMedia(port, media_id, std::move(codec));
+        body["media"] = buildMedia(port, stream_id, codec, rtcp_feedback);
         body["metadata"] = to_string(metadata);
         body["threads"] = 2;
 
@@ -387,8 +711,7 @@ namespace nvr {
 
             this->_stream_id = stream_data["id"];
 
-            logger->info("Stream '{}' created, has ID '{}' and media ID '{}'", camera_id, this->getStreamID(),
-                         media_id);
+            logger->info("Stream '{}' created, has ID '{}'", camera_id, this->getStreamID());
             streaming = true;
         } else {
             logger->warn("Not sure, dumping response: {}", response.dump());
@@ -398,19 +721,46 @@ namespace nvr {
         return streaming;
     }
 
-    int64_t Janus::generateMediaID() {
-        std::random_device rd;
-        std::mt19937_64 gen(rd());
-        std::uniform_int_distribution<unsigned long long> dis;
+    /**
+     * Whether a UDP port can be bound on loopback, e.g. by Janus for RTCP
+     * @param port
+     * @return
+     */
+    bool Janus::isPortFree(int64_t port) {
+        int sock = socket(AF_INET, SOCK_DGRAM, 0);
+
+        if (sock == -1)
+            return false;
+
+        struct sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons((uint16_t) port);
+
+        bool free = port > 0 && port < 65536 && bind(sock, (struct sockaddr *) &address, sizeof(address)) == 0;
+        close(sock);
+
+        return free;
+    }
+
+    /**
+     * Derive a mountpoint ID that stays the same across restarts. Numeric camera
+     * IDs are used as-is, anything else is hashed (FNV-1a) into the range a
+     * JavaScript client can represent.
+     * @param camera_id
+     * @return
+     */
+    int64_t Janus::stableStreamID(const string &camera_id) {
+        if (!camera_id.empty() && std::ranges::all_of(camera_id, ::isdigit) && camera_id.size() < 16)
+            return std::stoll(camera_id);
 
-        int64_t mid = dis(gen) % 9 + 1;
-        int index;
+        uint64_t hash = 14695981039346656037ULL;
 
-        for (index = 0; index < 15; index++) {
-            mid *= 10;
-            mid += dis(gen) % 10;
+        for (unsigned char character: camera_id) {
+            hash ^= character;
+            hash *= 1099511628211ULL;
         }
 
-        return mid;
+        return (int64_t) (hash % ((1ULL << 53) - 1)) + 1;
     }
 }
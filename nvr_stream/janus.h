@@ -7,10 +7,15 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/types.h>
+#include <atomic>
 #include <chrono>
-#include <thread>
+#include <condition_variable>
+#include <functional>
 #include <future>
+#include <mutex>
 #include <random>
+#include <thread>
+#include <unordered_map>
 
 #ifndef NEVER_CLI_JANUS_H
 #define NEVER_CLI_JANUS_H
@@ -21,42 +26,79 @@ using nvr_logger = std::shared_ptr<spdlog::logger>;
 namespace nvr {
     class Janus {
     public:
+        using ResponseHandler = std::function<void(const json &response)>;
+        using EventHandler = std::function<void(const json &event)>;
+
         Janus();
         explicit Janus(nvr_logger &logger);
+        ~Janus();
+        Janus(Janus const &) = delete;
+        Janus &operator=(Janus const &) = delete;
+
         void keepAlive();
+        void onEvent(EventHandler handler);
+        void setRTCPFeedback(bool enabled);
 
         int64_t getPluginHandlerID(int64_t session_id);
         int64_t getSessionID();
         int64_t getStreamID();
         int64_t findStreamID(const string& description);
         json getStreamList();
+        json getStreamInfo(int64_t stream_id);
 
         bool destroyStream(int64_t stream_id);
-        bool createStream(const string& camera_id, int64_t port, string codec);
+        bool createStream(const string& camera_id, int64_t stream_id, int64_t port, const string& codec);
+        bool editStream(int64_t stream_id, const string& camera_id);
+        bool attachStream(const string& camera_id, int64_t &port, const string& codec);
         bool connect();
         bool disconnect();
 
+        std::future<json> sendRequest(json request, bool wait_for_event = false);
+        void sendRequest(json request, ResponseHandler handler, bool wait_for_event = false);
+
         [[nodiscard]] bool isConnected() const;
         [[nodiscard]] bool isStreaming() const;
 
     private:
+        struct PendingRequest {
+            ResponseHandler handler;
+            bool wait_for_event;
+        };
+
         bool sendKeepAlive();
+        void readResponses();
+        void dispatchResponse(const char *data, size_t length);
+        void failPendingRequests();
+        void forgetSession();
         bool streaming = false;
-        bool connected = false;
+        bool rtcp_feedback = false;
+        std::atomic<bool> connected = false;
 
         nvr_logger logger;
-        int out_sock{};
+        int out_sock{-1};
 
         int64_t _session_id = -1;
         int64_t _handler_id = -1;
         int64_t _stream_id = -1;
 
-        [[nodiscard]] json performRequest(const json& request) const;
+        std::mutex send_mutex;
+        std::mutex session_mutex;
+        std::mutex pending_mutex;
+        std::mutex keep_alive_mutex;
+        std::condition_variable keep_alive_condition;
+        std::unordered_map<string, PendingRequest> pending;
+        EventHandler event_handler;
+        std::thread reader_thread;
+        std::thread keep_alive_thread;
+
+        json performRequest(const json& request, bool wait_for_event = false);
         json buildMessage(json &body);
 
         static string generateRandom();
-        static int64_t generateMediaID();
-        static json buildMedia(int64_t port, int64_t media_id, const string& codec);
+        static json errorResponse(const string &reason);
+        static int64_t stableStreamID(const string& camera_id);
+        static bool isPortFree(int64_t port);
+        static json buildMedia(int64_t port, int64_t media_id, const string& codec, bool rtcp_feedback);
     };
 }
 
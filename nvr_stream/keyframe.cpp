@@ -0,0 +1,208 @@
+//
+// Forces an encoder keyframe when Janus relays a PLI/FIR or a new viewer joins
+//
+
+#include "keyframe.h"
+
+#include <gst/video/video.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+namespace nvr {
+
+    // RTCP packet types (RFC 3550, RFC 4585)
+    const uint8_t rtcp_receiver_report = 201;
+    const uint8_t rtcp_payload_feedback = 206;
+
+    // Payload-specific feedback formats
+    const uint8_t feedback_pli = 1;
+    const uint8_t feedback_fir = 4;
+
+    // Our SSRC in receiver reports, Janus only needs a packet to latch onto our address
+    const uint32_t feedback_ssrc = 0x4e564552;
+
+    // Several viewers joining at once should not turn into a burst of keyframes
+    const auto keyframe_min_interval = std::chrono::milliseconds(500);
+
+    KeyframeRequester::KeyframeRequester(const nvr_logger &logger, GstElement *encoder, std::shared_ptr<Janus> janus) {
+        this->logger = logger;
+        this->encoder = encoder;
+        this->janus = std::move(janus);
+    }
+
+    KeyframeRequester::~KeyframeRequester() {
+        stop();
+    }
+
+    /**
+     * Start listening for feedback on the mountpoint's RTCP port
+     * @param rtcp_port Port Janus receives and sends RTCP on for this mountpoint
+     * @param stream_id Mountpoint ID, polled for its viewer count
+     * @return
+     */
+    bool KeyframeRequester::start(int64_t rtcp_port, int64_t stream_id) {
+        if (running && this->rtcp_port == rtcp_port && this->stream_id == stream_id)
+            return true;
+
+        stop();
+
+        this->rtcp_port = rtcp_port;
+        this->stream_id = stream_id;
+
+        if ((feedback_sock = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
+            logger->error("Could not create RTCP feedback socket");
+            return false;
+        }
+
+        struct sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons((uint16_t) rtcp_port);
+
+        // Janus answers feedback to wherever its RTCP came from, so send and receive on one socket
+        if (connect(feedback_sock, (struct sockaddr *) &address, sizeof(address)) == -1) {
+            logger->error("Could not connect RTCP feedback socket to port {}", rtcp_port);
+            close(feedback_sock);
+            feedback_sock = -1;
+            return false;
+        }
+
+        struct timeval timeout{1, 0};
+        setsockopt(feedback_sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        running = true;
+        feedback_thread = std::thread(&KeyframeRequester::listen, this);
+
+        logger->info("Listening for keyframe requests on RTCP port {}", rtcp_port);
+        return true;
+    }
+
+    void KeyframeRequester::stop() {
+        running = false;
+
+        if (feedback_thread.joinable())
+            feedback_thread.join();
+
+        if (feedback_sock != -1) {
+            close(feedback_sock);
+            feedback_sock = -1;
+        }
+    }
+
+    /**
+     * Ask the encoder for a keyframe, at most once per keyframe_min_interval
+     * @param reason Logged with the request
+     */
+    void KeyframeRequester::requestKeyframe(const string &reason) {
+        guint count;
+
+        {
+            std::lock_guard<std::mutex> lock(keyframe_mutex);
+            auto now = std::chrono::steady_clock::now();
+
+            if (now - last_keyframe < keyframe_min_interval)
+                return;
+
+            last_keyframe = now;
+            count = ++keyframe_count;
+        }
+
+        logger->debug("Requesting keyframe ({})", reason);
+
+        // Upstream event, the encoder receives it on its source pad
+        GstEvent *event = gst_video_event_new_upstream_force_key_unit(GST_CLOCK_TIME_NONE, TRUE, count);
+
+        if (!gst_element_send_event(encoder, event))
+            logger->warn("Encoder did not accept keyframe request");
+    }
+
+    void KeyframeRequester::listen() {
+        uint8_t buffer[1500];
+        auto last_report = std::chrono::steady_clock::time_point{};
+        auto last_poll = std::chrono::steady_clock::time_point{};
+
+        while (running) {
+            auto now = std::chrono::steady_clock::now();
+
+            if (now - last_report >= std::chrono::seconds(5)) {
+                sendReceiverReport();
+                last_report = now;
+            }
+
+            if (now - last_poll >= std::chrono::seconds(2)) {
+                pollViewers();
+                last_poll = now;
+            }
+
+            ssize_t length = recv(feedback_sock, buffer, sizeof(buffer), 0);
+
+            if (length > 0 && handleFeedback(buffer, length))
+                requestKeyframe("RTCP feedback from Janus");
+        }
+    }
+
+    /**
+     * Send an empty receiver report so Janus learns where to send feedback
+     */
+    void KeyframeRequester::sendReceiverReport() {
+        uint8_t report[8];
+
+        report[0] = 0x80; // V=2, no padding, no report blocks
+        report[1] = rtcp_receiver_report;
+        report[2] = 0;
+        report[3] = 1; // length in 32-bit words minus one
+
+        uint32_t ssrc = htonl(feedback_ssrc);
+        memcpy(report + 4, &ssrc, sizeof(ssrc));
+
+        send(feedback_sock, report, sizeof(report), MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+
+    /**
+     * Walk a compound RTCP packet looking for PLI or FIR
+     * @param data
+     * @param length
+     * @return true if a keyframe was requested
+     */
+    bool KeyframeRequester::handleFeedback(const uint8_t *data, ssize_t length) {
+        ssize_t offset = 0;
+
+        while (offset + 4 <= length) {
+            uint8_t version = data[offset] >> 6;
+            uint8_t format = data[offset] & 0x1f;
+            uint8_t packet_type = data[offset + 1];
+            ssize_t packet_length = ((data[offset + 2] << 8) | data[offset + 3]) * 4 + 4;
+
+            if (version != 2 || offset + packet_length > length)
+                break;
+
+            if (packet_type == rtcp_payload_feedback && (format == feedback_pli || format == feedback_fir))
+                return true;
+
+            offset += packet_length;
+        }
+
+        return false;
+    }
+
+    /**
+     * The streaming plugin does not tell a source about new viewers, so watch the count
+     */
+    void KeyframeRequester::pollViewers() {
+        if (janus == nullptr || !janus->isConnected())
+            return;
+
+        json info = janus->getStreamInfo(stream_id);
+
+        if (!info.contains("viewers"))
+            return;
+
+        int64_t current = info["viewers"];
+
+        if (current > viewers)
+            requestKeyframe("new viewer");
+
+        viewers = current;
+    }
+}
@@ -0,0 +1,50 @@
+//
+// Forces an encoder keyframe when Janus relays a PLI/FIR or a new viewer joins
+//
+
+#ifndef NEVER_CLI_KEYFRAME_H
+#define NEVER_CLI_KEYFRAME_H
+
+#include "../common.h"
+#include "janus.h"
+#include <gst/gst.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+
+namespace nvr {
+
+    class KeyframeRequester {
+    public:
+        KeyframeRequester(const nvr_logger &logger, GstElement *encoder, std::shared_ptr<Janus> janus);
+        ~KeyframeRequester();
+        KeyframeRequester(KeyframeRequester const &) = delete;
+        KeyframeRequester &operator=(KeyframeRequester const &) = delete;
+
+        bool start(int64_t rtcp_port, int64_t stream_id);
+        void stop();
+        void requestKeyframe(const string &reason);
+
+    private:
+        nvr_logger logger;
+        GstElement *encoder;
+        std::shared_ptr<Janus> janus;
+        int feedback_sock{-1};
+        int64_t rtcp_port = -1;
+        int64_t stream_id = -1;
+        int64_t viewers = 0;
+        guint keyframe_count = 0;
+        std::atomic<bool> running = false;
+        std::thread feedback_thread;
+        std::mutex keyframe_mutex;
+        std::chrono::steady_clock::time_point last_keyframe;
+
+        void listen();
+        void sendReceiverReport();
+        void pollViewers();
+        bool handleFeedback(const uint8_t *data, ssize_t length);
+    };
+}
+
+#endif //NEVER_CLI_KEYFRAME_H
@@ -0,0 +1,158 @@
+//
+// Ingest-to-egress latency measurement for the streaming pipeline
+//
+
+#include "latency.h"
+
+#include <algorithm>
+
+namespace nvr {
+
+    // Seconds between latency reports
+    const int report_interval = 10;
+
+    // Frames that never reach the sink (dropped, reordered) are forgotten past this
+    const size_t max_pending_frames = 256;
+
+    // Seconds between 1900-01-01 (NTP epoch) and 1970-01-01
+    const gint64 ntp_unix_offset = 2208988800LL;
+
+    LatencyProbe::LatencyProbe(const nvr_logger &logger, int jitter_buffer_ms) {
+        this->logger = logger;
+        this->jitter_buffer_ms = jitter_buffer_ms;
+        this->ntp_caps = gst_caps_new_empty_simple("timestamp/x-ntp");
+    }
+
+    /**
+     * Stamp frames as they leave the jitterbuffer. Called again whenever the
+     * depayloader is rebuilt (codec switch).
+     * @param ingest Element whose sink pad sees the incoming RTP (the depayloader)
+     */
+    void LatencyProbe::attachIngest(GstElement *ingest) {
+        auto probe_type = (GstPadProbeType) (GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST);
+
+        GstPad *ingest_pad = gst_element_get_static_pad(ingest, "sink");
+        gst_pad_add_probe(ingest_pad, probe_type, ingestProbe, this, nullptr);
+        gst_object_unref(ingest_pad);
+    }
+
+    /**
+     * Match frames against their ingest stamp as they reach the sink
+     * @param egress Element whose sink pad sees the outgoing RTP (the sink)
+     */
+    void LatencyProbe::attachEgress(GstElement *egress) {
+        auto probe_type = (GstPadProbeType) (GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST);
+
+        GstPad *egress_pad = gst_element_get_static_pad(egress, "sink");
+        gst_pad_add_probe(egress_pad, probe_type, egressProbe, this, nullptr);
+        gst_object_unref(egress_pad);
+
+        logger->info("Latency measurement enabled, reporting every {} seconds", report_interval);
+    }
+
+    GstBuffer *LatencyProbe::firstBuffer(GstPadProbeInfo *info) {
+        if (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
+            GstBufferList *list = GST_PAD_PROBE_INFO_BUFFER_LIST(info);
+            return gst_buffer_list_length(list) > 0 ? gst_buffer_list_get(list, 0) : nullptr;
+        }
+
+        return GST_PAD_PROBE_INFO_BUFFER(info);
+    }
+
+    GstPadProbeReturn LatencyProbe::ingestProbe([[maybe_unused]] GstPad *pad, GstPadProbeInfo *info,
+                                                gpointer user_data) {
+        GstBuffer *buffer = firstBuffer(info);
+
+        if (buffer != nullptr)
+            static_cast<LatencyProbe *>(user_data)->stampIngest(buffer);
+
+        return GST_PAD_PROBE_OK;
+    }
+
+    GstPadProbeReturn LatencyProbe::egressProbe([[maybe_unused]] GstPad *pad, GstPadProbeInfo *info,
+                                                gpointer user_data) {
+        GstBuffer *buffer = firstBuffer(info);
+
+        if (buffer != nullptr)
+            static_cast<LatencyProbe *>(user_data)->stampEgress(buffer);
+
+        return GST_PAD_PROBE_OK;
+    }
+
+    void LatencyProbe::stampIngest(GstBuffer *buffer) {
+        GstClockTime pts = GST_BUFFER_PTS(buffer);
+
+        if (!GST_CLOCK_TIME_IS_VALID(pts))
+            return;
+
+        std::lock_guard<std::mutex> lock(mutex);
+
+        // All RTP packets of a frame share its PTS, keep the first one's arrival
+        arrivals.emplace(pts, g_get_monotonic_time());
+
+        while (arrivals.size() > max_pending_frames)
+            arrivals.erase(arrivals.begin());
+    }
+
+    void LatencyProbe::stampEgress(GstBuffer *buffer) {
+        GstClockTime pts = GST_BUFFER_PTS(buffer);
+        gint64 now = g_get_monotonic_time();
+
+        if (!GST_CLOCK_TIME_IS_VALID(pts))
+            return;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        auto arrival = arrivals.find(pts);
+
+        if (arrival != arrivals.end()) {
+            pipeline_samples.push_back(now - arrival->second);
+
+            // Anything older than this frame has either been sent or was dropped
+            arrivals.erase(arrivals.begin(), std::next(arrival));
+
+            // Sender report based capture time, if the camera's clock is NTP synced this is glass-to-egress
+            GstReferenceTimestampMeta *meta = gst_buffer_get_reference_timestamp_meta(buffer, ntp_caps);
+
+            if (meta != nullptr) {
+                gint64 capture_us = (gint64) (meta->timestamp / 1000) - ntp_unix_offset * 1000000LL;
+                capture_samples.push_back(g_get_real_time() - capture_us);
+            }
+        }
+
+        if (now - last_report >= (gint64) report_interval * 1000000)
+            report(now);
+    }
+
+    void LatencyProbe::report(gint64 now) {
+        last_report = now;
+
+        if (pipeline_samples.empty()) {
+            logger->warn("Latency: no frames matched between ingest and egress");
+            return;
+        }
+
+        std::ranges::sort(pipeline_samples);
+
+        gint64 total = 0;
+        for (auto sample: pipeline_samples)
+            total += sample;
+
+        auto count = pipeline_samples.size();
+        double average_ms = (double) total / (double) count / 1000.0;
+        double p95_ms = (double) pipeline_samples[std::min(count - 1, count * 95 / 100)] / 1000.0;
+
+        logger->info("Latency: {} frames, pipeline min {:.1f}ms avg {:.1f}ms p95 {:.1f}ms max {:.1f}ms, "
+                     "with {}ms jitterbuffer ~{:.1f}ms ingest-to-egress",
+                     count, (double) pipeline_samples.front() / 1000.0, average_ms, p95_ms,
+                     (double) pipeline_samples.back() / 1000.0, jitter_buffer_ms, average_ms + jitter_buffer_ms);
+
+        if (!capture_samples.empty()) {
+            std::ranges::sort(capture_samples);
+            logger->info("Latency: capture-to-egress median {:.1f}ms from RTCP sender reports",
+                         (double) capture_samples[capture_samples.size() / 2] / 1000.0);
+        }
+
+        pipeline_samples.clear();
+        capture_samples.clear();
+    }
+}
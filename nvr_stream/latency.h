@@ -0,0 +1,48 @@
+//
+// Ingest-to-egress latency measurement for the streaming pipeline
+//
+
+#ifndef NEVER_CLI_LATENCY_H
+#define NEVER_CLI_LATENCY_H
+
+#include "../common.h"
+#include <gst/gst.h>
+#include <map>
+#include <mutex>
+#include <vector>
+
+namespace nvr {
+
+    class LatencyProbe {
+    public:
+        LatencyProbe(const nvr_logger &logger, int jitter_buffer_ms);
+        LatencyProbe(LatencyProbe const &) = delete;
+        LatencyProbe &operator=(LatencyProbe const &) = delete;
+
+        void attachIngest(GstElement *ingest);
+        void attachEgress(GstElement *egress);
+
+    private:
+        nvr_logger logger;
+        int jitter_buffer_ms;
+        std::mutex mutex;
+
+        // First arrival (monotonic, µs) of each frame's PTS at the depayloader
+        std::map<GstClockTime, gint64> arrivals;
+
+        std::vector<gint64> pipeline_samples;
+        std::vector<gint64> capture_samples;
+        gint64 last_report = 0;
+        GstCaps *ntp_caps{};
+
+        void stampIngest(GstBuffer *buffer);
+        void stampEgress(GstBuffer *buffer);
+        void report(gint64 now);
+
+        static GstBuffer *firstBuffer(GstPadProbeInfo *info);
+        static GstPadProbeReturn ingestProbe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data);
+        static GstPadProbeReturn egressProbe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data);
+    };
+}
+
+#endif //NEVER_CLI_LATENCY_H
@@ -0,0 +1,419 @@
+//
+// Several cameras decoded, composited into one grid and published as a single Janus mountpoint
+//
+
+#include "mosaic.h"
+#include "capabilities.h"
+
+#include <cmath>
+#include <netinet/in.h>
+
+namespace nvr {
+
+    // Output grid size, tiles are scaled to fit
+    const int mosaic_width = 1920;
+    const int mosaic_height = 1080;
+    const int mosaic_framerate = 15;
+
+    // One encode for the whole wall, so it gets more than a single camera's 900
+    const int mosaic_bitrate_kbps = 2500;
+
+    // Seconds before a failed camera is reconnected, the rest of the grid keeps running
+    const int tile_restart_delay = 5;
+
+    Mosaic::Mosaic(const string &mosaic_id, const std::vector<CameraConfig> &cameras) {
+        CameraConfig mosaic_config = cameras.front();
+        mosaic_config.stream_name = mosaic_id;
+        mosaic_config.stream_id = mosaic_id;
+
+        this->logger = nvr::buildLogger(mosaic_config);
+        this->mosaic_id = mosaic_id;
+        this->latency = mosaic_config.latency;
+        this->janus = std::make_shared<Janus>(this->logger);
+        this->scheduler = std::make_shared<EncoderScheduler>(this->logger, mosaic_id);
+
+        for (size_t i = 0; i < cameras.size(); i++) {
+            const CameraConfig &camera = cameras[i];
+            auto tile = std::make_shared<MosaicTile>();
+
+            tile->index = (int) i;
+            tile->name = camera.stream_id;
+            tile->stream_url = buildStreamURL(camera.sub_stream_url, camera.ip_address, camera.port,
+                                              camera.rtsp_password, camera.rtsp_username);
+            tile->rtsp_username = camera.rtsp_username;
+            tile->rtsp_password = camera.rtsp_password;
+            tile->latency = camera.latency;
+            tile->mosaic = this;
+
+            tiles.push_back(tile);
+        }
+
+        columns = (int) std::ceil(std::sqrt((double) tiles.size()));
+        rows = ((int) tiles.size() + columns - 1) / columns;
+    }
+
+    bool Mosaic::valid() {
+        return this->logger != nullptr;
+    }
+
+    void Mosaic::quit() {
+        if (janus->isConnected())
+            janus->disconnect();
+
+        scheduler->release();
+
+        if (!quitting && pipeline != nullptr) {
+            quitting = true;
+            logger->info("Exiting...");
+
+            gst_element_set_state(pipeline, GST_STATE_NULL);
+            gst_object_unref(pipeline);
+        }
+    }
+
+    int Mosaic::start() {
+        gst_init(nullptr, nullptr);
+        Capabilities::load(logger);
+
+        logger->info("Building {}x{} mosaic of {} cameras", columns, rows, tiles.size());
+
+        pipeline = gst_pipeline_new("mosaic");
+        compositor = gst_element_factory_make("compositor", "compositor");
+        g_object_set(G_OBJECT(compositor), "background", 1, nullptr);
+
+        // A camera that drops out should freeze its tile, not the whole grid
+        if (g_object_class_find_property(G_OBJECT_GET_CLASS(compositor), "ignore-inactive-pads"))
+            g_object_set(G_OBJECT(compositor), "ignore-inactive-pads", true, nullptr);
+
+        gst_bin_add(GST_BIN(pipeline), compositor);
+
+        if (!buildOutput()) {
+            gst_object_unref(pipeline);
+            return -1;
+        }
+
+        for (const auto &tile: tiles) {
+            if (!buildTile(tile)) {
+                gst_object_unref(pipeline);
+                return -1;
+            }
+        }
+
+        if (!createJanusStream()) {
+            gst_object_unref(pipeline);
+            return -1;
+        }
+
+        if (gst_element_set_state(pipeline, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE) {
+            logger->error("Unable to set mosaic pipeline's state to PLAYING");
+            gst_object_unref(pipeline);
+            return -1;
+        }
+
+        GstBus *bus = gst_element_get_bus(pipeline);
+
+        loop = g_main_loop_new(nullptr, FALSE);
+        gst_bus_add_signal_watch(bus);
+        g_signal_connect(bus, "message", G_CALLBACK(callbackMessage), this);
+        g_main_loop_run(loop);
+
+        g_main_loop_unref(loop);
+        gst_object_unref(bus);
+
+        quit();
+        return 0;
+    }
+
+    /**
+     * rtspsrc -> decodebin -> videoconvert -> videoscale -> tile caps -> leaky queue -> compositor pad
+     * @param tile
+     * @return
+     */
+    bool Mosaic::buildTile(const std::shared_ptr<MosaicTile> &tile) {
+        int tile_width = (mosaic_width / columns) & ~1;
+        int tile_height = (mosaic_height / rows) & ~1;
+        string prefix = fmt::format("tile{}_", tile->index);
+
+        tile->source = gst_element_factory_make("rtspsrc", (prefix + "src").c_str());
+        g_object_set(G_OBJECT(tile->source), "location", tile->stream_url.c_str(), nullptr);
+        g_object_set(G_OBJECT(tile->source), "udp-reconnect", true, nullptr);
+        g_object_set(G_OBJECT(tile->source), "latency", tile->latency.jitter_buffer_ms, nullptr);
+        g_object_set(G_OBJECT(tile->source), "drop-on-latency", tile->latency.drop_on_latency, nullptr);
+        g_object_set(G_OBJECT(tile->source), "user-id", tile->rtsp_username.c_str(), nullptr);
+        g_object_set(G_OBJECT(tile->source), "user-pw", tile->rtsp_password.c_str(), nullptr);
+
+        // Picks the same hardware decoders the single camera path would, by rank
+        tile->decoder = gst_element_factory_make("decodebin", (prefix + "dec").c_str());
+        tile->convert = gst_element_factory_make("videoconvert", (prefix + "convert").c_str());
+
+        GstElement *scale = gst_element_factory_make("videoscale", (prefix + "scale").c_str());
+        GstElement *caps_filter = gst_element_factory_make("capsfilter", (prefix + "caps").c_str());
+        GstElement *queue = gst_element_factory_make("queue", (prefix + "queue").c_str());
+
+        GstCaps *caps = gst_caps_new_simple("video/x-raw",
+                                            "width", G_TYPE_INT, tile_width,
+                                            "height", G_TYPE_INT, tile_height,
+                                            "pixel-aspect-ratio", GST_TYPE_FRACTION, 1, 1,
+                                            nullptr);
+        g_object_set(G_OBJECT(caps_filter), "caps", caps, nullptr);
+        gst_caps_unref(caps);
+
+        // Never let one slow camera back up the compositor
+        g_object_set(G_OBJECT(queue), "leaky", 2, nullptr);
+        g_object_set(G_OBJECT(queue), "max-size-buffers", 2, nullptr);
+        g_object_set(G_OBJECT(queue), "max-size-bytes", 0, nullptr);
+        g_object_set(G_OBJECT(queue), "max-size-time", 0, nullptr);
+
+        gst_bin_add_many(GST_BIN(pipeline), tile->source, tile->decoder, tile->convert, scale, caps_filter, queue,
+                         nullptr);
+
+        if (!gst_element_link_many(tile->convert, scale, caps_filter, queue, nullptr)) {
+            logger->error("Could not link tile for {}", tile->name);
+            return false;
+        }
+
+        GstPad *compositor_pad = gst_element_request_pad_simple(compositor, "sink_%u");
+        g_object_set(G_OBJECT(compositor_pad), "xpos", (tile->index % columns) * tile_width, nullptr);
+        g_object_set(G_OBJECT(compositor_pad), "ypos", (tile->index / columns) * tile_height, nullptr);
+
+        GstPad *queue_pad = gst_element_get_static_pad(queue, "src");
+        bool linked = GST_PAD_LINK_SUCCESSFUL(gst_pad_link(queue_pad, compositor_pad));
+        gst_object_unref(queue_pad);
+        gst_object_unref(compositor_pad);
+
+        if (!linked) {
+            logger->error("Could not link tile for {} to the compositor", tile->name);
+            return false;
+        }
+
+        g_signal_connect(tile->source, "pad-added", G_CALLBACK(sourcePadAdded), tile.get());
+        g_signal_connect(tile->decoder, "pad-added", G_CALLBACK(decoderPadAdded), tile.get());
+
+        logger->info("Tile {} ({}) at {}x{}", tile->index, tile->name, tile_width, tile_height);
+        return true;
+    }
+
+    /**
+     * compositor -> grid caps -> leaky queue -> VP8 encoder -> payloader -> udpsink
+     * @return
+     */
+    bool Mosaic::buildOutput() {
+        GstElement *caps_filter = gst_element_factory_make("capsfilter", "mosaic_caps");
+        GstElement *queue = gst_element_factory_make("queue", "encode_queue");
+        GstElement *encoder;
+        GstElement *payloader = gst_element_factory_make("rtpvp8pay", "pay");
+
+        GstCaps *caps = gst_caps_new_simple("video/x-raw",
+                                            "width", G_TYPE_INT, mosaic_width,
+                                            "height", G_TYPE_INT, mosaic_height,
+                                            "framerate", GST_TYPE_FRACTION, mosaic_framerate, 1,
+                                            nullptr);
+        g_object_set(G_OBJECT(caps_filter), "caps", caps, nullptr);
+        gst_caps_unref(caps);
+
+        g_object_set(G_OBJECT(queue), "leaky", 2, nullptr);
+        g_object_set(G_OBJECT(queue), "max-size-buffers", 2, nullptr);
+        g_object_set(G_OBJECT(queue), "max-size-bytes", 0, nullptr);
+        g_object_set(G_OBJECT(queue), "max-size-time", 0, nullptr);
+
+        // The mosaic's encode counts against the host's sessions like any camera's
+        std::vector<string> candidates;
+
+        if (Capabilities::get().vaapi)
+            candidates.emplace_back("vaapi");
+
+        if (scheduler->acquire(candidates).backend == "vaapi") {
+            logger->info("Using VAAPI for the mosaic encode");
+            encoder = gst_element_factory_make("vaapivp8enc", "enc");
+            g_object_set(G_OBJECT(encoder), "rate-control", 2, nullptr);
+            g_object_set(G_OBJECT(encoder), "bitrate", mosaic_bitrate_kbps, nullptr);
+        } else {
+            logger->info("Using software for the mosaic encode");
+            encoder = gst_element_factory_make("vp8enc", "enc");
+            g_object_set(G_OBJECT(encoder), "threads", 4, nullptr);
+            g_object_set(G_OBJECT(encoder), "target-bitrate", mosaic_bitrate_kbps * 1000, nullptr);
+            g_object_set(G_OBJECT(encoder), "deadline", (gint64) std::max<int64_t>(latency.encoder_deadline, 1), nullptr);
+
+            if (latency.lag_in_frames >= 0)
+                g_object_set(G_OBJECT(encoder), "lag-in-frames", latency.lag_in_frames, nullptr);
+        }
+
+        if (rtp_port <= 0)
+            rtp_port = pickPort();
+
+        sink = gst_element_factory_make("udpsink", "udp");
+        g_object_set(G_OBJECT(sink), "host", "0.0.0.0", nullptr);
+        g_object_set(G_OBJECT(sink), "port", (gint) rtp_port, nullptr);
+        g_object_set(G_OBJECT(sink), "sync", false, nullptr);
+
+        gst_bin_add_many(GST_BIN(pipeline), caps_filter, queue, encoder, payloader, sink, nullptr);
+
+        if (!gst_element_link_many(compositor, caps_filter, queue, encoder, payloader, sink, nullptr)) {
+            logger->error("Could not link mosaic output");
+            return false;
+        }
+
+        return true;
+    }
+
+    bool Mosaic::createJanusStream() {
+        if (!janus->connect()) {
+            logger->error("Unable to connect to Janus");
+            return false;
+        }
+
+        if (!janus->attachStream(mosaic_id, rtp_port, "vp8")) {
+            logger->error("Unable to create mosaic mountpoint");
+            return false;
+        }
+
+        // An existing mountpoint may be listening on a different port than we picked
+        g_object_set(G_OBJECT(sink), "port", (gint) rtp_port, nullptr);
+        janus->keepAlive();
+
+        logger->info("Mosaic published as mountpoint {} on port {}", janus->getStreamID(), rtp_port);
+        return true;
+    }
+
+    void Mosaic::sourcePadAdded([[maybe_unused]] GstElement *src, GstPad *new_pad, MosaicTile *tile) {
+        GstCaps *caps = gst_pad_get_current_caps(new_pad);
+
+        if (caps == nullptr)
+            caps = gst_pad_query_caps(new_pad, nullptr);
+
+        const gchar *media = gst_structure_get_string(gst_caps_get_structure(caps, 0), "media");
+        bool is_video = media != nullptr && strcmp(media, "video") == 0;
+        gst_caps_unref(caps);
+
+        if (!is_video)
+            return;
+
+        GstPad *sink_pad = gst_element_get_static_pad(tile->decoder, "sink");
+
+        if (!gst_pad_is_linked(sink_pad) && GST_PAD_LINK_FAILED(gst_pad_link(new_pad, sink_pad)))
+            tile->mosaic->logger->error("Could not link {} to its decoder", tile->name);
+
+        gst_object_unref(sink_pad);
+    }
+
+    void Mosaic::decoderPadAdded([[maybe_unused]] GstElement *decoder, GstPad *new_pad, MosaicTile *tile) {
+        GstPad *sink_pad = gst_element_get_static_pad(tile->convert, "sink");
+
+        if (!gst_pad_is_linked(sink_pad) && GST_PAD_LINK_FAILED(gst_pad_link(new_pad, sink_pad)))
+            tile->mosaic->logger->error("Could not link decoded {} to its tile", tile->name);
+        else
+            tile->mosaic->logger->info("Tile {} ({}) is live", tile->index, tile->name);
+
+        gst_object_unref(sink_pad);
+    }
+
+    MosaicTile *Mosaic::findTile(GstObject *element) {
+        for (const auto &tile: tiles) {
+            auto *parent = element;
+
+            // Errors come from elements inside rtspsrc and decodebin as well
+            while (parent != nullptr) {
+                if (parent == GST_OBJECT(tile->source) || parent == GST_OBJECT(tile->decoder))
+                    return tile.get();
+
+                parent = GST_OBJECT_PARENT(parent);
+            }
+        }
+
+        return nullptr;
+    }
+
+    /**
+     * Take the tile's source, decoder and converter down, the error may have come from any of them
+     * @param tile
+     */
+    void Mosaic::restartTile(MosaicTile *tile) {
+        if (tile->restart_pending)
+            return;
+
+        tile->restart_pending = true;
+
+        for (auto element: {tile->source, tile->decoder, tile->convert}) {
+            gst_element_set_locked_state(element, TRUE);
+            gst_element_set_state(element, GST_STATE_NULL);
+        }
+
+        g_timeout_add_seconds(tile_restart_delay, restartTimeout, tile);
+    }
+
+    gboolean Mosaic::restartTimeout(gpointer user_data) {
+        auto *tile = static_cast<MosaicTile *>(user_data);
+
+        tile->mosaic->logger->info("Reconnecting tile {} ({})", tile->index, tile->name);
+        tile->restart_pending = false;
+
+        // Downstream first, so the decoder's new pads link into a running converter
+        for (auto element: {tile->convert, tile->decoder, tile->source}) {
+            gst_element_set_locked_state(element, FALSE);
+            gst_element_sync_state_with_parent(element);
+        }
+
+        return G_SOURCE_REMOVE;
+    }
+
+    void Mosaic::callbackMessage([[maybe_unused]] GstBus *bus, GstMessage *msg, Mosaic *mosaic) {
+        switch (GST_MESSAGE_TYPE(msg)) {
+            case GST_MESSAGE_ERROR: {
+                GError *err;
+                gchar *debug;
+
+                gst_message_parse_error(msg, &err, &debug);
+                MosaicTile *tile = mosaic->findTile(GST_MESSAGE_SRC(msg));
+
+                if (tile != nullptr) {
+                    mosaic->logger->warn("Tile {} ({}) failed: {}", tile->index, tile->name, err->message);
+                    mosaic->restartTile(tile);
+                } else {
+                    mosaic->logger->error("Error received from element {}: {}", GST_OBJECT_NAME(msg->src), err->message);
+                    mosaic->logger->error("Debugging information: {}", debug ? debug : "none");
+                    g_main_loop_quit(mosaic->loop);
+                }
+
+                g_error_free(err);
+                g_free(debug);
+                break;
+            }
+            case GST_MESSAGE_EOS:
+                mosaic->logger->warn("End-Of-Stream reached.");
+                g_main_loop_quit(mosaic->loop);
+                break;
+            case GST_MESSAGE_LATENCY:
+                if (!gst_bin_recalculate_latency(GST_BIN(mosaic->pipeline)))
+                    mosaic->logger->error("Could not reconfigure latency");
+
+                break;
+            default:
+                break;
+        }
+    }
+
+    /**
+     * Let the kernel hand out a free UDP port for the mountpoint
+     * @return
+     */
+    int64_t Mosaic::pickPort() {
+        int sock = socket(AF_INET, SOCK_DGRAM, 0);
+        struct sockaddr_in address{};
+        socklen_t length = sizeof(address);
+
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = 0;
+
+        if (sock == -1 || bind(sock, (struct sockaddr *) &address, sizeof(address)) == -1 ||
+            getsockname(sock, (struct sockaddr *) &address, &length) == -1) {
+            if (sock != -1)
+                close(sock);
+
+            return 0;
+        }
+
+        close(sock);
+        return ntohs(address.sin_port);
+    }
+}
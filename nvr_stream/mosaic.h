@@ -0,0 +1,72 @@
+//
+// Several cameras decoded, composited into one grid and published as a single Janus mountpoint
+//
+
+#ifndef NEVER_CLI_MOSAIC_H
+#define NEVER_CLI_MOSAIC_H
+
+#include "../common.h"
+#include "janus.h"
+#include "scheduler.h"
+#include <gst/gst.h>
+#include <vector>
+
+namespace nvr {
+
+    class Mosaic;
+
+    struct MosaicTile {
+        int index;
+        string name;
+        string stream_url;
+        string rtsp_username;
+        string rtsp_password;
+        LatencyProfile latency;
+        GstElement *source;
+        GstElement *decoder;
+        GstElement *convert;
+        Mosaic *mosaic;
+        bool restart_pending;
+    };
+
+    class Mosaic {
+    public:
+        Mosaic(const string &mosaic_id, const std::vector<CameraConfig> &cameras);
+        Mosaic(Mosaic const &) = delete;
+        Mosaic &operator=(Mosaic const &) = delete;
+
+        int start();
+        void quit();
+        bool valid();
+
+    private:
+        nvr_logger logger;
+        string mosaic_id;
+        std::vector<std::shared_ptr<MosaicTile>> tiles;
+        std::shared_ptr<Janus> janus;
+        std::shared_ptr<EncoderScheduler> scheduler;
+        LatencyProfile latency;
+        GstElement *pipeline{};
+        GstElement *compositor{};
+        GstElement *sink{};
+        GMainLoop *loop{};
+        int64_t rtp_port = 0;
+        int columns = 1;
+        int rows = 1;
+        bool quitting = false;
+
+        bool buildTile(const std::shared_ptr<MosaicTile> &tile);
+        bool buildOutput();
+        bool createJanusStream();
+        void restartTile(MosaicTile *tile);
+        MosaicTile *findTile(GstObject *element);
+
+        static int64_t pickPort();
+        static void sourcePadAdded(GstElement *src, GstPad *new_pad, MosaicTile *tile);
+        static void decoderPadAdded(GstElement *decoder, GstPad *new_pad, MosaicTile *tile);
+        static gboolean restartTimeout(gpointer user_data);
+        static void callbackMessage([[maybe_unused]] GstBus *bus, GstMessage *msg, Mosaic *mosaic);
+    };
+}
+
+#endif //NEVER_CLI_MOSAIC_H
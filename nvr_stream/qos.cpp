@@ -0,0 +1,155 @@
+//
+// Leaky decode->encode handoff and late-frame dropping in front of the encoder
+//
+
+#include "qos.h"
+
+namespace nvr {
+
+    // Seconds between drop counter reports
+    const int drop_report_interval = 60;
+
+    // The on-time baseline is re-learned this often so clock drift can't accumulate
+    const gint64 baseline_window_us = 30 * 1000000LL;
+
+    // Jumps beyond this are timestamp discontinuities (reconnects, codec switches), not lateness
+    const gint64 discontinuity_us = 5 * 1000000LL;
+
+    // A jump has to last this long to be taken as a discontinuity, lag is worked off sooner
+    const gint64 discontinuity_hold_us = 2 * 1000000LL;
+
+    // The baseline is only re-learned from a frame at most this far behind it
+    const gint64 on_time_us = 100 * 1000LL;
+
+    FrameDropper::FrameDropper(const nvr_logger &logger, int max_lateness_ms) {
+        this->logger = logger;
+        this->max_lateness_us = (gint64) max_lateness_ms * 1000;
+    }
+
+    /**
+     * Count what the leaky queue discards and drop frames that are already too
+     * late by the time the encoder would get to them
+     * @param queue Leaky queue between decoder and encoder
+     * @param encoder
+     */
+    void FrameDropper::attach(GstElement *queue, GstElement *encoder) {
+        this->queue = queue;
+
+        GstPad *queue_sink = gst_element_get_static_pad(queue, "sink");
+        gst_pad_add_probe(queue_sink, GST_PAD_PROBE_TYPE_BUFFER, queueInProbe, this, nullptr);
+        gst_object_unref(queue_sink);
+
+        GstPad *queue_src = gst_element_get_static_pad(queue, "src");
+        gst_pad_add_probe(queue_src, GST_PAD_PROBE_TYPE_BUFFER, queueOutProbe, this, nullptr);
+        gst_object_unref(queue_src);
+
+        GstPad *encoder_sink = gst_element_get_static_pad(encoder, "sink");
+        gst_pad_add_probe(encoder_sink, GST_PAD_PROBE_TYPE_BUFFER, encoderProbe, this, nullptr);
+        gst_object_unref(encoder_sink);
+
+        if (max_lateness_us > 0)
+            logger->info("Dropping frames more than {}ms behind before encoding", max_lateness_us / 1000);
+        else
+            logger->info("Not dropping late frames before encoding");
+    }
+
+    uint64_t FrameDropper::getQueueDrops() const {
+        guint level = 0;
+
+        if (queue != nullptr)
+            g_object_get(G_OBJECT(queue), "current-level-buffers", &level, nullptr);
+
+        uint64_t in = queued;
+        uint64_t out = dequeued;
+
+        return in > out + level ? in - out - level : 0;
+    }
+
+    uint64_t FrameDropper::getLateDrops() const {
+        return late_drops;
+    }
+
+    GstPadProbeReturn FrameDropper::queueInProbe([[maybe_unused]] GstPad *pad, [[maybe_unused]] GstPadProbeInfo *info,
+                                                 gpointer user_data) {
+        static_cast<FrameDropper *>(user_data)->queued += 1;
+        return GST_PAD_PROBE_OK;
+    }
+
+    GstPadProbeReturn FrameDropper::queueOutProbe([[maybe_unused]] GstPad *pad, [[maybe_unused]] GstPadProbeInfo *info,
+                                                  gpointer user_data) {
+        static_cast<FrameDropper *>(user_data)->dequeued += 1;
+        return GST_PAD_PROBE_OK;
+    }
+
+    GstPadProbeReturn FrameDropper::encoderProbe([[maybe_unused]] GstPad *pad, GstPadProbeInfo *info,
+                                                 gpointer user_data) {
+        auto *dropper = static_cast<FrameDropper *>(user_data);
+
+        if (dropper->isLate(GST_PAD_PROBE_INFO_BUFFER(info))) {
+            dropper->late_drops += 1;
+            return GST_PAD_PROBE_DROP;
+        }
+
+        dropper->encoded += 1;
+        return GST_PAD_PROBE_OK;
+    }
+
+    /**
+     * udpsink runs with sync=false, so no QoS events ever come upstream. Instead
+     * compare each frame's (arrival - PTS) against the best recently seen: the
+     * difference is how far behind live the frame is.
+     * @param buffer
+     * @return
+     */
+    bool FrameDropper::isLate(GstBuffer *buffer) {
+        GstClockTime pts = GST_BUFFER_PTS(buffer);
+        gint64 now = g_get_monotonic_time();
+
+        if (now - last_report >= (gint64) drop_report_interval * 1000000)
+            report(now);
+
+        if (!GST_CLOCK_TIME_IS_VALID(pts))
+            return false;
+
+        gint64 offset = now - (gint64) GST_TIME_AS_USECONDS(pts);
+
+        if (offset < baseline_offset) {
+            baseline_offset = offset;
+            discontinuity_started = 0;
+        } else if (offset - baseline_offset > discontinuity_us) {
+            if (discontinuity_started == 0) {
+                discontinuity_started = now;
+            } else if (now - discontinuity_started >= discontinuity_hold_us) {
+                baseline_offset = offset;
+                baseline_started = now;
+                discontinuity_started = 0;
+            }
+        } else {
+            discontinuity_started = 0;
+
+            // Re-learning from a frame that is already behind would hide the lag it should measure
+            if (now - baseline_started >= baseline_window_us && offset - baseline_offset <= on_time_us) {
+                baseline_offset = offset;
+                baseline_started = now;
+            }
+        }
+
+        return max_lateness_us > 0 && offset - baseline_offset > max_lateness_us;
+    }
+
+    void FrameDropper::report(gint64 now) {
+        last_report = now;
+
+        uint64_t queue_drops = getQueueDrops();
+        uint64_t late = late_drops;
+        uint64_t frames = encoded;
+
+        if (queue_drops > reported_queue_drops || late > reported_late_drops)
+            logger->warn("Dropped {} frames in the decode->encode queue and {} late frames, encoded {}",
+                         queue_drops - reported_queue_drops, late - reported_late_drops, frames - reported_encoded);
+
+        reported_queue_drops = queue_drops;
+        reported_late_drops = late;
+        reported_encoded = frames;
+    }
+}
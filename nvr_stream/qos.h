@@ -0,0 +1,53 @@
+//
+// Leaky decode->encode handoff and late-frame dropping in front of the encoder
+//
+
+#ifndef NEVER_CLI_QOS_H
+#define NEVER_CLI_QOS_H
+
+#include "../common.h"
+#include <gst/gst.h>
+#include <atomic>
+
+namespace nvr {
+
+    class FrameDropper {
+    public:
+        FrameDropper(const nvr_logger &logger, int max_lateness_ms);
+        FrameDropper(FrameDropper const &) = delete;
+        FrameDropper &operator=(FrameDropper const &) = delete;
+
+        void attach(GstElement *queue, GstElement *encoder);
+
+        [[nodiscard]] uint64_t getQueueDrops() const;
+        [[nodiscard]] uint64_t getLateDrops() const;
+
+    private:
+        nvr_logger logger;
+        GstElement *queue{};
+        gint64 max_lateness_us;
+
+        std::atomic<uint64_t> queued = 0;
+        std::atomic<uint64_t> dequeued = 0;
+        std::atomic<uint64_t> late_drops = 0;
+        std::atomic<uint64_t> encoded = 0;
+
+        // Smallest (arrival - PTS) seen recently, what an on-time frame looks like
+        gint64 baseline_offset = G_MAXINT64;
+        gint64 baseline_started = 0;
+        gint64 discontinuity_started = 0;
+        gint64 last_report = 0;
+        uint64_t reported_queue_drops = 0;
+        uint64_t reported_late_drops = 0;
+        uint64_t reported_encoded = 0;
+
+        bool isLate(GstBuffer *buffer);
+        void report(gint64 now);
+
+        static GstPadProbeReturn queueInProbe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data);
+        static GstPadProbeReturn queueOutProbe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data);
+        static GstPadProbeReturn encoderProbe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data);
+    };
+}
+
+#endif //NEVER_CLI_QOS_H
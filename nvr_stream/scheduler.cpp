@@ -0,0 +1,219 @@
+//
+// Per-host hardware session scheduling, shared between streamers through a locked state file
+//
+
+#include "scheduler.h"
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <utility>
+
+using json = nlohmann::json;
+
+namespace nvr {
+
+    const char *software_backend = "software";
+
+    // Devices and session limits per backend, e.g. {"u30": {"devices": 2, "sessions": 8}}
+    const char *default_budget_path = "/nvr/encoders.json";
+
+    // Sessions held by every nvr_stream on the host, also used as the lock file
+    const char *slot_state_path = "/tmp/nvr_encoder_slots.json";
+
+    SlotPlacement placeStream(const std::vector<string> &candidates, const std::map<string, SlotBudget> &budget,
+                              const std::vector<SlotAllocation> &allocations) {
+        for (const auto &backend: candidates) {
+            SlotBudget limits;
+            auto configured = budget.find(backend);
+
+            if (configured != budget.end())
+                limits = configured->second;
+
+            if (limits.devices <= 0)
+                continue;
+
+            std::vector<int> load(limits.devices, 0);
+
+            for (const auto &allocation: allocations) {
+                if (allocation.backend == backend && allocation.device >= 0 && allocation.device < limits.devices)
+                    load[allocation.device] += 1;
+            }
+
+            int device = 0;
+            for (int i = 1; i < limits.devices; i++) {
+                if (load[i] < load[device])
+                    device = i;
+            }
+
+            if (limits.sessions == 0 || load[device] < limits.sessions)
+                return {backend, device};
+        }
+
+        return {software_backend, -1};
+    }
+
+    EncoderScheduler::EncoderScheduler(const nvr_logger &logger, string stream_id) {
+        this->logger = logger;
+        this->stream_id = std::move(stream_id);
+    }
+
+    /**
+     * Reserve a session for this stream. Call once per streamer, a codec switch
+     * keeps the encoder and so the placement it was built for.
+     * @param candidates Hardware backends this stream may use, best first
+     * @return
+     */
+    SlotPlacement EncoderScheduler::acquire(const std::vector<string> &candidates) {
+        pid_t pid = getpid();
+        int fd = lockState();
+
+        if (fd == -1) {
+            logger->warn("Could not open encoder slot state {}, scheduling without it", slot_state_path);
+            return placeStream(candidates, readBudget(), {});
+        }
+
+        std::vector<SlotAllocation> allocations = readAllocations(fd);
+
+        for (const auto &allocation: allocations) {
+            if (allocation.pid == pid && allocation.stream_id == stream_id) {
+                flock(fd, LOCK_UN);
+                close(fd);
+                return {allocation.backend, allocation.device};
+            }
+        }
+
+        SlotPlacement placement = placeStream(candidates, readBudget(), allocations);
+
+        if (placement.backend != software_backend) {
+            allocations.push_back({pid, stream_id, placement.backend, placement.device});
+            writeAllocations(fd, allocations);
+            logger->info("Placed stream on {} device {} ({} sessions on host)", placement.backend, placement.device,
+                         allocations.size());
+        } else if (!candidates.empty()) {
+            logger->warn("Hardware session budget exhausted, using software");
+        }
+
+        flock(fd, LOCK_UN);
+        close(fd);
+
+        return placement;
+    }
+
+    void EncoderScheduler::release() {
+        pid_t pid = getpid();
+        int fd = lockState();
+
+        if (fd == -1)
+            return;
+
+        std::vector<SlotAllocation> allocations = readAllocations(fd);
+        std::erase_if(allocations, [&](const SlotAllocation &allocation) {
+            return allocation.pid == pid && allocation.stream_id == stream_id;
+        });
+        writeAllocations(fd, allocations);
+
+        flock(fd, LOCK_UN);
+        close(fd);
+    }
+
+    /**
+     * The budget is read on every placement so it can be changed without restarting streams
+     * @return
+     */
+    std::map<string, SlotBudget> EncoderScheduler::readBudget() {
+        std::map<string, SlotBudget> budget;
+        const char *path = getenv("NVR_ENCODER_BUDGET");
+
+        if (path == nullptr)
+            path = default_budget_path;
+
+        if (!std::filesystem::exists(path))
+            return budget;
+
+        std::ifstream budget_file(path);
+        json config = json::parse(budget_file, nullptr, false);
+
+        if (config.is_discarded() || !config.is_object()) {
+            logger->warn("Could not parse encoder budget {}, treating hardware as unlimited", path);
+            return budget;
+        }
+
+        for (auto &[backend, limits]: config.items()) {
+            SlotBudget entry;
+
+            if (limits.contains("devices"))
+                entry.devices = limits["devices"];
+
+            if (limits.contains("sessions"))
+                entry.sessions = limits["sessions"];
+
+            budget[backend] = entry;
+        }
+
+        return budget;
+    }
+
+    /**
+     * Read the host's allocations, dropping any held by processes that no longer exist
+     * @param fd Locked state file
+     * @return
+     */
+    std::vector<SlotAllocation> EncoderScheduler::readAllocations(int fd) {
+        std::vector<SlotAllocation> allocations;
+        string contents;
+        char buffer[4096];
+        ssize_t length;
+
+        lseek(fd, 0, SEEK_SET);
+        while ((length = read(fd, buffer, sizeof(buffer))) > 0)
+            contents.append(buffer, length);
+
+        json state = json::parse(contents, nullptr, false);
+
+        if (state.is_discarded() || !state.is_array())
+            return allocations;
+
+        for (auto &entry: state) {
+            SlotAllocation allocation{
+                    entry.value("pid", 0),
+                    entry.value("stream", ""),
+                    entry.value("backend", ""),
+                    entry.value("device", -1)
+            };
+
+            if (allocation.pid <= 0 || (kill(allocation.pid, 0) == -1 && errno == ESRCH))
+                continue;
+
+            allocations.push_back(allocation);
+        }
+
+        return allocations;
+    }
+
+    void EncoderScheduler::writeAllocations(int fd, const std::vector<SlotAllocation> &allocations) {
+        json state = json::array();
+
+        for (const auto &allocation: allocations) {
+            state.push_back({
+                                    {"pid",     allocation.pid},
+                                    {"stream",  allocation.stream_id},
+                                    {"backend", allocation.backend},
+                                    {"device",  allocation.device}
+                            });
+        }
+
+        string contents = state.dump();
+
+        if (ftruncate(fd, 0) == -1 || pwrite(fd, contents.data(), contents.size(), 0) != (ssize_t) contents.size())
+            spdlog::warn("Could not write encoder slot state {}", slot_state_path);
+    }
+
+    int EncoderScheduler::lockState() {
+        int fd = open(slot_state_path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+
+        if (fd != -1)
+            flock(fd, LOCK_EX);
+
+        return fd;
+    }
+}
@@ -0,0 +1,66 @@
+//
+// Per-host hardware session scheduling, shared between streamers through a locked state file
+//
+
+#ifndef NEVER_CLI_SCHEDULER_H
+#define NEVER_CLI_SCHEDULER_H
+
+#include "../common.h"
+#include <map>
+#include <vector>
+
+namespace nvr {
+
+    // Backend name used when every hardware candidate is full
+    extern const char *software_backend;
+
+    struct SlotBudget {
+        int devices = 1;
+        int sessions = 0; // per device, 0 is unlimited
+    };
+
+    struct SlotAllocation {
+        pid_t pid;
+        string stream_id;
+        string backend;
+        int device;
+    };
+
+    struct SlotPlacement {
+        string backend;
+        int device;
+    };
+
+    /**
+     * Pick a backend and device for a new stream. Candidates are tried in
+     * priority order, and within a backend the least loaded device wins.
+     * Pure function of its arguments, no files or processes involved.
+     * @param candidates Hardware backends this stream may use, best first
+     * @param budget Devices and sessions per backend, missing backends get the SlotBudget defaults
+     * @param allocations Sessions already held on this host
+     * @return software_backend with device -1 when nothing has room
+     */
+    SlotPlacement placeStream(const std::vector<string> &candidates, const std::map<string, SlotBudget> &budget,
+                              const std::vector<SlotAllocation> &allocations);
+
+    class EncoderScheduler {
+    public:
+        EncoderScheduler(const nvr_logger &logger, string stream_id);
+        EncoderScheduler(EncoderScheduler const &) = delete;
+        EncoderScheduler &operator=(EncoderScheduler const &) = delete;
+
+        SlotPlacement acquire(const std::vector<string> &candidates);
+        void release();
+
+    private:
+        nvr_logger logger;
+        string stream_id;
+
+        std::map<string, SlotBudget> readBudget();
+        static std::vector<SlotAllocation> readAllocations(int fd);
+        static void writeAllocations(int fd, const std::vector<SlotAllocation> &allocations);
+        int lockState();
+    };
+}
+
+#endif //NEVER_CLI_SCHEDULER_H
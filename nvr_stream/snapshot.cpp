@@ -0,0 +1,313 @@
+//
+// JPEG snapshots of the latest decoded frame, served over a local socket
+//
+
+#include "snapshot.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+namespace nvr {
+
+    // How long a request waits for the JPEG encoder
+    const GstClockTime snapshot_timeout = 2 * GST_SECOND;
+
+    /**
+     * @param logger
+     * @param stream_id Socket is /tmp/nvr-snapshot-<stream_id>.sock
+     * @param quality JPEG quality, 1-100
+     */
+    SnapshotServer::SnapshotServer(const nvr_logger &logger, const string &stream_id, int quality) {
+        this->logger = logger;
+        this->socket_path = "/tmp/nvr-snapshot-" + stream_id + ".sock";
+        this->quality = quality;
+    }
+
+    SnapshotServer::~SnapshotServer() {
+        stop();
+
+        if (latest != nullptr)
+            gst_sample_unref(latest);
+    }
+
+    /**
+     * Sink for a decoded branch, keeps only the newest frame
+     * @return
+     */
+    GstElement *SnapshotServer::create() {
+        GstElement *sink = gst_element_factory_make("appsink", "snapshot");
+
+        g_object_set(G_OBJECT(sink), "sync", false, nullptr);
+        g_object_set(G_OBJECT(sink), "async", false, nullptr);
+        g_object_set(G_OBJECT(sink), "max-buffers", 1, nullptr);
+        g_object_set(G_OBJECT(sink), "drop", true, nullptr);
+
+        GstAppSinkCallbacks callbacks = {nullptr, nullptr, newSample};
+        gst_app_sink_set_callbacks(GST_APP_SINK(sink), &callbacks, this, nullptr);
+
+        return sink;
+    }
+
+    const string &SnapshotServer::getSocketPath() const {
+        return socket_path;
+    }
+
+    GstFlowReturn SnapshotServer::newSample(GstAppSink *sink, gpointer user_data) {
+        auto *server = static_cast<SnapshotServer *>(user_data);
+        GstSample *sample = gst_app_sink_pull_sample(sink);
+
+        if (sample == nullptr)
+            return GST_FLOW_OK;
+
+        GstSample *previous;
+
+        {
+            std::lock_guard<std::mutex> lock(server->latest_mutex);
+            previous = server->latest;
+            server->latest = sample;
+            server->latest_number++;
+        }
+
+        // Holding on to one decoded frame is all the branch costs until someone asks
+        if (previous != nullptr)
+            gst_sample_unref(previous);
+
+        return GST_FLOW_OK;
+    }
+
+    bool SnapshotServer::start() {
+        if (running)
+            return true;
+
+        if (!buildEncoder())
+            return false;
+
+        if ((server_sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
+            logger->error("Could not create snapshot socket");
+            return false;
+        }
+
+        struct sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+
+        unlink(socket_path.c_str());
+
+        if (bind(server_sock, (struct sockaddr *) &address, sizeof(address)) < 0 || listen(server_sock, 8) < 0) {
+            logger->error("Could not listen for snapshot requests on {}", socket_path);
+            close(server_sock);
+            server_sock = -1;
+            return false;
+        }
+
+        running = true;
+        server_thread = std::thread(&SnapshotServer::serve, this);
+
+        logger->info("Serving snapshots on {}", socket_path);
+        return true;
+    }
+
+    void SnapshotServer::stop() {
+        if (running) {
+            running = false;
+            shutdown(server_sock, SHUT_RDWR);
+            close(server_sock);
+            server_sock = -1;
+
+            if (server_thread.joinable())
+                server_thread.join();
+
+            unlink(socket_path.c_str());
+        }
+
+        if (encode_pipeline != nullptr) {
+            gst_element_set_state(encode_pipeline, GST_STATE_NULL);
+            gst_object_unref(encode_pipeline);
+            encode_pipeline = nullptr;
+        }
+    }
+
+    /**
+     * appsrc -> jpegenc -> appsink, built once and left running between requests
+     * @return
+     */
+    bool SnapshotServer::buildEncoder() {
+        encode_pipeline = gst_pipeline_new("snapshot_encoder");
+        encode_src = gst_element_factory_make("appsrc", "snapshot_src");
+        GstElement *encoder = gst_element_factory_make("jpegenc", "snapshot_enc");
+        encode_sink = gst_element_factory_make("appsink", "snapshot_jpeg");
+
+        g_object_set(G_OBJECT(encode_src), "format", GST_FORMAT_TIME, nullptr);
+        g_object_set(G_OBJECT(encoder), "quality", quality, nullptr);
+        g_object_set(G_OBJECT(encode_sink), "sync", false, nullptr);
+        g_object_set(G_OBJECT(encode_sink), "max-buffers", 1, nullptr);
+
+        gst_bin_add_many(GST_BIN(encode_pipeline), encode_src, encoder, encode_sink, nullptr);
+
+        if (!gst_element_link_many(encode_src, encoder, encode_sink, nullptr)) {
+            logger->error("Could not link snapshot encoder");
+            return false;
+        }
+
+        if (gst_element_set_state(encode_pipeline, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE) {
+            logger->error("Could not start snapshot encoder");
+            return false;
+        }
+
+        return true;
+    }
+
+    /**
+     * Encode the latest decoded frame
+     * @param jpeg Set to the JPEG, reused between calls
+     * @return false if there is no frame yet or encoding failed
+     */
+    bool SnapshotServer::snapshot(std::vector<uint8_t> &jpeg) {
+        GstSample *sample;
+        uint64_t number;
+
+        {
+            std::lock_guard<std::mutex> lock(latest_mutex);
+
+            if (latest == nullptr)
+                return false;
+
+            sample = gst_sample_ref(latest);
+            number = latest_number;
+        }
+
+        std::lock_guard<std::mutex> lock(encode_mutex);
+
+        // Several viewers asking at once share one encode
+        if (number == encoded_number && !encoded.empty()) {
+            gst_sample_unref(sample);
+            jpeg = encoded;
+            return true;
+        }
+
+        // A JPEG that came out after an earlier request gave up must not pass for this frame
+        while (GstSample *stale = gst_app_sink_try_pull_sample(GST_APP_SINK(encode_sink), 0))
+            gst_sample_unref(stale);
+
+        GstBuffer *frame = gst_sample_get_buffer(sample);
+        GstClockTime pts = frame != nullptr ? GST_BUFFER_PTS(frame) : GST_CLOCK_TIME_NONE;
+
+        GstFlowReturn pushed = gst_app_src_push_sample(GST_APP_SRC(encode_src), sample);
+        gst_sample_unref(sample);
+
+        if (pushed != GST_FLOW_OK) {
+            logger->warn("Snapshot encoder refused frame");
+            return false;
+        }
+
+        // jpegenc keeps the PTS, anything else still in flight is skipped
+        gint64 deadline = g_get_monotonic_time() + (gint64) (snapshot_timeout / GST_USECOND);
+        GstSample *result = nullptr;
+
+        while (true) {
+            gint64 remaining = deadline - g_get_monotonic_time();
+
+            if (remaining <= 0)
+                break;
+
+            result = gst_app_sink_try_pull_sample(GST_APP_SINK(encode_sink), remaining * GST_USECOND);
+
+            if (result == nullptr || !GST_CLOCK_TIME_IS_VALID(pts))
+                break;
+
+            GstBuffer *output = gst_sample_get_buffer(result);
+
+            if (output != nullptr && GST_BUFFER_PTS(output) == pts)
+                break;
+
+            gst_sample_unref(result);
+            result = nullptr;
+        }
+
+        if (result == nullptr) {
+            logger->warn("Snapshot encoder timed out");
+            encoded_number = 0;
+            encoded.clear();
+            return false;
+        }
+
+        GstBuffer *buffer = gst_sample_get_buffer(result);
+        GstMapInfo map_info = GST_MAP_INFO_INIT;
+
+        if (buffer == nullptr || !gst_buffer_map(buffer, &map_info, GST_MAP_READ)) {
+            gst_sample_unref(result);
+            return false;
+        }
+
+        encoded.assign(map_info.data, map_info.data + map_info.size);
+        encoded_number = number;
+
+        gst_buffer_unmap(buffer, &map_info);
+        gst_sample_unref(result);
+
+        jpeg = encoded;
+        return true;
+    }
+
+    void SnapshotServer::serve() {
+        while (running) {
+            int client_sock = accept(server_sock, nullptr, nullptr);
+
+            if (client_sock < 0) {
+                if (running && errno != EINTR)
+                    logger->warn("Snapshot accept failed: {}", strerror(errno));
+
+                if (!running)
+                    break;
+
+                continue;
+            }
+
+            handleConnection(client_sock);
+            close(client_sock);
+        }
+    }
+
+    /**
+     * Answers any request with the current frame as an HTTP response, so
+     * curl --unix-socket works as well as a bare connect-and-read
+     * @param client_sock
+     */
+    void SnapshotServer::handleConnection(int client_sock) {
+        char buffer[2048];
+        string request;
+
+        // Wait briefly for a request, clients that only read get the image anyway
+        struct timeval timeout{0, 200000};
+        setsockopt(client_sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        while (request.size() < sizeof(buffer) * 4 && request.find("\r\n\r\n") == string::npos) {
+            ssize_t bytes = recv(client_sock, buffer, sizeof(buffer), 0);
+
+            if (bytes <= 0)
+                break;
+
+            request.append(buffer, bytes);
+        }
+
+        std::vector<uint8_t> jpeg;
+        string header;
+
+        if (snapshot(jpeg)) {
+            header = "HTTP/1.1 200 OK\r\n"
+                     "Content-Type: image/jpeg\r\n"
+                     "Cache-Control: no-store\r\n"
+                     "Connection: close\r\n"
+                     "Content-Length: " + std::to_string(jpeg.size()) + "\r\n\r\n";
+        } else {
+            header = "HTTP/1.1 503 Service Unavailable\r\n"
+                     "Connection: close\r\n"
+                     "Content-Length: 0\r\n\r\n";
+        }
+
+        send(client_sock, header.data(), header.size(), MSG_NOSIGNAL);
+
+        if (!jpeg.empty())
+            send(client_sock, jpeg.data(), jpeg.size(), MSG_NOSIGNAL);
+    }
+}
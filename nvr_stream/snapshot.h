@@ -0,0 +1,61 @@
+//
+// JPEG snapshots of the latest decoded frame, served over a local socket
+//
+
+#ifndef NEVER_CLI_SNAPSHOT_H
+#define NEVER_CLI_SNAPSHOT_H
+
+#include "../common.h"
+#include <gst/gst.h>
+#include <gst/app/gstappsink.h>
+#include <gst/app/gstappsrc.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace nvr {
+
+    class SnapshotServer {
+    public:
+        SnapshotServer(const nvr_logger &logger, const string &stream_id, int quality);
+        ~SnapshotServer();
+        SnapshotServer(SnapshotServer const &) = delete;
+        SnapshotServer &operator=(SnapshotServer const &) = delete;
+
+        GstElement *create();
+        bool start();
+        void stop();
+
+        bool snapshot(std::vector<uint8_t> &jpeg);
+        [[nodiscard]] const string &getSocketPath() const;
+
+    private:
+        nvr_logger logger;
+        string socket_path;
+        int quality;
+        int server_sock{-1};
+        std::atomic<bool> running = false;
+        std::thread server_thread;
+
+        std::mutex latest_mutex;
+        GstSample *latest{};
+        uint64_t latest_number = 0;
+
+        // One encoder for every request, the last result is reused until a newer frame arrives
+        std::mutex encode_mutex;
+        GstElement *encode_pipeline{};
+        GstElement *encode_src{};
+        GstElement *encode_sink{};
+        uint64_t encoded_number = 0;
+        std::vector<uint8_t> encoded;
+
+        bool buildEncoder();
+        void serve();
+        void handleConnection(int client_sock);
+
+        static GstFlowReturn newSample(GstAppSink *sink, gpointer user_data);
+    };
+}
+
+#endif //NEVER_CLI_SNAPSHOT_H
@@ -3,10 +3,12 @@
 //
 
 #include "streamer.h"
+#include "mosaic.h"
 #include "janus.h"
 #include <thread>
 
 nvr::Streamer streamer;
+std::shared_ptr<nvr::Mosaic> mosaic;
 
 
 void quit(int sig)
@@ -14,14 +16,32 @@ void quit(int sig)
     if (streamer.valid())
         streamer.quit();
 
+    if (mosaic != nullptr && mosaic->valid())
+        mosaic->quit();
+
     exit(sig);
 }
 
 int main(int argc, char *argv[]) {
+    if (argc > 3 && strcmp(argv[1], "--mosaic") == 0) {
+        std::vector<nvr::CameraConfig> cameras;
+
+        for (int i = 3; i < argc; i++)
+            cameras.push_back(nvr::getConfig(argv[i]));
+
+        mosaic = std::make_shared<nvr::Mosaic>(argv[2], cameras);
+
+        signal(SIGINT, quit);
+        signal(SIGTERM, quit);
+        return mosaic->start();
+    }
+
     if (argc < 2 || argc > 2) {
         spdlog::error("usage: {} camera-config.json\n"
+                      "       {} --mosaic mosaic-id camera-1.json camera-2.json ...\n"
                       "i.e. {} ./cameras/camera-1.json\n"
-                      "Stream an RTSP camera to an RTP port.\n", argv[0], argv[0]);
+                      "Stream an RTSP camera to an RTP port, or composite several into one grid.\n",
+                      argv[0], argv[0], argv[0]);
         return 1;
     }
 
@@ -24,19 +24,38 @@ namespace nvr {
         this->ip_address = config.ip_address;
         this->rtsp_password = config.rtsp_password;
         this->rtsp_username = config.rtsp_username;
-        this->rtp_port = nvr::Streamer::findOpenPort();
+        this->rtp_port = config.rtp_port > 0 ? config.rtp_port : nvr::Streamer::findOpenPort();
         this->port = config.port;
 
         this->appData.rtp_port = this->rtp_port;
         this->appData.bitrate = 900; // The recorded video is ~about~ this
         this->appData.hardware_enc_priority = config.hardware_enc_priority;
+        this->appData.egress_sink = config.egress_sink;
         this->appData.stream_name = this->camera_id;
         this->bus = nullptr;
         this->appData.stream_id = config.stream_id;
         this->appData.logger = this->logger;
-        this->appData.janus = Janus(this->logger);
+        this->appData.janus = std::make_shared<Janus>(this->logger);
         this->appData.error_count = 0;
         this->appData.needs_codec_switch = false;
+        this->appData.janus_enabled = config.janus_enabled;
+        this->appData.whep_port = config.whep_port;
+        this->appData.latency = config.latency;
+        this->appData.keyframe_on_demand = config.keyframe_on_demand;
+        this->appData.janus->setRTCPFeedback(config.keyframe_on_demand);
+        this->appData.scheduler = std::make_shared<EncoderScheduler>(this->logger, config.stream_id);
+        this->appData.hardware_type = none;
+        this->appData.device_index = 0;
+        this->appData.codecs = config.codecs;
+        this->appData.codec_preset = config.codec_preset;
+        this->appData.frame_tap = config.frame_tap;
+        this->appData.snapshot_server = config.snapshot_server;
+        this->appData.snapshot_quality = config.snapshot_quality;
+        this->appData.analysis = config.analysis;
+
+        if (config.trace_interval > 0)
+            this->appData.tracer = std::make_shared<PipelineTracer>(this->logger, config.stream_id,
+                                                                    config.trace_interval);
 
         // Use sub stream for streaming
         this->stream_url = config.sub_stream_url;
@@ -47,10 +66,21 @@ namespace nvr {
     }
 
     void Streamer::quit() {
-        if (appData.janus.isConnected() && appData.janus.isStreaming()) {
-            appData.janus.disconnect();
+        if (appData.janus->isConnected() && appData.janus->isStreaming()) {
+            appData.janus->disconnect();
         }
 
+        if (appData.whep != nullptr)
+            appData.whep->stop();
+
+        if (appData.keyframes != nullptr)
+            appData.keyframes->stop();
+
+        if (appData.snapshots != nullptr)
+            appData.snapshots->stop();
+
+        appData.scheduler->release();
+
         if (!quitting) {
             quitting = true;
             logger->info("Exiting...");
@@ -73,6 +103,7 @@ namespace nvr {
         GstStateChangeReturn ret;
 
         gst_init(nullptr, nullptr);
+        Capabilities::load(logger);
 
         appData.stream_url = buildStreamURL(this->stream_url, this->ip_address, this->port,
                                             this->rtsp_password, this->rtsp_username);
@@ -88,29 +119,15 @@ namespace nvr {
         // rtsp stream
         setupRTSPStream(&appData);
 
-        if (hasU30()) {
-            // h264 final payloader
-            appData.payloader = gst_element_factory_make("rtph264pay", "pay");
-            logger->info("Using rtph264pay");
-            g_object_set(G_OBJECT(appData.payloader), "pt", 96, nullptr);
-            g_object_set(G_OBJECT(appData.payloader), "config-interval", -1, nullptr);
-        } else {
-            // vp8 final payloader
-            appData.payloader = gst_element_factory_make("rtpvp8pay", "pay");
-            logger->info("Using rtpvp8pay");
-        }
-
-        // udp output sink
-        appData.sink = gst_element_factory_make("udpsink", "udp");
-        g_object_set(G_OBJECT(appData.sink), "host", "0.0.0.0", nullptr);
-        g_object_set(G_OBJECT(appData.sink), "port", rtp_port, nullptr);
-        g_object_set(G_OBJECT(appData.sink), "sync", false, nullptr);
-
-
         appData.is_h265 = type == h265;
 
         Streamer::setupStreamInput(&appData);
         Streamer::setupStreamOutput(&appData, true);
+        Streamer::setupQueues(&appData);
+
+        // The scheduler may have overflowed a U30 stream to software, so pick the payloader afterwards
+        appData.payloader = createPayloader(appData.codec, "pay");
+        logger->info("Using {}", appData.codec.payloader);
 
         // add everything
         if (hasTimestamper()) {
@@ -120,10 +137,12 @@ namespace nvr {
                     appData.dePayloader,
                     appData.parser,
                     appData.timestamper,
+                    appData.decodeQueue,
                     appData.decoder,
+                    appData.decodedTee,
+                    appData.encodeQueue,
                     appData.encoder,
                     appData.payloader,
-                    appData.sink,
                     nullptr
             );
 
@@ -132,10 +151,12 @@ namespace nvr {
                     appData.dePayloader,
                     appData.parser,
                     appData.timestamper,
+                    appData.decodeQueue,
                     appData.decoder,
+                    appData.decodedTee,
+                    appData.encodeQueue,
                     appData.encoder,
                     appData.payloader,
-                    appData.sink,
                     nullptr
             );
         } else {
@@ -144,10 +165,12 @@ namespace nvr {
                     appData.rtspSrc,
                     appData.dePayloader,
                     appData.parser,
+                    appData.decodeQueue,
                     appData.decoder,
+                    appData.decodedTee,
+                    appData.encodeQueue,
                     appData.encoder,
                     appData.payloader,
-                    appData.sink,
                     nullptr
             );
 
@@ -155,14 +178,57 @@ namespace nvr {
             gst_element_link_many(
                     appData.dePayloader,
                     appData.parser,
+                    appData.decodeQueue,
                     appData.decoder,
+                    appData.decodedTee,
+                    appData.encodeQueue,
                     appData.encoder,
                     appData.payloader,
-                    appData.sink,
                     nullptr
             );
         }
 
+        appData.frame_dropper = std::make_shared<FrameDropper>(logger, appData.latency.max_lateness_ms);
+        appData.frame_dropper->attach(appData.encodeQueue, appData.encoder);
+
+        if (!Streamer::setupEgress(&appData)) {
+            gst_object_unref(appData.pipeline);
+            return -1;
+        }
+
+        if (!Streamer::setupDecodedBranches(&appData)) {
+            gst_object_unref(appData.pipeline);
+            return -1;
+        }
+
+        logger->info("Using '{}' latency profile", appData.latency.name);
+
+        string cost_description = appData.hardware_type == none || appData.hardware_type == nvidia ?
+                                  fmt::format("{} {}", appData.codec.name, appData.codec_preset) :
+                                  fmt::format("hardware {}", appData.codec.name);
+        appData.cost_meter = std::make_shared<CodecCostMeter>(logger, cost_description);
+        appData.cost_meter->start();
+
+        if (appData.tracer != nullptr) {
+            for (auto element: {appData.dePayloader, appData.parser, appData.decoder, appData.encoder,
+                                appData.payloader, appData.sink})
+                appData.tracer->trace(element);
+
+            // The egress queue only exists with WHEP
+            for (auto queue: {appData.decodeQueue, appData.encodeQueue, appData.egressQueue}) {
+                if (queue != nullptr)
+                    appData.tracer->watchQueue(queue);
+            }
+
+            appData.tracer->start();
+        }
+
+        if (appData.latency.measure) {
+            appData.latency_probe = std::make_shared<LatencyProbe>(logger, appData.latency.jitter_buffer_ms);
+            appData.latency_probe->attachIngest(appData.dePayloader);
+            appData.latency_probe->attachEgress(appData.sink);
+        }
+
 
         g_signal_connect(appData.rtspSrc, "pad-added", G_CALLBACK(nvr::Streamer::padAddedHandler), &appData);
 
@@ -342,23 +408,29 @@ namespace nvr {
             exit(-1);
         }
 
-        string codec = "vp8";
+        string codec = data->codec.janus_codec;
+        data->logger->info("Publishing {} to Janus", codec);
 
-        if (hasU30() && (std::equal(data->hardware_enc_priority.begin(), data->hardware_enc_priority.end(), "u30") ||
-                         std::equal(data->hardware_enc_priority.begin(), data->hardware_enc_priority.end(), "none"))) {
-            data->logger->info("Using h264 stream since we are using U30");
-            codec = "h264";
-        }
+        if (data->janus->attachStream(data->stream_id, data->rtp_port, codec)) {
+            // An existing mountpoint may be listening on a different port than we picked
+            setEgressPort(data);
+            data->janus->keepAlive();
+
+            if (data->keyframe_on_demand) {
+                if (data->keyframes == nullptr)
+                    data->keyframes = std::make_shared<KeyframeRequester>(data->logger, data->encoder, data->janus);
+
+                data->keyframes->start(data->rtp_port + 1, data->janus->getStreamID());
+            }
 
-        if (data->janus.createStream(data->stream_id, data->rtp_port, codec)) {
-            data->janus.keepAlive();
             data->error_count = 0;
             return;
         } else {
             data->logger->warn("Stream created, but unable to notify Janus, trying to recreate stream");
             data->error_count += 1;
             data->logger->info("Retrying stream creation");
-            data->rtp_port += 1;
+            // Step past this attempt's RTCP port (RTP port + 1) too
+            data->rtp_port += 2;
             return createJanusStream(data);
         }
     }
@@ -372,7 +444,7 @@ namespace nvr {
         string caps_str;
 
 
-        bool janus_connected = data->janus.connect();
+        bool janus_connected = !data->janus_enabled || data->janus->connect();
 
 
         data->logger->debug("Received new pad '{}' from '{}'", GST_PAD_NAME(new_pad), GST_ELEMENT_NAME(src));
@@ -415,9 +487,10 @@ namespace nvr {
         } else {
             data->logger->debug("Link of type '{}' succeeded", new_pad_type);
 
-            gint port_value;
-            g_object_get(G_OBJECT(data->sink), "port", &port_value, nullptr);
-            data->logger->debug("Streaming output RTP port: {}", port_value);
+            if (!data->janus_enabled)
+                goto exit;
+
+            data->logger->debug("Streaming output RTP port: {}", data->rtp_port);
 
             if (janus_connected)
                 createJanusStream(data);
@@ -449,6 +522,14 @@ namespace nvr {
         Streamer::setupRTSPStream(appData);
         Streamer::setupStreamOutput(appData, false);
 
+        if (appData->latency_probe != nullptr)
+            appData->latency_probe->attachIngest(appData->dePayloader);
+
+        if (appData->tracer != nullptr) {
+            for (auto element: {appData->dePayloader, appData->parser, appData->decoder})
+                appData->tracer->trace(element);
+        }
+
         logger->info("Adding elements");
         if (hasTimestamper()) {
             gst_bin_add_many(
@@ -461,13 +542,14 @@ namespace nvr {
                     nullptr
             );
 
+            // rtspsrc is linked from pad-added, the queues and decoded tee were kept in the pipeline
             gst_element_link_many(
-                    appData->rtspSrc,
                     appData->dePayloader,
                     appData->parser,
                     appData->timestamper,
+                    appData->decodeQueue,
                     appData->decoder,
-                    appData->encoder,
+                    appData->decodedTee,
                     nullptr);
         } else {
             gst_bin_add_many(
@@ -480,11 +562,11 @@ namespace nvr {
             );
 
             gst_element_link_many(
-                    appData->rtspSrc,
                     appData->dePayloader,
                     appData->parser,
+                    appData->decodeQueue,
                     appData->decoder,
-                    appData->encoder,
+                    appData->decodedTee,
                     nullptr);
         }
 
@@ -588,27 +670,34 @@ namespace nvr {
                 }
                 break;
             case nvidia:
-                if (appData->is_h265)
+                // nvcodec registers one element per GPU, only the first one has the plain name
+                if (appData->device_index > 0) {
+                    string decoder = fmt::format("nv{}device{}dec", appData->is_h265 ? "h265" : "h264",
+                                                 appData->device_index);
+                    appData->decoder = gst_element_factory_make(decoder.c_str(), "dec");
+                } else if (appData->is_h265)
                     appData->decoder = gst_element_factory_make("nvh265dec", "dec");
                 else
                     appData->decoder = gst_element_factory_make("nvh264dec", "dec");
 
                 if (create_encoder) {
-                    appData->encoder = gst_element_factory_make("vp8enc", "enc");
-                    g_object_set(G_OBJECT(appData->encoder), "threads", 2, nullptr);
-                    g_object_set(G_OBJECT(appData->encoder), "target-bitrate", appData->bitrate, nullptr);
+                    appData->encoder = createEncoder(appData->codec, appData->codec_preset, appData->bitrate, "enc");
+                    applyEncoderLatency(appData);
                 }
                 break;
             case u30:
                 appData->decoder = gst_element_factory_make("vvas_xvcudec", "dec");
-                g_object_set(G_OBJECT(appData->decoder), "dev-idx", 0, nullptr);
+                g_object_set(G_OBJECT(appData->decoder), "dev-idx", appData->device_index, nullptr);
                 g_object_set(G_OBJECT(appData->decoder), "low-latency", true, nullptr);
                 g_object_set(G_OBJECT(appData->decoder), "splitbuff-mode", true, nullptr);
 
                 if (create_encoder) {
                     appData->encoder = gst_element_factory_make("vvas_xvcuenc", "enc");
-                    g_object_set(G_OBJECT(appData->encoder), "dev-idx", 0, nullptr);
-                    g_object_set(G_OBJECT(appData->encoder), "b-frames", 0, nullptr);
+                    g_object_set(G_OBJECT(appData->encoder), "dev-idx", appData->device_index, nullptr);
+
+                    if (appData->latency.b_frames >= 0)
+                        g_object_set(G_OBJECT(appData->encoder), "b-frames", appData->latency.b_frames, nullptr);
+
                     g_object_set(G_OBJECT(appData->encoder), "target-bitrate", appData->bitrate - 75, nullptr);
                     g_object_set(G_OBJECT(appData->encoder), "max-bitrate", appData->bitrate, nullptr);
                     g_object_set(G_OBJECT(appData->encoder), "gop-mode", 2, nullptr);
@@ -624,138 +713,268 @@ namespace nvr {
                 else
                     appData->decoder = gst_element_factory_make("avdec_h264", "dec");
 
+                // Slice threading avoids the frame of delay per thread that frame threading adds
+                if (appData->latency.low_latency_decode)
+                    g_object_set(G_OBJECT(appData->decoder), "thread-type", 2, nullptr);
+
 
                 if (create_encoder) {
-                    appData->encoder = gst_element_factory_make("vp8enc", "enc");
-                    g_object_set(G_OBJECT(appData->encoder), "threads", 2, nullptr);
-                    g_object_set(G_OBJECT(appData->encoder), "target-bitrate", appData->bitrate, nullptr);
+                    appData->encoder = createEncoder(appData->codec, appData->codec_preset, appData->bitrate, "enc");
+                    applyEncoderLatency(appData);
                 }
                 break;
         }
     }
 
-    void Streamer::setupStreamOutput(StreamData *appData, bool create_encoder) {
+    /**
+     * Create the queues that put decoding and encoding on their own threads, and the
+     * tee between them that decoded frame consumers attach to.
+     * The compressed side never drops (a missing reference frame corrupts the
+     * GOP), the raw side leaks the oldest frame so an encoder that can't keep up
+     * lowers the frame rate instead of adding delay.
+     * @param appData
+     */
+    void Streamer::setupQueues(StreamData *appData) {
+        appData->decodeQueue = gst_element_factory_make("queue", "decode_queue");
+        g_object_set(G_OBJECT(appData->decodeQueue), "max-size-buffers", 60, nullptr);
+        g_object_set(G_OBJECT(appData->decodeQueue), "max-size-bytes", 0, nullptr);
+        g_object_set(G_OBJECT(appData->decodeQueue), "max-size-time", 0, nullptr);
+
+        // Everything else that wants decoded frames branches off here, see setupDecodedBranches
+        appData->decodedTee = gst_element_factory_make("tee", "decoded_tee");
+        g_object_set(G_OBJECT(appData->decodedTee), "allow-not-linked", true, nullptr);
+
+        // Only the low latency profiles drop here, the default holds the decoder back while the encoder catches up
+        appData->encodeQueue = gst_element_factory_make("queue", "encode_queue");
+        g_object_set(G_OBJECT(appData->encodeQueue), "leaky", appData->latency.encode_queue_leaky ? 2 : 0, nullptr);
+        g_object_set(G_OBJECT(appData->encodeQueue), "max-size-buffers",
+                     (guint) std::max(appData->latency.encode_queue_buffers, 1), nullptr);
+        g_object_set(G_OBJECT(appData->encodeQueue), "max-size-bytes", 0, nullptr);
+        g_object_set(G_OBJECT(appData->encodeQueue), "max-size-time", 0, nullptr);
+    }
+
+    /**
+     * Apply the latency profile's encoder settings to a software libvpx encoder
+     * @param appData
+     */
+    void Streamer::applyEncoderLatency(StreamData *appData) {
+        if (appData->codec.name != "vp8" && appData->codec.name != "vp9")
+            return;
+
+        if (appData->latency.encoder_deadline >= 0)
+            g_object_set(G_OBJECT(appData->encoder), "deadline", (gint64) appData->latency.encoder_deadline, nullptr);
+
+        if (appData->latency.lag_in_frames >= 0)
+            g_object_set(G_OBJECT(appData->encoder), "lag-in-frames", appData->latency.lag_in_frames, nullptr);
+    }
+
+    /**
+     * Choose where the stream is encoded and with which codec, once per streamer
+     * @param appData
+     */
+    void Streamer::placeEncoder(StreamData *appData) {
         auto logger = appData->logger;
-        bool has_vaapi = hasVAAPI();
-        bool has_nvidia = hasNVIDIA();
-        bool has_u30 = hasU30();
         string priority = appData->hardware_enc_priority;
+        std::vector<string> candidates;
 
         logger->info("Hardware encoder priority: {}", priority);
 
-        if (!has_u30 && !has_vaapi && !has_nvidia || std::equal(priority.begin(), priority.end(), "software")) {
-            logger->info("Using software for encoding/decoding");
-            buildStreamOutput(appData, none, create_encoder);
+        // Same preference order as always, the scheduler skips backends that are full
+        if (priority != "software") {
+            if (hasNVIDIA() && (priority == "nvidia" || priority == "none"))
+                candidates.emplace_back("nvidia");
+
+            if (hasU30() && (priority == "u30" || priority == "none"))
+                candidates.emplace_back("u30");
+
+            if (hasVAAPI() && (priority == "vaapi" || priority == "none"))
+                candidates.emplace_back("vaapi");
+        }
+
+        SlotPlacement placement = appData->scheduler->acquire(candidates);
+        appData->device_index = std::max(placement.device, 0);
+
+        if (placement.backend == "nvidia") {
+            logger->info("Using NVidia GPU {} for encoding/decoding", appData->device_index);
+            appData->hardware_type = nvidia;
+            appData->codec = selectCodec(appData->codecs, logger);
+        } else if (placement.backend == "u30") {
+            logger->info("Using U30 Media Accelerator {} for encoding/decoding", appData->device_index);
+            appData->hardware_type = u30;
+            appData->codec = hardwareCodec("h264");
+        } else if (placement.backend == "vaapi") {
+            logger->info("Using VAAPI for encoding/decoding");
+            appData->hardware_type = vaapi;
+            appData->codec = hardwareCodec("vp8");
         } else {
-            if (has_nvidia && (std::equal(priority.begin(), priority.end(), "nvidia") ||
-                               std::equal(priority.begin(), priority.end(), "none"))) {
-                logger->info("Using NVidia GPU for encoding/decoding");
-                buildStreamOutput(appData, nvidia, create_encoder);
-            } else if (has_u30 && (std::equal(priority.begin(), priority.end(), "u30") ||
-                                   std::equal(priority.begin(), priority.end(), "none"))) {
-                logger->info("Using U30 Media Accelerator for encoding/decoding");
-                buildStreamOutput(appData, u30, create_encoder);
-            } else if (has_vaapi && (std::equal(priority.begin(), priority.end(), "vaapi") ||
-                                     std::equal(priority.begin(), priority.end(), "none"))) {
-                logger->info("Using VAAPI for encoding/decoding");
-                buildStreamOutput(appData, vaapi, create_encoder);
-            } else {
-                logger->warn("All cases fell through, we are using software encoder");
-                buildStreamOutput(appData, none, create_encoder);
-            }
+            logger->info("Using software for encoding/decoding");
+            appData->hardware_type = none;
+            appData->codec = selectCodec(appData->codecs, logger);
         }
     }
 
+    void Streamer::setupStreamOutput(StreamData *appData, bool create_encoder) {
+        auto logger = appData->logger;
+
+        // A codec switch keeps the encoder, so it keeps the placement (and session) that encoder was built for
+        if (create_encoder)
+            placeEncoder(appData);
+        else
+            logger->info("Keeping the running encoder's placement, device {}", appData->device_index);
+
+        if (appData->hardware_type == none || appData->hardware_type == nvidia)
+            logger->info("Encoding {} with the '{}' preset", appData->codec.name, appData->codec_preset);
+
+        buildStreamOutput(appData, appData->hardware_type, create_encoder);
+    }
+
 #pragma clang diagnostic pop
 
     void Streamer::setupRTSPStream(StreamData *appData) {
         appData->rtspSrc = gst_element_factory_make("rtspsrc", "src");
         g_object_set(G_OBJECT(appData->rtspSrc), "location", appData->stream_url.c_str(), nullptr);
         g_object_set(G_OBJECT(appData->rtspSrc), "udp-reconnect", true, nullptr);
-        g_object_set(G_OBJECT(appData->rtspSrc), "latency", 200, nullptr);
+        g_object_set(G_OBJECT(appData->rtspSrc), "latency", appData->latency.jitter_buffer_ms, nullptr);
+        g_object_set(G_OBJECT(appData->rtspSrc), "drop-on-latency", appData->latency.drop_on_latency, nullptr);
         g_object_set(G_OBJECT(appData->rtspSrc), "user-id", appData->rtsp_username.c_str(), nullptr);
         g_object_set(G_OBJECT(appData->rtspSrc), "user-pw", appData->rtsp_password.c_str(), nullptr);
-    }
 
-    bool Streamer::hasNVIDIA() {
-        GList *plugins, *p;
+        // GstRTSPLowerTrans flags
+        const string &protocols = appData->latency.protocols;
+        if (protocols == "udp")
+            g_object_set(G_OBJECT(appData->rtspSrc), "protocols", 0x1, nullptr);
+        else if (protocols == "tcp")
+            g_object_set(G_OBJECT(appData->rtspSrc), "protocols", 0x4, nullptr);
+        else if (protocols == "tcp+udp" || protocols == "udp+tcp")
+            g_object_set(G_OBJECT(appData->rtspSrc), "protocols", 0x5, nullptr);
+
+        // Capture times from RTCP sender reports, used for glass-to-egress measurement
+        if (appData->latency.measure &&
+            g_object_class_find_property(G_OBJECT_GET_CLASS(appData->rtspSrc), "add-reference-timestamp-meta"))
+            g_object_set(G_OBJECT(appData->rtspSrc), "add-reference-timestamp-meta", true, nullptr);
+    }
 
-        bool has_nvidia = false;
-        plugins = gst_registry_get_plugin_list(gst_registry_get());
-        for (p = plugins; p; p = p->next) {
-            auto *plugin = static_cast<GstPlugin *>(p->data);
+    /**
+     * Build the output side after the payloader: the UDP sink feeding Janus and,
+     * when a WHEP port is configured, a tee that webrtcbin peers attach to.
+     * With egressSink set to "batched" the udpsink is replaced by a BatchSink.
+     * Without Janus the sink is a fakesink so the pipeline still runs with no viewers.
+     * @param appData
+     * @return
+     */
+    bool Streamer::setupEgress(StreamData *appData) {
+        auto logger = appData->logger;
 
-            // Check for nvcodec
-            if (strcmp(gst_plugin_get_name(plugin), "nvcodec") == 0) {
-                has_nvidia = gst_registry_check_feature_version(gst_registry_get(), "nvh265dec", 1, 22, 0);
+        if (appData->janus_enabled && appData->egress_sink == "batched") {
+            appData->batch_sink = std::make_shared<BatchSink>(logger, appData->rtp_port);
+            appData->sink = appData->batch_sink->create();
 
-                if (has_nvidia)
-                    break;
+            if (appData->sink == nullptr) {
+                logger->warn("Could not create batched RTP egress, falling back to udpsink");
+                appData->batch_sink = nullptr;
             }
         }
 
-        gst_plugin_list_free(plugins);
-        return has_nvidia;
+        if (appData->janus_enabled && appData->batch_sink == nullptr) {
+            // udp output sink
+            appData->sink = gst_element_factory_make("udpsink", "udp");
+            g_object_set(G_OBJECT(appData->sink), "host", "0.0.0.0", nullptr);
+            g_object_set(G_OBJECT(appData->sink), "port", (gint) appData->rtp_port, nullptr);
+            g_object_set(G_OBJECT(appData->sink), "sync", false, nullptr);
+        } else if (!appData->janus_enabled) {
+            logger->info("Janus is disabled, RTP output is only available over WHEP");
+            appData->sink = gst_element_factory_make("fakesink", "udp");
+            g_object_set(G_OBJECT(appData->sink), "sync", false, nullptr);
+            g_object_set(G_OBJECT(appData->sink), "async", false, nullptr);
+        }
+
+        gst_bin_add(GST_BIN(appData->pipeline), appData->sink);
+
+        if (appData->whep_port <= 0)
+            return gst_element_link(appData->payloader, appData->sink);
+
+        appData->egressTee = gst_element_factory_make("tee", "egress_tee");
+        appData->egressQueue = gst_element_factory_make("queue", "egress_queue");
+        g_object_set(G_OBJECT(appData->egressTee), "allow-not-linked", true, nullptr);
+
+        gst_bin_add_many(GST_BIN(appData->pipeline), appData->egressTee, appData->egressQueue, nullptr);
+
+        if (!gst_element_link_many(appData->payloader, appData->egressTee, appData->egressQueue, appData->sink,
+                                   nullptr)) {
+            logger->error("Could not link WHEP egress tee");
+            return false;
+        }
+
+        appData->whep = std::make_shared<WhepEgress>(logger, appData->whep_port, appData->stream_id);
+        return appData->whep->start(appData->pipeline, appData->egressTee);
     }
 
-    bool Streamer::hasVAAPI() {
-        GList *plugins, *p;
-
-        bool has_vaapi = false;
-        plugins = gst_registry_get_plugin_list(gst_registry_get());
-        for (p = plugins; p; p = p->next) {
-            auto *plugin = static_cast<GstPlugin *>(p->data);
-            // Check for vaapi
-            if (strcmp(gst_plugin_get_name(plugin), "vaapi") == 0) {
-                has_vaapi = gst_registry_check_feature_version(gst_registry_get(), "vaapidecodebin", 1, 22, 0);
-
-                if (has_vaapi)
-                    break;
-            }
+    /**
+     * Attach the optional consumers of decoded frames to the decoded tee
+     * @param appData
+     * @return
+     */
+    bool Streamer::setupDecodedBranches(StreamData *appData) {
+        const FrameTapConfig &tap = appData->frame_tap;
+
+        if (tap.enabled) {
+            appData->frame_ring = std::make_shared<FrameRing>(appData->logger, appData->stream_id, tap.slots);
+
+            DecodedBranchFormat format = {"frame_tap", tap.format, tap.width, tap.height, tap.max_fps};
+            if (!attachDecodedBranch(appData->pipeline, appData->decodedTee, format, appData->frame_ring->create(),
+                                     appData->logger))
+                return false;
         }
 
-        gst_plugin_list_free(plugins);
+        // Format left to the decoder, jpegenc takes the usual raw formats and only converts on request
+        if (appData->snapshot_server) {
+            appData->snapshots = std::make_shared<SnapshotServer>(appData->logger, appData->stream_id,
+                                                                  appData->snapshot_quality);
 
-        return has_vaapi;
-    }
+            DecodedBranchFormat format = {"snapshot", "", 0, 0, 0};
+            if (!attachDecodedBranch(appData->pipeline, appData->decodedTee, format, appData->snapshots->create(),
+                                     appData->logger) || !appData->snapshots->start())
+                return false;
+        }
 
-    bool Streamer::hasTimestamper() {
-        GList *plugins, *p;
-
-        bool has_timestamper = false;
-        plugins = gst_registry_get_plugin_list(gst_registry_get());
-        for (p = plugins; p; p = p->next) {
-            auto *plugin = static_cast<GstPlugin *>(p->data);
-            // Check for codectimestamper
-            if (strcmp(gst_plugin_get_name(plugin), "codectimestamper") == 0) {
-                has_timestamper = gst_registry_check_feature_version(gst_registry_get(), "h264timestamper", 1, 22, 0);
-
-                if (has_timestamper)
-                    break;
-            }
+        if (appData->analysis.enabled) {
+            appData->analyzer = std::make_shared<VideoAnalyzer>(appData->logger, appData->stream_id,
+                                                                appData->analysis);
+
+            if (!attachDecodedBranch(appData->pipeline, appData->decodedTee, VideoAnalyzer::branchFormat(),
+                                     appData->analyzer->create(), appData->logger))
+                return false;
+
+            appData->analyzer->start();
         }
 
-        gst_plugin_list_free(plugins);
+        return true;
+    }
+
+    /**
+     * Apply appData->rtp_port to whichever element occupies the sink slot
+     * @param appData
+     */
+    void Streamer::setEgressPort(StreamData *appData) {
+        if (appData->batch_sink != nullptr)
+            appData->batch_sink->setPort(appData->rtp_port);
+        else
+            g_object_set(G_OBJECT(appData->sink), "port", (gint) appData->rtp_port, nullptr);
+    }
 
-        return has_timestamper;
+    bool Streamer::hasNVIDIA() {
+        return Capabilities::get().nvidia;
     }
 
-    bool Streamer::hasU30() {
-        GList *plugins, *p;
-
-        bool has_u30 = false;
-        plugins = gst_registry_get_plugin_list(gst_registry_get());
-        for (p = plugins; p; p = p->next) {
-            auto *plugin = static_cast<GstPlugin *>(p->data);
-            // Check for vvas_xvcudec
-            if (strcmp(gst_plugin_get_name(plugin), "vvas_xvcuenc") == 0) {
-                has_u30 = true;
-                break;
-            }
-        }
+    bool Streamer::hasVAAPI() {
+        return Capabilities::get().vaapi;
+    }
 
-        gst_plugin_list_free(plugins);
+    bool Streamer::hasTimestamper() {
+        return Capabilities::get().timestamper;
+    }
 
-        return has_u30;
+    bool Streamer::hasU30() {
+        return Capabilities::get().u30;
     }
 }
@@ -9,26 +9,76 @@
 #include <gst/gst.h>
 #include <gst/gstpad.h>
 #include "janus.h"
+#include "whep.h"
+#include "batch_sink.h"
+#include "latency.h"
+#include "keyframe.h"
+#include "qos.h"
+#include "capabilities.h"
+#include "scheduler.h"
+#include "codecs.h"
+#include "decoded_branch.h"
+#include "frame_ring.h"
+#include "snapshot.h"
+#include "analysis.h"
+#include "tracer.h"
 
 namespace nvr {
 
+    enum StreamHardwareType {
+        vaapi,
+        u30,
+        nvidia,
+        none
+    };
+
     typedef struct StreamData {
         GstElement *pipeline;
         GstElement *rtspSrc;
         GstElement *dePayloader;
         GstElement *parser;
         GstElement *timestamper;
+        GstElement *decodeQueue;
         GstElement *decoder;
+        GstElement *decodedTee;
+        GstElement *encodeQueue;
         GstElement *encoder;
         GstElement *payloader;
+        GstElement *egressTee;
+        GstElement *egressQueue;
         GstElement *sink;
         string stream_name;
         string hardware_enc_priority;
+        string egress_sink;
         int64_t rtp_port;
         int64_t bitrate;
         string stream_id;
         std::shared_ptr<spdlog::logger> logger;
-        Janus janus;
+        std::shared_ptr<Janus> janus;
+        std::shared_ptr<WhepEgress> whep;
+        std::shared_ptr<BatchSink> batch_sink;
+        std::shared_ptr<LatencyProbe> latency_probe;
+        std::shared_ptr<KeyframeRequester> keyframes;
+        std::shared_ptr<FrameDropper> frame_dropper;
+        std::shared_ptr<EncoderScheduler> scheduler;
+        StreamHardwareType hardware_type;
+        int device_index;
+        StreamCodec codec;
+        std::vector<string> codecs;
+        string codec_preset;
+        std::shared_ptr<CodecCostMeter> cost_meter;
+        std::shared_ptr<FrameRing> frame_ring;
+        FrameTapConfig frame_tap;
+        std::shared_ptr<SnapshotServer> snapshots;
+        bool snapshot_server;
+        int snapshot_quality;
+        std::shared_ptr<VideoAnalyzer> analyzer;
+        AnalysisConfig analysis;
+        std::shared_ptr<PipelineTracer> tracer;
+        bool keyframe_on_demand;
+        LatencyProfile latency;
+        bool janus_enabled;
+        int whep_port;
         GMainLoop *loop;
         gboolean is_live;
         gboolean is_h265;
@@ -39,15 +89,6 @@ namespace nvr {
         string rtsp_password;
     } StreamData;
 
-    enum StreamHardwareType {
-        vaapi,
-        u30,
-        nvidia,
-        none
-    };
-
-
-
     class Streamer {
 
     public:
@@ -75,10 +116,16 @@ namespace nvr {
         static void padAddedHandler(GstElement *src, GstPad *new_pad, StreamData *data);
         static void createJanusStream(StreamData *data);
         static void setupStreamInput(StreamData *appData);
+        static void placeEncoder(StreamData *appData);
         static void setupStreamOutput(StreamData *appData,  bool create_encoder);
         static void buildStreamOutput(StreamData *appData, StreamHardwareType type, bool create_encoder);
+        static void setupQueues(StreamData *appData);
+        static void applyEncoderLatency(StreamData *appData);
         static void teardownStreamCodecs(StreamData *appData);
         static void setupRTSPStream(StreamData *appData);
+        static bool setupEgress(StreamData *appData);
+        static bool setupDecodedBranches(StreamData *appData);
+        static void setEgressPort(StreamData *appData);
         static void switchCodecs(StreamData *appData);
 
         static bool hasVAAPI();
@@ -0,0 +1,285 @@
+//
+// Per-element processing time, rates and queue levels for the streaming pipeline
+//
+
+#include "tracer.h"
+
+#include <utility>
+
+using json = nlohmann::json;
+
+namespace nvr {
+
+    // Frames that never leave an element (dropped, merged) are forgotten past this
+    const size_t max_pending_buffers = 64;
+
+    /**
+     * @param logger
+     * @param stream_id
+     * @param interval_seconds Seconds between reports
+     */
+    PipelineTracer::PipelineTracer(const nvr_logger &logger, string stream_id, int interval_seconds) {
+        this->logger = logger;
+        this->stream_id = std::move(stream_id);
+        this->interval_seconds = interval_seconds;
+    }
+
+    PipelineTracer::~PipelineTracer() {
+        if (report_id != 0)
+            g_source_remove(report_id);
+
+        for (auto queue: queues)
+            gst_object_unref(queue);
+    }
+
+    /**
+     * Count buffers in and out of an element and time each PTS through it. Called
+     * again for the elements a codec switch rebuilds, the totals carry on under the
+     * same element name.
+     * @param element Skipped when nullptr, for elements the configuration leaves out
+     */
+    void PipelineTracer::trace(GstElement *element) {
+        if (element == nullptr)
+            return;
+
+        string name = GST_OBJECT_NAME(element);
+        ElementTrace *trace;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto existing = elements.find(name);
+
+            if (existing == elements.end()) {
+                auto created = std::make_unique<ElementTrace>();
+                created->tracer = this;
+                trace = created.get();
+
+                elements.emplace(name, std::move(created));
+                order.push_back(name);
+            } else {
+                trace = existing->second.get();
+
+                if (!trace->pending.empty())
+                    trace->busy_us += g_get_monotonic_time() - trace->busy_since;
+
+                trace->pending.clear();
+            }
+        }
+
+        auto probe_type = (GstPadProbeType) (GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST);
+
+        GstPad *sink_pad = gst_element_get_static_pad(element, "sink");
+        if (sink_pad != nullptr) {
+            gst_pad_add_probe(sink_pad, probe_type, sinkProbe, trace, nullptr);
+            gst_object_unref(sink_pad);
+        }
+
+        // Sinks have no src pad, their rates are still useful
+        GstPad *src_pad = gst_element_get_static_pad(element, "src");
+        if (src_pad != nullptr) {
+            trace->timed = true;
+            gst_pad_add_probe(src_pad, probe_type, srcProbe, trace, nullptr);
+            gst_object_unref(src_pad);
+        }
+    }
+
+    /**
+     * Report the fill level of a queue, a full queue sits in front of the bottleneck
+     * @param queue
+     */
+    void PipelineTracer::watchQueue(GstElement *queue) {
+        if (queue == nullptr)
+            return;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        queues.push_back(GST_ELEMENT(gst_object_ref(queue)));
+    }
+
+    void PipelineTracer::start() {
+        last_report = g_get_monotonic_time();
+        report_id = g_timeout_add_seconds(interval_seconds, reportTimeout, this);
+
+        logger->info("Pipeline tracing enabled, reporting every {} seconds", interval_seconds);
+    }
+
+    GstPadProbeReturn PipelineTracer::sinkProbe([[maybe_unused]] GstPad *pad, GstPadProbeInfo *info,
+                                                gpointer user_data) {
+        auto *trace = static_cast<ElementTrace *>(user_data);
+        trace->tracer->enter(trace, info);
+
+        return GST_PAD_PROBE_OK;
+    }
+
+    GstPadProbeReturn PipelineTracer::srcProbe([[maybe_unused]] GstPad *pad, GstPadProbeInfo *info,
+                                               gpointer user_data) {
+        auto *trace = static_cast<ElementTrace *>(user_data);
+        trace->tracer->leave(trace, info);
+
+        return GST_PAD_PROBE_OK;
+    }
+
+    gboolean PipelineTracer::reportTimeout(gpointer user_data) {
+        static_cast<PipelineTracer *>(user_data)->report();
+
+        return G_SOURCE_CONTINUE;
+    }
+
+    /**
+     * @param info
+     * @param buffers Set to the number of buffers in the probe
+     * @param bytes Set to their total size
+     * @return The first buffer, for its PTS
+     */
+    static GstBuffer *countBuffers(GstPadProbeInfo *info, uint64_t &buffers, uint64_t &bytes) {
+        if (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
+            GstBufferList *list = GST_PAD_PROBE_INFO_BUFFER_LIST(info);
+            guint length = gst_buffer_list_length(list);
+
+            buffers = length;
+            bytes = 0;
+
+            for (guint i = 0; i < length; i++)
+                bytes += gst_buffer_get_size(gst_buffer_list_get(list, i));
+
+            return length > 0 ? gst_buffer_list_get(list, 0) : nullptr;
+        }
+
+        GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+        buffers = 1;
+        bytes = gst_buffer_get_size(buffer);
+
+        return buffer;
+    }
+
+    void PipelineTracer::enter(ElementTrace *trace, GstPadProbeInfo *info) {
+        uint64_t buffers, bytes;
+        GstBuffer *buffer = countBuffers(info, buffers, bytes);
+        gint64 now = g_get_monotonic_time();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        trace->buffers_in += buffers;
+        trace->bytes_in += bytes;
+
+        // Packets of one frame share its PTS, the first one starts the clock
+        if (trace->timed && buffer != nullptr && GST_CLOCK_TIME_IS_VALID(GST_BUFFER_PTS(buffer))) {
+            if (trace->pending.empty())
+                trace->busy_since = now;
+
+            trace->pending.emplace(GST_BUFFER_PTS(buffer), now);
+
+            while (trace->pending.size() > max_pending_buffers)
+                trace->pending.erase(trace->pending.begin());
+        }
+    }
+
+    void PipelineTracer::leave(ElementTrace *trace, GstPadProbeInfo *info) {
+        uint64_t buffers, bytes;
+        GstBuffer *buffer = countBuffers(info, buffers, bytes);
+        gint64 now = g_get_monotonic_time();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        trace->buffers_out += buffers;
+        trace->bytes_out += bytes;
+
+        if (buffer == nullptr || !GST_CLOCK_TIME_IS_VALID(GST_BUFFER_PTS(buffer)))
+            return;
+
+        auto entered = trace->pending.find(GST_BUFFER_PTS(buffer));
+
+        if (entered == trace->pending.end())
+            return;
+
+        gint64 elapsed = now - entered->second;
+        trace->timed_buffers++;
+        trace->latency_us += elapsed;
+        trace->max_us = std::max(trace->max_us, elapsed);
+
+        // Anything older has left already or was dropped
+        trace->pending.erase(trace->pending.begin(), std::next(entered));
+
+        if (trace->pending.empty())
+            trace->busy_us += now - trace->busy_since;
+    }
+
+    /**
+     * Log one JSON line per interval and reset the counters
+     */
+    void PipelineTracer::report() {
+        gint64 now = g_get_monotonic_time();
+        double seconds = (double) (now - last_report) / 1000000.0;
+        last_report = now;
+
+        if (seconds <= 0)
+            return;
+
+        json metrics;
+        metrics["type"] = "pipeline-trace";
+        metrics["camera"] = stream_id;
+        metrics["interval"] = seconds;
+
+        string busiest;
+        double busiest_share = 0;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            for (const auto &name: order) {
+                ElementTrace &trace = *elements[name];
+                json element;
+
+                // Close the open busy stretch at the interval boundary, the next interval gets the rest
+                if (!trace.pending.empty()) {
+                    trace.busy_us += now - trace.busy_since;
+                    trace.busy_since = now;
+                }
+
+                element["inFps"] = (double) trace.buffers_in / seconds;
+                element["outFps"] = (double) trace.buffers_out / seconds;
+                element["inKbps"] = (double) trace.bytes_in * 8.0 / 1000.0 / seconds;
+                element["outKbps"] = (double) trace.bytes_out * 8.0 / 1000.0 / seconds;
+
+                if (trace.timed_buffers > 0) {
+                    double share = (double) trace.busy_us / 1000000.0 / seconds;
+
+                    element["avgMs"] = (double) trace.latency_us / (double) trace.timed_buffers / 1000.0;
+                    element["maxMs"] = (double) trace.max_us / 1000.0;
+                    element["busy"] = share;
+
+                    if (share > busiest_share) {
+                        busiest_share = share;
+                        busiest = name;
+                    }
+                }
+
+                metrics["elements"][name] = element;
+
+                trace.buffers_in = trace.buffers_out = 0;
+                trace.bytes_in = trace.bytes_out = 0;
+                trace.timed_buffers = 0;
+                trace.latency_us = trace.max_us = trace.busy_us = 0;
+            }
+
+            for (auto queue: queues) {
+                guint buffers = 0, max_buffers = 0;
+                guint64 level_time = 0;
+
+                g_object_get(G_OBJECT(queue), "current-level-buffers", &buffers, "max-size-buffers", &max_buffers,
+                             "current-level-time", &level_time, nullptr);
+
+                json level;
+                level["buffers"] = buffers;
+                level["maxBuffers"] = max_buffers;
+                level["ms"] = (double) level_time / 1000000.0;
+
+                metrics["queues"][GST_OBJECT_NAME(queue)] = level;
+            }
+        }
+
+        logger->info("Trace: {}", metrics.dump());
+
+        // Share of wall clock with a frame inside the element, near 1.0 it can't keep up
+        if (busiest_share > 0.8)
+            logger->warn("Trace: {} is busy {:.0f}% of the time and is likely the bottleneck", busiest,
+                         busiest_share * 100.0);
+    }
+}
@@ -0,0 +1,70 @@
+//
+// Per-element processing time, rates and queue levels for the streaming pipeline
+//
+
+#ifndef NEVER_CLI_TRACER_H
+#define NEVER_CLI_TRACER_H
+
+#include "../common.h"
+#include <gst/gst.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace nvr {
+
+    class PipelineTracer;
+
+    struct ElementTrace {
+        PipelineTracer *tracer = nullptr;
+        bool timed = false;
+        uint64_t buffers_in = 0;
+        uint64_t buffers_out = 0;
+        uint64_t bytes_in = 0;
+        uint64_t bytes_out = 0;
+        uint64_t timed_buffers = 0;
+        gint64 latency_us = 0;
+        gint64 max_us = 0;
+
+        // Time with at least one frame inside, overlapping frames (frame threads, lookahead) count once
+        gint64 busy_us = 0;
+        gint64 busy_since = 0;
+
+        // Monotonic time (µs) each PTS entered the element, matched when it leaves
+        std::map<GstClockTime, gint64> pending;
+    };
+
+    class PipelineTracer {
+    public:
+        PipelineTracer(const nvr_logger &logger, string stream_id, int interval_seconds);
+        ~PipelineTracer();
+        PipelineTracer(PipelineTracer const &) = delete;
+        PipelineTracer &operator=(PipelineTracer const &) = delete;
+
+        void trace(GstElement *element);
+        void watchQueue(GstElement *queue);
+        void start();
+
+    private:
+        nvr_logger logger;
+        string stream_id;
+        int interval_seconds;
+        std::mutex mutex;
+        std::vector<string> order;
+        std::map<string, std::unique_ptr<ElementTrace>> elements;
+        std::vector<GstElement *> queues;
+        gint64 last_report = 0;
+        guint report_id = 0;
+
+        void enter(ElementTrace *trace, GstPadProbeInfo *info);
+        void leave(ElementTrace *trace, GstPadProbeInfo *info);
+        void report();
+
+        static GstPadProbeReturn sinkProbe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data);
+        static GstPadProbeReturn srcProbe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data);
+        static gboolean reportTimeout(gpointer user_data);
+    };
+}
+
+#endif //NEVER_CLI_TRACER_H
@@ -0,0 +1,426 @@
+//
+// Minimal WHEP endpoint serving the streamer's RTP output through webrtcbin
+//
+
+#include "whep.h"
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <charconv>
+#include <random>
+#include <sstream>
+
+namespace nvr {
+
+    // Upper bound for an SDP offer, browsers send a few KB
+    const size_t max_request_size = 64 * 1024;
+
+    WhepEgress::WhepEgress(const nvr_logger &logger, int port, string stream_id) {
+        this->logger = logger;
+        this->port = port;
+        this->stream_id = std::move(stream_id);
+    }
+
+    WhepEgress::~WhepEgress() {
+        stop();
+    }
+
+    /**
+     * Start listening for WHEP requests on localhost
+     * @param pipeline Pipeline the peers are added to
+     * @param tee Tee carrying the payloaded RTP stream
+     * @return
+     */
+    bool WhepEgress::start(GstElement *pipeline, GstElement *tee) {
+        if (running)
+            return true;
+
+        this->pipeline = pipeline;
+        this->tee = tee;
+
+        if ((server_sock = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+            logger->error("Could not create WHEP socket");
+            return false;
+        }
+
+        int opt = 1;
+        setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+        struct sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(port);
+
+        if (bind(server_sock, (struct sockaddr *) &address, sizeof(address)) < 0 || listen(server_sock, 8) < 0) {
+            logger->error("Could not listen for WHEP on port {}", port);
+            close(server_sock);
+            server_sock = -1;
+            return false;
+        }
+
+        running = true;
+        server_thread = std::thread(&WhepEgress::serve, this);
+
+        logger->info("WHEP endpoint listening on http://127.0.0.1:{}/whep/{}", port, stream_id);
+        return true;
+    }
+
+    void WhepEgress::stop() {
+        if (!running)
+            return;
+
+        running = false;
+        shutdown(server_sock, SHUT_RDWR);
+        close(server_sock);
+        server_sock = -1;
+
+        if (server_thread.joinable())
+            server_thread.join();
+
+        std::lock_guard<std::mutex> lock(peers_mutex);
+
+        for (auto &[session_id, peer]: peers)
+            g_signal_handler_disconnect(peer.webrtc, peer.state_handler);
+
+        peers.clear();
+    }
+
+    void WhepEgress::serve() {
+        while (running) {
+            int client_sock = accept(server_sock, nullptr, nullptr);
+
+            if (client_sock < 0) {
+                if (running && errno != EINTR)
+                    logger->warn("WHEP accept failed: {}", strerror(errno));
+
+                if (!running)
+                    break;
+
+                continue;
+            }
+
+            // Requests are short and rare, handling them in turn keeps negotiation serialized
+            handleConnection(client_sock);
+            close(client_sock);
+        }
+    }
+
+    void WhepEgress::handleConnection(int client_sock) {
+        string request;
+        char buffer[4096];
+        size_t header_end = string::npos;
+        size_t content_length = 0;
+        bool bad_length = false;
+
+        struct timeval timeout{5, 0};
+        setsockopt(client_sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        while (request.size() < max_request_size) {
+            ssize_t bytes = recv(client_sock, buffer, sizeof(buffer), 0);
+
+            // An incomplete request is answered below rather than dropped
+            if (bytes <= 0)
+                break;
+
+            request.append(buffer, bytes);
+
+            if (header_end == string::npos && (header_end = request.find("\r\n\r\n")) != string::npos) {
+                string lowered = request.substr(0, header_end);
+                std::ranges::transform(lowered, lowered.begin(), ::tolower);
+
+                size_t length_pos = lowered.find("content-length:");
+                if (length_pos != string::npos) {
+                    size_t value_start = lowered.find_first_not_of(" \t", length_pos + 15);
+                    size_t value_end = lowered.find("\r\n", length_pos);
+                    const char *first = lowered.data() + std::min(value_start, lowered.size());
+                    const char *last = lowered.data() + std::min(value_end, lowered.size());
+                    auto [end, error] = std::from_chars(first, last, content_length);
+
+                    bad_length = error != std::errc() || end == first ||
+                                 string(end, last).find_first_not_of(" \t") != string::npos;
+                }
+
+                if (bad_length || header_end + 4 + content_length > max_request_size)
+                    break;
+            }
+
+            if (header_end != string::npos && request.size() >= header_end + 4 + content_length)
+                break;
+        }
+
+        if (header_end == string::npos || bad_length) {
+            sendResponse(client_sock, 400, "Bad Request");
+            return;
+        }
+
+        if (header_end + 4 + content_length > max_request_size) {
+            sendResponse(client_sock, 413, "Payload Too Large");
+            return;
+        }
+
+        // The client stopped sending before the whole body arrived
+        if (request.size() < header_end + 4 + content_length) {
+            sendResponse(client_sock, 400, "Bad Request");
+            return;
+        }
+
+        std::istringstream request_line(request.substr(0, request.find("\r\n")));
+        string method, target;
+        request_line >> method >> target;
+
+        string endpoint = "/whep/" + stream_id;
+        string body = request.substr(header_end + 4, content_length);
+
+        if (method == "OPTIONS") {
+            sendResponse(client_sock, 204, "No Content", "",
+                         "Access-Control-Allow-Methods: POST, DELETE, OPTIONS\r\n"
+                         "Access-Control-Allow-Headers: Content-Type\r\n");
+        } else if (method == "POST" && (target == endpoint || target == "/whep")) {
+            string session_id;
+            string answer = addPeer(body, session_id);
+
+            if (answer.empty())
+                sendResponse(client_sock, 400, "Bad Request");
+            else
+                sendResponse(client_sock, 201, "Created", answer,
+                             "Content-Type: application/sdp\r\n"
+                             "Location: /whep/" + stream_id + "/" + session_id + "\r\n");
+        } else if (method == "DELETE" && target.starts_with(endpoint + "/")) {
+            if (removePeer(target.substr(endpoint.size() + 1)))
+                sendResponse(client_sock, 200, "OK");
+            else
+                sendResponse(client_sock, 404, "Not Found");
+        } else if (method == "PATCH") {
+            // Answers are only sent once gathering completes, so trickle ICE is not needed
+            sendResponse(client_sock, 405, "Method Not Allowed");
+        } else {
+            sendResponse(client_sock, 404, "Not Found");
+        }
+    }
+
+    void WhepEgress::sendResponse(int client_sock, int status, const string &reason, const string &body,
+                                  const string &extra_headers) {
+        string response = "HTTP/1.1 " + std::to_string(status) + " " + reason + "\r\n"
+                          "Access-Control-Allow-Origin: *\r\n"
+                          "Access-Control-Expose-Headers: Location\r\n"
+                          "Connection: close\r\n"
+                          "Content-Length: " + std::to_string(body.size()) + "\r\n" +
+                          extra_headers + "\r\n" + body;
+
+        send(client_sock, response.data(), response.size(), MSG_NOSIGNAL);
+    }
+
+    /**
+     * Add a webrtcbin fed from the egress tee and answer the viewer's offer.
+     * The answer is returned once ICE gathering completes (no trickle).
+     * @param offer SDP offer from the viewer
+     * @param session_id Set to the new session's ID
+     * @return SDP answer, empty on failure
+     */
+    string WhepEgress::addPeer(const string &offer, string &session_id) {
+        GstSDPMessage *sdp = nullptr;
+
+        if (gst_sdp_message_new_from_text(offer.c_str(), &sdp) != GST_SDP_OK) {
+            logger->warn("Could not parse WHEP offer");
+            return "";
+        }
+
+        WhepPeer peer{};
+        peer.session_id = generateSessionID();
+        peer.queue = gst_element_factory_make("queue", nullptr);
+        peer.webrtc = gst_element_factory_make("webrtcbin", nullptr);
+
+        if (peer.webrtc == nullptr) {
+            logger->error("webrtcbin is not available, cannot serve WHEP");
+            gst_sdp_message_free(sdp);
+            return "";
+        }
+
+        g_object_set(G_OBJECT(peer.queue), "leaky", 2, "max-size-buffers", 64, "max-size-time", 0,
+                     "max-size-bytes", 0, nullptr);
+        g_object_set(G_OBJECT(peer.webrtc), "bundle-policy", 3, "latency", 0, nullptr);
+
+        gst_bin_add_many(GST_BIN(pipeline), peer.queue, peer.webrtc, nullptr);
+
+        peer.tee_pad = gst_element_request_pad_simple(tee, "src_%u");
+        GstPad *queue_sink = gst_element_get_static_pad(peer.queue, "sink");
+        gst_pad_link(peer.tee_pad, queue_sink);
+        gst_object_unref(queue_sink);
+
+        // Requesting the sink pad creates a send-only transceiver the offer's m-line is matched to
+        GstPad *queue_src = gst_element_get_static_pad(peer.queue, "src");
+        GstPad *webrtc_sink = gst_element_request_pad_simple(peer.webrtc, "sink_%u");
+        gst_pad_link(queue_src, webrtc_sink);
+        gst_object_unref(queue_src);
+        gst_object_unref(webrtc_sink);
+
+        gst_element_sync_state_with_parent(peer.queue);
+        gst_element_sync_state_with_parent(peer.webrtc);
+
+        GstWebRTCSessionDescription *remote = gst_webrtc_session_description_new(GST_WEBRTC_SDP_TYPE_OFFER, sdp);
+        GstPromise *promise = gst_promise_new();
+        g_signal_emit_by_name(peer.webrtc, "set-remote-description", remote, promise);
+        gst_promise_wait(promise);
+        gst_promise_unref(promise);
+        gst_webrtc_session_description_free(remote);
+
+        GstWebRTCSessionDescription *answer = nullptr;
+        promise = gst_promise_new();
+        g_signal_emit_by_name(peer.webrtc, "create-answer", nullptr, promise);
+
+        if (gst_promise_wait(promise) == GST_PROMISE_RESULT_REPLIED) {
+            const GstStructure *reply = gst_promise_get_reply(promise);
+            gst_structure_get(reply, "answer", GST_TYPE_WEBRTC_SESSION_DESCRIPTION, &answer, nullptr);
+        }
+        gst_promise_unref(promise);
+
+        if (answer == nullptr) {
+            logger->warn("webrtcbin could not create an answer for the WHEP offer");
+            detachPeer(peer);
+            return "";
+        }
+
+        promise = gst_promise_new();
+        g_signal_emit_by_name(peer.webrtc, "set-local-description", answer, promise);
+        gst_promise_wait(promise);
+        gst_promise_unref(promise);
+        gst_webrtc_session_description_free(answer);
+
+        if (!waitForGathering(peer.webrtc, 5000))
+            logger->warn("ICE gathering did not complete, answering with the candidates so far");
+
+        GstWebRTCSessionDescription *local = nullptr;
+        g_object_get(G_OBJECT(peer.webrtc), "local-description", &local, nullptr);
+
+        if (local == nullptr) {
+            detachPeer(peer);
+            return "";
+        }
+
+        gchar *local_text = gst_sdp_message_as_text(local->sdp);
+        string local_sdp = string(local_text);
+        g_free(local_text);
+        gst_webrtc_session_description_free(local);
+
+        session_id = peer.session_id;
+
+        {
+            std::lock_guard<std::mutex> lock(peers_mutex);
+
+            // Viewers that leave without a DELETE are noticed when ICE/DTLS fails or closes
+            g_object_set_data_full(G_OBJECT(peer.webrtc), "whep-session", g_strdup(session_id.c_str()), g_free);
+            peer.state_handler = g_signal_connect(peer.webrtc, "notify::connection-state",
+                                                  G_CALLBACK(onConnectionState), this);
+            peers[session_id] = peer;
+            logger->info("WHEP session '{}' started, {} viewer(s)", session_id, peers.size());
+        }
+
+        return local_sdp;
+    }
+
+    bool WhepEgress::removePeer(const string &session_id) {
+        WhepPeer peer;
+
+        {
+            std::lock_guard<std::mutex> lock(peers_mutex);
+            auto entry = peers.find(session_id);
+
+            if (entry == peers.end())
+                return false;
+
+            peer = entry->second;
+            peers.erase(entry);
+        }
+
+        logger->info("WHEP session '{}' ended", session_id);
+        g_signal_handler_disconnect(peer.webrtc, peer.state_handler);
+        detachPeer(peer);
+
+        return true;
+    }
+
+    void WhepEgress::onConnectionState(GstElement *webrtc, [[maybe_unused]] GParamSpec *spec, gpointer user_data) {
+        auto *egress = static_cast<WhepEgress *>(user_data);
+        GstWebRTCPeerConnectionState state;
+        g_object_get(G_OBJECT(webrtc), "connection-state", &state, nullptr);
+
+        if (state != GST_WEBRTC_PEER_CONNECTION_STATE_FAILED && state != GST_WEBRTC_PEER_CONNECTION_STATE_CLOSED)
+            return;
+
+        auto *session_id = static_cast<const gchar *>(g_object_get_data(G_OBJECT(webrtc), "whep-session"));
+
+        if (session_id != nullptr && egress->removePeer(session_id))
+            egress->logger->info("WHEP session '{}' dropped, connection {}", session_id,
+                                 state == GST_WEBRTC_PEER_CONNECTION_STATE_FAILED ? "failed" : "closed");
+    }
+
+    /**
+     * Unlink a peer once the tee pad is idle, then tear it down on the main loop
+     * @param peer
+     */
+    void WhepEgress::detachPeer(const WhepPeer &peer) {
+        auto *detached = new WhepPeer(peer);
+
+        gst_pad_add_probe(peer.tee_pad, GST_PAD_PROBE_TYPE_IDLE, unlinkPeer, detached, nullptr);
+    }
+
+    GstPadProbeReturn WhepEgress::unlinkPeer(GstPad *pad, [[maybe_unused]] GstPadProbeInfo *info,
+                                             gpointer user_data) {
+        auto *peer = static_cast<WhepPeer *>(user_data);
+        GstPad *queue_sink = gst_element_get_static_pad(peer->queue, "sink");
+
+        gst_pad_unlink(pad, queue_sink);
+        gst_object_unref(queue_sink);
+
+        // Changing state from a streaming thread can deadlock, leave that to the main loop
+        g_idle_add(releasePeer, peer);
+
+        return GST_PAD_PROBE_REMOVE;
+    }
+
+    gboolean WhepEgress::releasePeer(gpointer user_data) {
+        auto *peer = static_cast<WhepPeer *>(user_data);
+        GstElement *tee = gst_pad_get_parent_element(peer->tee_pad);
+
+        gst_element_release_request_pad(tee, peer->tee_pad);
+        gst_object_unref(peer->tee_pad);
+        gst_object_unref(tee);
+
+        gst_element_set_state(peer->webrtc, GST_STATE_NULL);
+        gst_element_set_state(peer->queue, GST_STATE_NULL);
+
+        GstElement *pipeline = GST_ELEMENT(gst_object_get_parent(GST_OBJECT(peer->webrtc)));
+        gst_bin_remove_many(GST_BIN(pipeline), peer->queue, peer->webrtc, nullptr);
+        gst_object_unref(pipeline);
+
+        delete peer;
+        return FALSE;
+    }
+
+    bool WhepEgress::waitForGathering(GstElement *webrtc, int timeout_ms) {
+        for (int waited = 0; waited < timeout_ms; waited += 10) {
+            GstWebRTCICEGatheringState state;
+            g_object_get(G_OBJECT(webrtc), "ice-gathering-state", &state, nullptr);
+
+            if (state == GST_WEBRTC_ICE_GATHERING_STATE_COMPLETE)
+                return true;
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+
+        return false;
+    }
+
+    string WhepEgress::generateSessionID() {
+        static const char hex[] = "0123456789abcdef";
+        std::random_device rd;
+        std::mt19937 gen(rd());
+        string session_id;
+
+        for (int i = 0; i < 16; i++)
+            session_id += hex[gen() % 16];
+
+        return session_id;
+    }
+}
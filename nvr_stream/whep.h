@@ -0,0 +1,68 @@
+//
+// Minimal WHEP endpoint serving the streamer's RTP output through webrtcbin
+//
+
+#ifndef NEVER_CLI_WHEP_H
+#define NEVER_CLI_WHEP_H
+
+#define GST_USE_UNSTABLE_API
+
+#include "../common.h"
+#include <gst/gst.h>
+#include <gst/sdp/sdp.h>
+#include <gst/webrtc/webrtc.h>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <thread>
+
+namespace nvr {
+
+    typedef struct WhepPeer {
+        string session_id;
+        GstElement *queue;
+        GstElement *webrtc;
+        GstPad *tee_pad;
+        gulong state_handler;
+    } WhepPeer;
+
+    class WhepEgress {
+    public:
+        WhepEgress(const nvr_logger &logger, int port, string stream_id);
+        ~WhepEgress();
+        WhepEgress(WhepEgress const &) = delete;
+        WhepEgress &operator=(WhepEgress const &) = delete;
+
+        bool start(GstElement *pipeline, GstElement *tee);
+        void stop();
+
+        string addPeer(const string &offer, string &session_id);
+        bool removePeer(const string &session_id);
+
+    private:
+        nvr_logger logger;
+        int port;
+        string stream_id;
+        int server_sock{-1};
+        std::atomic<bool> running = false;
+        std::thread server_thread;
+        std::mutex peers_mutex;
+        std::map<string, WhepPeer> peers;
+        GstElement *pipeline{};
+        GstElement *tee{};
+
+        void serve();
+        void handleConnection(int client_sock);
+        void sendResponse(int client_sock, int status, const string &reason, const string &body = "",
+                          const string &extra_headers = "");
+        void detachPeer(const WhepPeer &peer);
+
+        static bool waitForGathering(GstElement *webrtc, int timeout_ms);
+        static string generateSessionID();
+        static void onConnectionState(GstElement *webrtc, GParamSpec *spec, gpointer user_data);
+        static GstPadProbeReturn unlinkPeer(GstPad *pad, GstPadProbeInfo *info, gpointer user_data);
+        static gboolean releasePeer(gpointer user_data);
+    };
+}
+
+#endif //NEVER_CLI_WHEP_H
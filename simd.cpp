@@ -0,0 +1,73 @@
+//
+// SIMD helpers for comparing and measuring 8-bit image planes
+//
+
+#include "simd.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace nvr {
+
+    uint64_t sumAbsDiff(const uint8_t *a, const uint8_t *b, size_t length) {
+        uint64_t total = 0;
+        size_t i = 0;
+
+#if defined(__SSE2__)
+        __m128i accumulator = _mm_setzero_si128();
+
+        for (; i + 16 <= length; i += 16) {
+            __m128i left = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i));
+            __m128i right = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i));
+
+            // Two 64-bit lanes, each the SAD of eight bytes
+            accumulator = _mm_add_epi64(accumulator, _mm_sad_epu8(left, right));
+        }
+
+        total = (uint64_t) _mm_cvtsi128_si64(accumulator) +
+                (uint64_t) _mm_cvtsi128_si64(_mm_unpackhi_epi64(accumulator, accumulator));
+#endif
+
+        for (; i < length; i++)
+            total += a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+
+        return total;
+    }
+
+    PlaneStats planeStats(const uint8_t *plane, size_t length) {
+        PlaneStats stats{0, 0};
+        size_t i = 0;
+
+#if defined(__SSE2__)
+        const __m128i zero = _mm_setzero_si128();
+        __m128i sum = _mm_setzero_si128();
+        __m128i squares = _mm_setzero_si128();
+
+        for (; i + 16 <= length; i += 16) {
+            __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i *>(plane + i));
+            sum = _mm_add_epi64(sum, _mm_sad_epu8(pixels, zero));
+
+            // Widen to 16 bits, multiply-add pairs into 32-bit lanes (at most 2 * 255^2 each)
+            __m128i low = _mm_unpacklo_epi8(pixels, zero);
+            __m128i high = _mm_unpackhi_epi8(pixels, zero);
+            __m128i pairs = _mm_add_epi32(_mm_madd_epi16(low, low), _mm_madd_epi16(high, high));
+
+            // Widen to 64 bits before accumulating so large planes can't overflow
+            squares = _mm_add_epi64(squares, _mm_unpacklo_epi32(pairs, zero));
+            squares = _mm_add_epi64(squares, _mm_unpackhi_epi32(pairs, zero));
+        }
+
+        stats.sum = (uint64_t) _mm_cvtsi128_si64(sum) + (uint64_t) _mm_cvtsi128_si64(_mm_unpackhi_epi64(sum, sum));
+        stats.sum_squares = (uint64_t) _mm_cvtsi128_si64(squares) +
+                            (uint64_t) _mm_cvtsi128_si64(_mm_unpackhi_epi64(squares, squares));
+#endif
+
+        for (; i < length; i++) {
+            stats.sum += plane[i];
+            stats.sum_squares += (uint64_t) plane[i] * plane[i];
+        }
+
+        return stats;
+    }
+}
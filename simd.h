@@ -0,0 +1,36 @@
+//
+// SIMD helpers for comparing and measuring 8-bit image planes
+//
+
+#ifndef NEVER_CLI_SIMD_H
+#define NEVER_CLI_SIMD_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace nvr {
+
+    struct PlaneStats {
+        uint64_t sum;
+        uint64_t sum_squares;
+    };
+
+    /**
+     * Sum of absolute differences between two byte buffers
+     * @param a
+     * @param b
+     * @param length Bytes in each buffer
+     * @return
+     */
+    uint64_t sumAbsDiff(const uint8_t *a, const uint8_t *b, size_t length);
+
+    /**
+     * Sum and sum of squares of a byte buffer, for mean and variance
+     * @param plane
+     * @param length
+     * @return
+     */
+    PlaneStats planeStats(const uint8_t *plane, size_t length);
+}
+
+#endif //NEVER_CLI_SIMD_H
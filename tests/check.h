@@ -0,0 +1,19 @@
+//
+// Minimal assertions for the test executables, the first failed check ends the test with a non-zero exit
+//
+
+#ifndef NEVER_CLI_CHECK_H
+#define NEVER_CLI_CHECK_H
+
+#include <cstdio>
+#include <cstdlib>
+
+#define CHECK(condition)                                                                      \
+    do {                                                                                      \
+        if (!(condition)) {                                                                   \
+            std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            std::exit(1);                                                                     \
+        }                                                                                     \
+    } while (0)
+
+#endif //NEVER_CLI_CHECK_H
@@ -0,0 +1,44 @@
+//
+// placeStream against mock budgets and allocations, no state file involved
+//
+
+#include "check.h"
+#include "../nvr_stream/scheduler.h"
+
+using namespace nvr;
+
+static bool placedOn(const SlotPlacement &placement, const string &backend, int device) {
+    return placement.backend == backend && placement.device == device;
+}
+
+int main() {
+    const std::vector<string> candidates = {"nvidia", "u30", "vaapi"};
+
+    // No budget file: one device per backend, no limit, first candidate wins
+    CHECK(placedOn(placeStream(candidates, {}, {}), "nvidia", 0));
+    CHECK(placedOn(placeStream({}, {}, {}), software_backend, -1));
+
+    // Least loaded device of the preferred backend
+    std::map<string, SlotBudget> budget = {{"nvidia", {2, 2}}, {"u30", {1, 1}}};
+    std::vector<SlotAllocation> allocations = {{100, "a", "nvidia", 0}};
+    CHECK(placedOn(placeStream(candidates, budget, allocations), "nvidia", 1));
+
+    // A full backend falls through to the next candidate
+    allocations = {{100, "a", "nvidia", 0}, {101, "b", "nvidia", 0}, {102, "c", "nvidia", 1},
+                   {103, "d", "nvidia", 1}};
+    CHECK(placedOn(placeStream(candidates, budget, allocations), "u30", 0));
+
+    // Everything full goes to software
+    allocations.push_back({104, "e", "u30", 0});
+    budget["vaapi"] = {1, 0};
+    CHECK(placedOn(placeStream({"nvidia", "u30"}, budget, allocations), software_backend, -1));
+    CHECK(placedOn(placeStream(candidates, budget, allocations), "vaapi", 0));
+
+    // A backend budgeted with no devices is skipped, allocations on devices it no longer has are ignored
+    budget["nvidia"] = {0, 2};
+    CHECK(placedOn(placeStream({"nvidia"}, budget, {}), software_backend, -1));
+    budget = {{"u30", {1, 1}}};
+    CHECK(placedOn(placeStream({"u30"}, budget, {{100, "a", "u30", 3}}), "u30", 0));
+
+    return 0;
+}
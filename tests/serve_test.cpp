@@ -0,0 +1,116 @@
+//
+// Clip server over loopback: whole files, ranges, pipelined and half-closed requests, refusals
+//
+
+#include "check.h"
+#include "../nvr_serve/server.h"
+#include <fstream>
+#include <thread>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <spdlog/sinks/stdout_color_sinks.h>
+
+using namespace nvr;
+namespace fs = std::filesystem;
+
+// Loopback port the server under test listens on
+const int test_port = 18712;
+
+/**
+ * Send raw requests, shut down the sending side and read until the server closes the connection
+ * @param request
+ * @return
+ */
+static string exchange(const string &request) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(test_port);
+
+    CHECK(connect(sock, (struct sockaddr *) &address, sizeof(address)) == 0);
+    send(sock, request.data(), request.size(), MSG_NOSIGNAL);
+    shutdown(sock, SHUT_WR);
+
+    string response;
+    char buffer[65536];
+    ssize_t bytes;
+
+    while ((bytes = recv(sock, buffer, sizeof(buffer), 0)) > 0)
+        response.append(buffer, bytes);
+
+    close(sock);
+    return response;
+}
+
+static string body(const string &response) {
+    size_t end = response.find("\r\n\r\n");
+    CHECK(end != string::npos);
+    return response.substr(end + 4);
+}
+
+int main() {
+    auto logger = spdlog::stdout_color_mt("serve");
+
+    fs::path root = fs::temp_directory_path() / fmt::format("nvr-serve-test-{}", getpid());
+    fs::create_directories(root / "videos");
+    fs::create_directories(root / "logs");
+
+    // Several send chunks, so the body goes out over more than one wakeup
+    string clip(3 * 1024 * 1024 + 123, '\0');
+    for (size_t i = 0; i < clip.size(); i++)
+        clip[i] = (char) (i * 7 % 251);
+
+    std::ofstream(root / "videos" / "clip.mp4", std::ios::binary) << clip;
+    std::ofstream(root / "videos" / ".partial.mp4") << "working file";
+    std::ofstream(root / "logs" / "camera.log") << "not served";
+
+    Server server(logger, root.string(), 4);
+    CHECK(server.listen(std::to_string(test_port)));
+    std::thread server_thread([&server] { server.run(); });
+
+    // A keep-alive request from a client that already shut down its side still gets the whole file
+    string response = exchange("GET /videos/clip.mp4 HTTP/1.1\r\n\r\n");
+    CHECK(response.starts_with("HTTP/1.1 200"));
+    CHECK(response.find("Content-Type: video/mp4") != string::npos);
+    CHECK(body(response) == clip);
+
+    response = exchange("GET /videos/clip.mp4 HTTP/1.1\r\nRange: bytes=1000-1999\r\n\r\n");
+    CHECK(response.starts_with("HTTP/1.1 206"));
+    CHECK(response.find(fmt::format("Content-Range: bytes 1000-1999/{}", clip.size())) != string::npos);
+    CHECK(body(response) == clip.substr(1000, 1000));
+
+    response = exchange("GET /videos/clip.mp4 HTTP/1.1\r\nRange: bytes=-10\r\n\r\n");
+    CHECK(body(response) == clip.substr(clip.size() - 10));
+
+    response = exchange(fmt::format("GET /videos/clip.mp4 HTTP/1.1\r\nRange: bytes={}-\r\n\r\n", clip.size()));
+    CHECK(response.starts_with("HTTP/1.1 416"));
+
+    // Pipelined requests are answered in order, then the half-closed connection is closed
+    response = exchange("HEAD /videos/clip.mp4 HTTP/1.1\r\n\r\n"
+                        "GET /videos/clip.mp4 HTTP/1.1\r\nRange: bytes=0-4\r\n\r\n");
+    size_t second = response.find("HTTP/1.1 206");
+    CHECK(response.starts_with("HTTP/1.1 200"));
+    CHECK(second != string::npos);
+    CHECK(body(response.substr(second)) == clip.substr(0, 5));
+
+    // Only the media trees, nothing hidden, nothing outside the root
+    CHECK(exchange("GET /logs/camera.log HTTP/1.1\r\n\r\n").starts_with("HTTP/1.1 404"));
+    CHECK(exchange("GET /videos/.partial.mp4 HTTP/1.1\r\n\r\n").starts_with("HTTP/1.1 404"));
+    CHECK(exchange("GET /videos/../logs/camera.log HTTP/1.1\r\n\r\n").starts_with("HTTP/1.1 404"));
+    CHECK(exchange("GET /videos/missing.mp4 HTTP/1.1\r\n\r\n").starts_with("HTTP/1.1 404"));
+    CHECK(exchange("POST /videos/clip.mp4 HTTP/1.1\r\n\r\n").starts_with("HTTP/1.1 405"));
+    CHECK(exchange("nonsense\r\n\r\n").starts_with("HTTP/1.1 400"));
+    CHECK(exchange("GET /videos/clip.mp4 HTTP/1.1\r\nX-Padding: " + string(10000, 'a') + "\r\n\r\n")
+                  .starts_with("HTTP/1.1 431"));
+
+    // An incomplete request from a closed client gets no answer
+    CHECK(exchange("GET /videos/clip.mp4 HTTP/1.1\r\n").empty());
+
+    server.stop();
+    server_thread.join();
+    fs::remove_all(root);
+
+    return 0;
+}
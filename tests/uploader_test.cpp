@@ -0,0 +1,233 @@
+//
+// Clip uploads against a stand-in PUT receiver: chunking, retry, resume and clips swapped by compaction
+//
+
+#include "check.h"
+#include "../nvr_record/uploader.h"
+#include <fstream>
+#include <map>
+#include <thread>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <spdlog/sinks/stdout_color_sinks.h>
+
+using namespace nvr;
+namespace fs = std::filesystem;
+
+// Loopback port the stand-in receiver listens on
+const int test_port = 18713;
+
+/**
+ * Writes each PUT body at the offset its Content-Range gives, like a real receiver would.
+ * One connection at a time, each closed after its response.
+ */
+struct Receiver {
+    int listen_fd = -1;
+    std::thread thread;
+    std::mutex mutex;
+    std::map<string, string> files;
+    std::vector<string> requests;
+    // 1-based number of the request to answer with a 500, 0 for none
+    size_t fail_request = 0;
+
+    void start() {
+        listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int reuse = 1;
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+        struct sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(test_port);
+
+        CHECK(bind(listen_fd, (struct sockaddr *) &address, sizeof(address)) == 0);
+        CHECK(::listen(listen_fd, 16) == 0);
+
+        thread = std::thread([this] {
+            int fd;
+
+            while ((fd = accept(listen_fd, nullptr, nullptr)) >= 0) {
+                serve(fd);
+                close(fd);
+            }
+        });
+    }
+
+    void stop() {
+        shutdown(listen_fd, SHUT_RDWR);
+        close(listen_fd);
+        thread.join();
+    }
+
+    void serve(int fd) {
+        string input;
+        char buffer[65536];
+        ssize_t bytes;
+
+        while (input.find("\r\n\r\n") == string::npos && (bytes = recv(fd, buffer, sizeof(buffer), 0)) > 0)
+            input.append(buffer, bytes);
+
+        size_t end = input.find("\r\n\r\n");
+
+        if (end == string::npos)
+            return;
+
+        string head = input.substr(0, end);
+        string body = input.substr(end + 4);
+        string target = head.substr(4, head.find(' ', 4) - 4);
+        size_t length = std::stoul(header(head, "Content-Length"));
+        long first = 0, last = 0, total = 0;
+        CHECK(sscanf(header(head, "Content-Range").c_str(), "bytes %ld-%ld/%ld", &first, &last, &total) == 3);
+        CHECK(head.starts_with("PUT "));
+
+        while (body.size() < length && (bytes = recv(fd, buffer, sizeof(buffer), 0)) > 0)
+            body.append(buffer, bytes);
+
+        CHECK(body.size() == length && (long) length == last - first + 1);
+
+        bool fail;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            requests.push_back(target);
+            fail = requests.size() == fail_request;
+
+            if (!fail) {
+                string &file = files[target];
+                file.resize(total);
+                file.replace(first, length, body);
+            }
+        }
+
+        string response = fail ? "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 0\r\nConnection: close\r\n\r\n" :
+                          "HTTP/1.1 204 No Content\r\nConnection: close\r\n\r\n";
+        send(fd, response.data(), response.size(), MSG_NOSIGNAL);
+    }
+
+    static string header(const string &head, const string &name) {
+        size_t start = head.find("\r\n" + name + ": ");
+        CHECK(start != string::npos);
+        start += name.size() + 4;
+        return head.substr(start, head.find("\r\n", start) - start);
+    }
+
+    string file(const string &target) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return files.count(target) > 0 ? files[target] : "";
+    }
+};
+
+static string pattern(size_t size, int seed) {
+    string content(size, '\0');
+
+    for (size_t i = 0; i < size; i++)
+        content[i] = (char) ((i + seed) * 31 % 251);
+
+    return content;
+}
+
+static void writeFile(const fs::path &file_path, const string &content) {
+    std::ofstream(file_path, std::ios::binary | std::ios::trunc) << content;
+}
+
+static string readFile(const fs::path &file_path) {
+    std::ifstream file(file_path, std::ios::binary);
+    return {std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+}
+
+/**
+ * Poll until the receiver holds the content and the queue file is empty
+ * @return False after a minute
+ */
+static bool waitForUpload(Receiver &receiver, const string &target, const string &content, const fs::path &queue) {
+    for (int i = 0; i < 600; i++) {
+        if (receiver.file(target) == content && readFile(queue) == "[]")
+            return true;
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+
+    return false;
+}
+
+int main() {
+    auto logger = spdlog::stdout_color_mt("upload");
+    Metrics metrics(logger, "test");
+
+    fs::path root = fs::temp_directory_path() / fmt::format("nvr-upload-test-{}", getpid());
+    fs::path queue = root / "logs" / "uploads.json";
+    fs::create_directories(root / "videos");
+
+    Receiver receiver;
+    receiver.start();
+
+    UploadConfig config{true, fmt::format("http://127.0.0.1:{}/nvr", test_port), 0, 1, {}, ""};
+
+    // Three chunks with the second one failing once, retried from where it left off
+    string first = pattern(2 * 1024 * 1024 + 4321, 1);
+    writeFile(root / "videos" / "a.mp4", first);
+    receiver.fail_request = 2;
+
+    {
+        Uploader uploader(logger, "test", config, queue.string(), metrics);
+        uploader.start();
+        uploader.enqueue((root / "videos" / "a.mp4").string());
+
+        CHECK(waitForUpload(receiver, "/nvr/test/a.mp4", first, queue));
+    }
+
+    CHECK(receiver.requests.size() == 4);
+
+    // Clips queued while stopped are picked up by the next start, from the saved queue
+    string second = pattern(300000, 2);
+    string third = pattern(500000, 3);
+    writeFile(root / "videos" / "b.mp4", second);
+    writeFile(root / "videos" / "c.mp4", third);
+
+    {
+        Uploader uploader(logger, "test", config, queue.string(), metrics);
+        uploader.enqueue((root / "videos" / "b.mp4").string());
+        uploader.enqueue((root / "videos" / "c.mp4").string());
+        uploader.enqueue((root / "videos" / "c.mp4").string());
+    }
+
+    string saved = readFile(queue);
+    CHECK(saved.find("b.mp4") != string::npos);
+    CHECK(saved.find("c.mp4") == saved.rfind("c.mp4"));
+
+    // Compaction merges a (already sent) with b and c (still queued) into a.mp4 and removes b and c
+    string merged = first + second + third;
+    writeFile(root / "videos" / "a.mp4", merged);
+
+    {
+        Uploader uploader(logger, "test", config, queue.string(), metrics);
+        uploader.start();
+
+        // While the uploader runs, as the compactor does it
+        std::vector<string> clips = {(root / "videos" / "a.mp4").string(), (root / "videos" / "b.mp4").string(),
+                                     (root / "videos" / "c.mp4").string()};
+        uploader.replace(clips.front(), clips);
+        fs::remove(root / "videos" / "b.mp4");
+        fs::remove(root / "videos" / "c.mp4");
+
+        CHECK(waitForUpload(receiver, "/nvr/test/a.mp4", merged, queue));
+    }
+
+    // Whatever of b and c went out before the swap was complete, nothing is missing from a.mp4
+    CHECK(receiver.file("/nvr/test/b.mp4").empty() || receiver.file("/nvr/test/b.mp4") == second);
+    CHECK(receiver.file("/nvr/test/c.mp4").empty() || receiver.file("/nvr/test/c.mp4") == third);
+
+    // Nothing queued for the merge: all its clips were sent, the merged file isn't sent again
+    {
+        Uploader uploader(logger, "test", config, queue.string(), metrics);
+        uploader.start();
+        uploader.replace((root / "videos" / "a.mp4").string(), {(root / "videos" / "a.mp4").string()});
+    }
+
+    CHECK(readFile(queue) == "[]");
+
+    receiver.stop();
+    fs::remove_all(root);
+
+    return 0;
+}
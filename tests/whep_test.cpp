@@ -0,0 +1,143 @@
+//
+// WHEP endpoint over loopback: offer/answer, DELETE, and malformed or oversized requests
+//
+
+#include "check.h"
+#include "../nvr_stream/whep.h"
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <spdlog/sinks/stdout_color_sinks.h>
+
+using namespace nvr;
+
+// Loopback port the endpoint under test listens on
+const int test_port = 18711;
+
+/**
+ * Send a raw request and read the response until the server closes the connection
+ * @param request
+ * @return
+ */
+static string exchange(const string &request) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(test_port);
+
+    CHECK(connect(sock, (struct sockaddr *) &address, sizeof(address)) == 0);
+    send(sock, request.data(), request.size(), MSG_NOSIGNAL);
+    shutdown(sock, SHUT_WR);
+
+    string response;
+    char buffer[4096];
+    ssize_t bytes;
+
+    while ((bytes = recv(sock, buffer, sizeof(buffer), 0)) > 0)
+        response.append(buffer, bytes);
+
+    close(sock);
+    return response;
+}
+
+static string post(const string &body) {
+    return exchange("POST /whep/test HTTP/1.1\r\nContent-Type: application/sdp\r\nContent-Length: " +
+                    std::to_string(body.size()) + "\r\n\r\n" + body);
+}
+
+/**
+ * A receive-only viewer offer from a second webrtcbin, as a browser would send
+ * @param viewer
+ * @return
+ */
+static string createOffer(GstElement *viewer) {
+    GstCaps *caps = gst_caps_from_string("application/x-rtp,media=video,encoding-name=VP8,payload=96,clock-rate=90000");
+    GstWebRTCRTPTransceiver *transceiver = nullptr;
+    g_signal_emit_by_name(viewer, "add-transceiver", GST_WEBRTC_RTP_TRANSCEIVER_DIRECTION_RECVONLY, caps,
+                          &transceiver);
+    gst_caps_unref(caps);
+    gst_object_unref(transceiver);
+
+    GstWebRTCSessionDescription *offer = nullptr;
+    GstPromise *promise = gst_promise_new();
+    g_signal_emit_by_name(viewer, "create-offer", nullptr, promise);
+    CHECK(gst_promise_wait(promise) == GST_PROMISE_RESULT_REPLIED);
+    gst_structure_get(gst_promise_get_reply(promise), "offer", GST_TYPE_WEBRTC_SESSION_DESCRIPTION, &offer, nullptr);
+    gst_promise_unref(promise);
+    CHECK(offer != nullptr);
+
+    gchar *text = gst_sdp_message_as_text(offer->sdp);
+    string offer_sdp = text;
+    g_free(text);
+    gst_webrtc_session_description_free(offer);
+
+    return offer_sdp;
+}
+
+int main(int argc, char *argv[]) {
+    gst_init(&argc, &argv);
+    auto logger = spdlog::stdout_color_mt("whep");
+
+    GMainLoop *loop = g_main_loop_new(nullptr, false);
+    std::thread loop_thread([loop] { g_main_loop_run(loop); });
+
+    GstElement *pipeline = gst_parse_launch(
+            "videotestsrc is-live=true ! video/x-raw,width=320,height=240 ! vp8enc deadline=1 ! "
+            "rtpvp8pay pt=96 ! tee name=egress allow-not-linked=true ! queue ! fakesink sync=false", nullptr);
+    CHECK(pipeline != nullptr);
+    GstElement *tee = gst_bin_get_by_name(GST_BIN(pipeline), "egress");
+    gst_element_set_state(pipeline, GST_STATE_PLAYING);
+
+    GstElement *viewer_pipeline = gst_pipeline_new("viewer");
+    GstElement *viewer = gst_element_factory_make("webrtcbin", nullptr);
+    CHECK(viewer != nullptr);
+    gst_bin_add(GST_BIN(viewer_pipeline), viewer);
+    gst_element_set_state(viewer_pipeline, GST_STATE_PLAYING);
+
+    WhepEgress egress(logger, test_port, "test");
+    CHECK(egress.start(pipeline, tee));
+
+    // Offer/answer
+    string response = post(createOffer(viewer));
+    CHECK(response.starts_with("HTTP/1.1 201"));
+    CHECK(response.find("Content-Type: application/sdp") != string::npos);
+
+    size_t location = response.find("Location: /whep/test/");
+    CHECK(location != string::npos);
+    string session_id = response.substr(location + 21, response.find("\r\n", location) - location - 21);
+
+    string answer = response.substr(response.find("\r\n\r\n") + 4);
+    GstSDPMessage *answer_sdp = nullptr;
+    CHECK(gst_sdp_message_new_from_text(answer.c_str(), &answer_sdp) == GST_SDP_OK);
+    CHECK(gst_sdp_message_medias_len(answer_sdp) == 1);
+    gst_sdp_message_free(answer_sdp);
+    CHECK(answer.find("VP8/90000") != string::npos);
+
+    // Teardown by DELETE, once
+    CHECK(exchange("DELETE /whep/test/" + session_id + " HTTP/1.1\r\n\r\n").starts_with("HTTP/1.1 200"));
+    CHECK(exchange("DELETE /whep/test/" + session_id + " HTTP/1.1\r\n\r\n").starts_with("HTTP/1.1 404"));
+
+    // Malformed and oversized requests are refused without taking the server down
+    CHECK(exchange("POST /whep/test HTTP/1.1\r\nContent-Length: nope\r\n\r\n").starts_with("HTTP/1.1 400"));
+    CHECK(exchange("POST /whep/test HTTP/1.1\r\nContent-Length: 99999999999999999999999\r\n\r\n")
+                  .starts_with("HTTP/1.1 400"));
+    CHECK(exchange("POST /whep/test HTTP/1.1\r\nContent-Length: 10485760\r\n\r\n").starts_with("HTTP/1.1 413"));
+    CHECK(exchange("POST /whep/test HTTP/1.1\r\nContent-Length: 5\r\n\r\nv=0").starts_with("HTTP/1.1 400"));
+    CHECK(post("not sdp").starts_with("HTTP/1.1 400"));
+    CHECK(exchange("OPTIONS /whep/test HTTP/1.1\r\n\r\n").starts_with("HTTP/1.1 204"));
+
+    egress.stop();
+
+    gst_element_set_state(viewer_pipeline, GST_STATE_NULL);
+    gst_object_unref(viewer_pipeline);
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+    gst_object_unref(tee);
+    gst_object_unref(pipeline);
+
+    g_main_loop_quit(loop);
+    loop_thread.join();
+    g_main_loop_unref(loop);
+
+    return 0;
+}